@@ -5,6 +5,7 @@ import re
 
 # Protubuf imports with regard to python seem to be crazy
 # We want to put all protos into a module, so fix all imports
+# Well-known types are left alone, they come with the protobuf package
 
 pat = re.compile(r"""import "([^"]+)";\n""")
 
@@ -12,7 +13,7 @@ pat = re.compile(r"""import "([^"]+)";\n""")
 def copy(inf, outf, prefix):
     for line in inf:
         m = pat.match(line)
-        if m:
+        if m and not m.group(1).startswith("google/protobuf/"):
             outf.write(f"import \"{prefix}/{m.group(1)}\";\n")
         else:
             outf.write(line)
@@ -4,30 +4,39 @@
 
 #include "analyzer_cache.h"
 #include "util/logging.hpp"
+#include <thread>
 
 namespace jumanpp {
 namespace grpc {
 
 Status CachedAnalyzer::readInput(const AnalysisRequest &req, const AnalyzerCache &cache) {
-  if (!reader_ || lastRequestType != req.type()) {
-    switch(req.type()) {
-      case RequestType::Normal: {
-        reader_.reset(new core::input::PlainStreamReader);
-        break;
+  auto& sentence = req.sentence();
+  switch(req.type()) {
+    case RequestType::Normal: {
+      // the first line only, as PlainStreamReader would read it
+      auto end = sentence.find('\n');
+      if (end == std::string::npos) {
+        end = sentence.size();
       }
-      case RequestType::PartialAnnotation: {
+      input_ = StringPiece{sentence.data(), sentence.data() + end};
+      break;
+    }
+    case RequestType::PartialAnnotation: {
+      if (!reader_) {
         auto reader = new core::input::PexStreamReader;
         reader_.reset(reader);
         JPP_RETURN_IF_ERROR(reader->initialize(cache.cachedReader()));
-        break;
       }
-      default:
-        return JPPS_NOT_IMPLEMENTED;
+      inputBuf_.reset(sentence);
+      inputStream_.clear();
+      JPP_RETURN_IF_ERROR(reader_->readExample(&inputStream_));
+      break;
     }
+    default:
+      return JPPS_NOT_IMPLEMENTED;
   }
+  readerType_ = req.type();
 
-  std::istringstream ss{req.sentence()};
-  JPP_RETURN_IF_ERROR(reader_->readExample(&ss));
   comment_ = req.key();
   lastUsage_ = Clock::now();
 
@@ -35,18 +44,25 @@ Status CachedAnalyzer::readInput(const AnalysisRequest &req, const AnalyzerCache
 }
 
 Status CachedAnalyzer::analyze() {
-  JPP_RETURN_IF_ERROR(reader_->analyzeWith(&analyzer_));
+  if (readerType_ == RequestType::Normal) {
+    JPP_RETURN_IF_ERROR(analyzer_->analyze(input_));
+  } else {
+    JPP_RETURN_IF_ERROR(reader_->analyzeWith(analyzer_.get()));
+  }
   lastUsage_ = Clock::now();
-  state_ = AnalyzerState::WithResult;
+  state_.store(AnalyzerState::WithResult, std::memory_order_release);
   return Status::Ok();
 }
 
 bool CachedAnalyzer::isAvailableFor(const JumanppConfig &cfg, const AnalysisRequest &req, bool allFeatures) const {
-  auto st = state_;
+  auto st = state_.load(std::memory_order_relaxed);
   if (st == AnalyzerState::InUse || st == AnalyzerState::WithResult) {
     return false;
   }
+  return isConfiguredFor(cfg, req, allFeatures);
+}
 
+bool CachedAnalyzer::isConfiguredFor(const JumanppConfig &cfg, const AnalysisRequest &req, bool allFeatures) const {
   if (lastRequestType != req.type()) {
     return false;
   }
@@ -85,66 +101,616 @@ void CachedAnalyzer::setBaseConfig(const core::analysis::AnalyzerConfig &anaconf
 }
 
 Status CachedAnalyzer::buildAnalyzer(const core::JumanppEnv &env) {
+  if (!analyzer_) {
+    analyzer_.reset(new core::analysis::Analyzer);
+  }
   auto scorer = env.scorers();
   if (scoringConfig.numScorers != scorer->numScorers()) {
     cachedDef_.feature = scorer->feature;
     cachedDef_.scoreWeights.clear();
     cachedDef_.scoreWeights.push_back(scorer->scoreWeights.front());
-    JPP_RETURN_IF_ERROR(analyzer_.initialize(env.coreHolder(), analyzerConfig, scoringConfig, &cachedDef_));
+    JPP_RETURN_IF_ERROR(analyzer_->initialize(env.coreHolder(), analyzerConfig, scoringConfig, &cachedDef_));
   } else {
-    JPP_RETURN_IF_ERROR(analyzer_.initialize(env.coreHolder(), analyzerConfig, scoringConfig, scorer));
+    JPP_RETURN_IF_ERROR(analyzer_->initialize(env.coreHolder(), analyzerConfig, scoringConfig, scorer));
   }
   lastUsage_ = Clock::now();
   return Status::Ok();
 }
 
-void AnalyzerCache::release(CachedAnalyzer *analyzer) {
-  std::lock_guard<std::mutex> guard{mutex_};
-  analyzer->state_ = AnalyzerState::NotInUse;
+bool CachedAnalyzer::hasSameShape(const JumanppConfig &cfg, int numScorers, bool allFeatures) const {
+  return analyzer_ &&
+         scoringConfig.beamSize == cfg.local_beam() &&
+         scoringConfig.numScorers == numScorers &&
+         analyzerConfig.storeAllPatterns == allFeatures;
 }
 
-CachedAnalyzer *AnalyzerCache::acquire(const JumanppConfig &cfg, const AnalysisRequest &req, bool allFeatures) {
-  std::lock_guard<std::mutex> guard{mutex_};
+Status CachedAnalyzer::reconfigure(const JumanppConfig &cfg) {
+  JPP_RETURN_IF_ERROR(analyzer_->setGlobalBeam(cfg.global_beam_left(), cfg.global_beam_check(), cfg.global_beam_right()));
+  setProtoConfig(cfg);
+  lastUsage_ = Clock::now();
+  return Status::Ok();
+}
+
+void CachedAnalyzer::destroyAnalyzer() {
+  analyzer_.reset();
+  reader_.reset();
+  input_ = StringPiece{};
+  comment_.clear();
+  comment_.shrink_to_fit();
+  lastUsage_ = TimePoint::min();
+}
+
+namespace {
+
+constexpr u64 IndexMask = 0xffffffffULL;
+
+// upper half of a list head is a modification counter, lower is analyzer index + 1
+inline u64 nextHead(u64 head, u64 index) {
+  return (((head >> 32) + 1) << 32) | index;
+}
+
+inline u64 mixKey(u64 seed, u64 value) {
+  u64 h = seed ^ (value + 0x9e3779b97f4a7c15ULL + (seed << 6) + (seed >> 2));
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
 
-  CachedAnalyzer* available = nullptr;
-  TimePoint lastUsage = TimePoint::max();
+} // namespace
 
-  for (auto& v: cache_) {
-    if (v->isAvailableFor(cfg, req, allFeatures)) {
-      // non-used compatible analyzer is returned immediately
-      v->state_ = AnalyzerState::InUse;
-      return v.get();
+u64 AnalyzerKey::configHash(const JumanppConfig &cfg, bool ignoreRnn) {
+  u64 beams = (static_cast<u64>(static_cast<u32>(cfg.local_beam())) << 32) |
+              static_cast<u32>(cfg.global_beam_left());
+  u64 rightBeams = (static_cast<u64>(static_cast<u32>(cfg.global_beam_right())) << 32) |
+                   static_cast<u32>(cfg.global_beam_check());
+  return mixKey(mixKey(ignoreRnn ? 1 : 0, beams), rightBeams);
+}
+
+AnalyzerKey AnalyzerKey::of(u64 configHash, RequestType type, bool allFeatures) {
+  u64 flags = (static_cast<u64>(type) << 1) | (allFeatures ? 1 : 0);
+  u64 hash = mixKey(configHash, flags);
+  if (hash == 0) { // zero marks an empty bucket
+    hash = 1;
+  }
+  return AnalyzerKey{hash};
+}
+
+AnalyzerKey AnalyzerKey::of(const JumanppConfig &cfg, RequestType type, bool ignoreRnn, bool allFeatures) {
+  return of(configHash(cfg, ignoreRnn), type, allFeatures);
+}
+
+Status AnalyzerShard::initialize(const core::JumanppEnv *env, const core::analysis::AnalyzerConfig *defaultConfig,
+                                 int capacity, int minSize, int node, u32 firstId) {
+  env_ = env;
+  defaultCfg_ = defaultConfig;
+  minSize_ = minSize;
+  node_ = node;
+
+  // there always are more buckets than analyzers, so a new config can always get a bucket
+  u32 numBuckets = 16;
+  while (numBuckets < static_cast<u32>(capacity) * 2) {
+    numBuckets <<= 1;
+  }
+  buckets_.reset(new AnalyzerBucket[numBuckets]);
+  bucketMask_ = numBuckets - 1;
+
+  links_.reset(new std::atomic<u32>[capacity]);
+  idle_.reserve(static_cast<size_t>(capacity));
+  for (int i = 0; i < capacity; ++i) {
+    cache_.emplace_back(new CachedAnalyzer);
+    cache_.back()->index_ = static_cast<u32>(i);
+    cache_.back()->id_ = firstId + static_cast<u32>(i);
+    cache_.back()->shard_ = this;
+    links_[i].store(0, std::memory_order_relaxed);
+  }
+
+  for (int i = capacity; i > 0; --i) {
+    push(&fresh_, cache_[i - 1].get());
+  }
+
+  return Status::Ok();
+}
+
+void AnalyzerShard::push(std::atomic<u64> *head, CachedAnalyzer *analyzer) {
+  auto& link = links_[analyzer->index_];
+  u64 current = head->load(std::memory_order_relaxed);
+  u64 next;
+  do {
+    link.store(static_cast<u32>(current & IndexMask), std::memory_order_relaxed);
+    next = nextHead(current, analyzer->index_ + 1);
+  } while (!head->compare_exchange_weak(current, next, std::memory_order_release, std::memory_order_relaxed));
+}
+
+CachedAnalyzer *AnalyzerShard::pop(std::atomic<u64> *head) {
+  u64 current = head->load(std::memory_order_acquire);
+  u64 next;
+  do {
+    u64 index = current & IndexMask;
+    if (index == 0) {
+      return nullptr;
     }
+    next = nextHead(current, links_[index - 1].load(std::memory_order_relaxed));
+  } while (!head->compare_exchange_weak(current, next, std::memory_order_acquire, std::memory_order_acquire));
+  return cache_[(current & IndexMask) - 1].get();
+}
 
-    if (v->state_ == AnalyzerState::Uninitialized) {
-      // non-initialized analyzer is returned with the highest priority
-      available = v.get();
+i32 AnalyzerShard::findBucket(AnalyzerKey key) const {
+  u32 start = static_cast<u32>(key.value() ^ (key.value() >> 32));
+  for (u32 i = 0; i <= bucketMask_; ++i) {
+    u32 idx = (start + i) & bucketMask_;
+    u64 bucketKey = buckets_[idx].key.load(std::memory_order_acquire);
+    if (bucketKey == key.value()) {
+      return static_cast<i32>(idx);
+    }
+    if (bucketKey == 0) {
+      return -1;
+    }
+  }
+  return -1;
+}
+
+// Must be called under the mutex.
+// A bucket without assigned analyzers can be reused for a different key.
+// Only the first free or reusable bucket in the probe sequence is taken,
+// so lookups, which stop at the first empty bucket, will always find it.
+i32 AnalyzerShard::assignBucket(AnalyzerKey key) {
+  u32 start = static_cast<u32>(key.value() ^ (key.value() >> 32));
+  i32 candidate = -1;
+  for (u32 i = 0; i <= bucketMask_; ++i) {
+    u32 idx = (start + i) & bucketMask_;
+    auto& bucket = buckets_[idx];
+    u64 bucketKey = bucket.key.load(std::memory_order_relaxed);
+    if (bucketKey == key.value()) {
+      candidate = static_cast<i32>(idx);
+      break;
+    }
+    if (candidate == -1 && (bucketKey == 0 || bucket.assigned.load(std::memory_order_relaxed) == 0)) {
+      candidate = static_cast<i32>(idx);
+    }
+    if (bucketKey == 0) {
       break;
     }
+  }
+
+  if (candidate != -1) {
+    auto& bucket = buckets_[candidate];
+    bucket.key.store(key.value(), std::memory_order_release);
+    bucket.assigned.fetch_add(1, std::memory_order_relaxed);
+  }
+  return candidate;
+}
+
+CachedAnalyzer *AnalyzerShard::popFromBucket(i32 bucket, const JumanppConfig &cfg, const AnalysisRequest &req,
+                                             bool allFeatures) {
+  auto& head = buckets_[bucket].head;
+  auto an = pop(&head);
+  if (an == nullptr) {
+    return nullptr;
+  }
+
+  if (!an->isAvailableFor(cfg, req, allFeatures)) {
+    // fingerprint collision, will be rebuilt by the slow path
+    push(&head, an);
+    return nullptr;
+  }
 
-    if (v->state_ != AnalyzerState::InUse && lastUsage > v->lastUsage_) {
-      // otherwise try to find one not used for a longest time
-      available = v.get();
-      lastUsage = v->lastUsage_;
+  an->state_.store(AnalyzerState::InUse, std::memory_order_relaxed);
+  an->source_ = ResultSource::Reuse;
+  an->reuses_.store(an->reuses_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+  return an;
+}
+
+void AnalyzerShard::release(CachedAnalyzer *analyzer) {
+  analyzer->state_.store(AnalyzerState::NotInUse, std::memory_order_relaxed);
+  push(&buckets_[analyzer->bucket_].head, analyzer);
+}
+
+CachedAnalyzer *AnalyzerShard::tryAcquire(AnalyzerKey key, const JumanppConfig &cfg, const AnalysisRequest &req,
+                                          bool allFeatures) {
+  auto bucket = findBucket(key);
+  if (bucket == -1) {
+    return nullptr;
+  }
+  return popFromBucket(bucket, cfg, req, allFeatures);
+}
+
+CachedAnalyzer *AnalyzerShard::acquireSlow(AnalyzerKey key, const JumanppConfig &cfg, const AnalysisRequest &req,
+                                           bool allFeatures, bool build, AcquireStatus *status) {
+  std::unique_lock<std::mutex> lock{mutex_};
+  *status = AcquireStatus::Ok;
+
+  // someone could have released a compatible analyzer while we were waiting
+  auto bucket = findBucket(key);
+  if (bucket != -1) {
+    auto an = popFromBucket(bucket, cfg, req, allFeatures);
+    if (an != nullptr) {
+      return an;
     }
   }
 
+  // non-initialized analyzer is used with the highest priority
+  CachedAnalyzer* available = build ? pop(&fresh_) : nullptr;
+  bool wasFresh = available != nullptr;
+  bool reconfigure = false;
+  int numScorers = cfg.ignore_rnn() ? 1 : env_->scorers()->numScorers();
+
   if (available == nullptr) {
+    // otherwise take one which can be reconfigured without rebuilding,
+    // or the idle one which was not used for the longest time.
+    // Heads of the stacks are the most recently released analyzers,
+    // so the stacks are emptied and get the rest back in the same order.
+    idle_.clear();
+    for (u32 i = 0; i <= bucketMask_ && !reconfigure; ++i) {
+      auto& head = buckets_[i].head;
+      for (auto candidate = pop(&head); candidate != nullptr; candidate = pop(&head)) {
+        idle_.push_back(candidate);
+        if (candidate->hasSameShape(cfg, numScorers, allFeatures)) {
+          available = candidate;
+          reconfigure = true;
+          break;
+        }
+        if (build && (available == nullptr || candidate->lastUsage_ < available->lastUsage_)) {
+          available = candidate;
+        }
+      }
+    }
+    for (auto it = idle_.rbegin(); it != idle_.rend(); ++it) {
+      if (*it != available) {
+        push(&buckets_[(*it)->bucket_].head, *it);
+      }
+    }
+  }
+
+  if (available == nullptr) {
+    *status = AcquireStatus::Busy;
     return nullptr;
   }
 
-  available->setBaseConfig(defaultCfg_, *env_, allFeatures);
-  available->setProtoConfig(cfg);
-  Status s = available->buildAnalyzer(*env_);
+  if (available->bucket_ != -1) {
+    buckets_[available->bucket_].assigned.fetch_sub(1, std::memory_order_relaxed);
+  }
+  available->bucket_ = assignBucket(key);
+  available->key_ = key;
+  available->lastRequestType = req.type();
+  available->state_.store(AnalyzerState::InUse, std::memory_order_relaxed);
+  lock.unlock();
+
+  Status s = Status::Ok();
+  if (available->bucket_ == -1) {
+    s = JPPS_INVALID_STATE << "no free analyzer buckets";
+  } else {
+    if (reconfigure) {
+      s = available->reconfigure(cfg);
+      if (s) {
+        available->source_ = ResultSource::Reconfigure;
+        reconfigures_.fetch_add(1, std::memory_order_relaxed);
+      } else if (build) {
+        LOG_WARN() << "Failed to reconfigure analyzer, rebuilding it: " << s;
+      }
+    }
+
+    if (build && (!reconfigure || !s)) {
+      available->setBaseConfig(*defaultCfg_, *env_, allFeatures);
+      available->setProtoConfig(cfg);
+      auto buildStart = Clock::now();
+      s = available->buildAnalyzer(*env_);
+      Metrics::local().builds.record(Metrics::micros(Clock::now() - buildStart));
+      available->source_ = ResultSource::Rebuild;
+      rebuilds_.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+
+  if (s && wasFresh) {
+    live_.fetch_add(1, std::memory_order_relaxed);
+  }
+
   if (!s) {
     LOG_ERROR() << "Failed to init analyzer: " << s;
+    lock.lock();
+    if (available->bucket_ != -1) {
+      buckets_[available->bucket_].assigned.fetch_sub(1, std::memory_order_relaxed);
+      available->bucket_ = -1;
+    }
+    if (!wasFresh) {
+      live_.fetch_sub(1, std::memory_order_relaxed);
+    }
+    available->destroyAnalyzer();
+    available->state_.store(AnalyzerState::Uninitialized, std::memory_order_relaxed);
+    push(&fresh_, available);
+    lock.unlock();
+    // the thief goes on with other shards or waits
+    *status = build ? AcquireStatus::BuildFailed : AcquireStatus::Busy;
     return nullptr;
   }
 
-  available->state_ = AnalyzerState::InUse;
   return available;
 }
 
 
+int AnalyzerShard::shrinkIdle(TimePoint threshold) {
+  std::lock_guard<std::mutex> guard{mutex_};
+  int destroyed = 0;
+  std::vector<CachedAnalyzer*> idle;
+
+  for (u32 i = 0; i <= bucketMask_; ++i) {
+    auto& bucket = buckets_[i];
+    if (bucket.assigned.load(std::memory_order_relaxed) == 0) {
+      continue;
+    }
+
+    // take all idle analyzers from the bucket, the oldest ones are the last
+    idle.clear();
+    while (auto an = pop(&bucket.head)) {
+      idle.push_back(an);
+    }
+
+    for (auto it = idle.rbegin(); it != idle.rend(); ++it) {
+      auto an = *it;
+      if (an->lastUsage_ < threshold && live_.load(std::memory_order_relaxed) > minSize_) {
+        bucket.assigned.fetch_sub(1, std::memory_order_relaxed);
+        an->bucket_ = -1;
+        an->destroyAnalyzer();
+        an->state_.store(AnalyzerState::Uninitialized, std::memory_order_relaxed);
+        live_.fetch_sub(1, std::memory_order_relaxed);
+        push(&fresh_, an);
+        ++destroyed;
+      } else {
+        push(&bucket.head, an);
+      }
+    }
+  }
+
+  return destroyed;
+}
+
+void AnalyzerShard::addStats(AnalyzerCacheStats *stats) const {
+  stats->rebuilds += rebuilds_.load(std::memory_order_relaxed);
+  stats->reconfigures += reconfigures_.load(std::memory_order_relaxed);
+  for (auto& an: cache_) {
+    stats->reuses += an->reuses_.load(std::memory_order_relaxed);
+    stats->states[static_cast<int>(an->state_.load(std::memory_order_relaxed))] += 1;
+  }
+  stats->live += live_.load(std::memory_order_relaxed);
+}
+
+thread_local int AnalyzerCache::currentShard_ = 0;
+
+Status AnalyzerCache::initialize(const core::JumanppEnv *env, const core::analysis::AnalyzerConfig &defaultConfig,
+                                 const AnalyzerPoolConfig &poolConfig) {
+  if (poolConfig.maxSize <= 0 || poolConfig.minSize > poolConfig.maxSize) {
+    return JPPS_INVALID_PARAMETER << "invalid analyzer pool size, min=" << poolConfig.minSize
+                                  << " max=" << poolConfig.maxSize;
+  }
+
+  defaultCfg_ = defaultConfig;
+  poolCfg_ = poolConfig;
+  hasRnn_ = env->scorers()->numScorers() > 1;
+  JPP_RETURN_IF_ERROR(cachedReader_.initialize(*env->coreHolder()));
+
+  std::vector<int> nodes = poolConfig.shardNodes;
+  if (nodes.empty()) {
+    nodes.push_back(0);
+  }
+  int numShards = static_cast<int>(nodes.size());
+  u32 firstId = 0;
+  for (int i = 0; i < numShards; ++i) {
+    int capacity = poolConfig.maxSize / numShards + (i < poolConfig.maxSize % numShards ? 1 : 0);
+    int minSize = poolConfig.minSize / numShards + (i < poolConfig.minSize % numShards ? 1 : 0);
+    shards_.emplace_back(new AnalyzerShard);
+    JPP_RETURN_IF_ERROR(shards_.back()->initialize(env, &defaultCfg_, capacity, minSize, nodes[i], firstId));
+    firstId += static_cast<u32>(capacity);
+  }
+
+  // shards of the same node are robbed first, neighbours are tried in different order by different shards
+  victims_.resize(numShards);
+  for (int i = 0; i < numShards; ++i) {
+    auto& victims = victims_[i];
+    for (int k = 1; k < numShards; ++k) {
+      int other = (i + k) % numShards;
+      if (nodes[other] == nodes[i]) {
+        victims.push_back(other);
+      }
+    }
+    for (int k = 1; k < numShards; ++k) {
+      int other = (i + k) % numShards;
+      if (nodes[other] != nodes[i]) {
+        victims.push_back(other);
+      }
+    }
+  }
+
+  return Status::Ok();
+}
+
+void AnalyzerCache::release(CachedAnalyzer *analyzer) {
+  analyzer->shard_->release(analyzer);
+  notifyWaiters();
+}
+
+void AnalyzerCache::notifyWaiters() {
+  // pairs with the fence in acquireWaiting: either a waiter sees the pushed analyzer
+  // or we see the waiter
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (waiters_.load(std::memory_order_relaxed) > 0) {
+    {
+      std::lock_guard<std::mutex> guard{waitMutex_};
+      ++releases_;
+    }
+    waitCv_.notify_one();
+  }
+}
+
+CachedAnalyzer *AnalyzerCache::acquire(const JumanppConfig &cfg, const AnalysisRequest &req, bool allFeatures,
+                                       AcquireStatus *status) {
+  return acquireKey(keyFor(cfg, req, allFeatures), cfg, req, allFeatures, status);
+}
+
+CachedAnalyzer *AnalyzerCache::acquire(const SharedConfig &cfg, const AnalysisRequest &req, bool allFeatures,
+                                       AcquireStatus *status) {
+  return acquireKey(keyFor(cfg, req, allFeatures), cfg.config, req, allFeatures, status);
+}
+
+CachedAnalyzer *AnalyzerCache::acquireKey(AnalyzerKey key, const JumanppConfig &cfg, const AnalysisRequest &req,
+                                          bool allFeatures, AcquireStatus *status) {
+  AcquireStatus ignored;
+  if (status == nullptr) {
+    status = &ignored;
+  }
+  *status = AcquireStatus::Ok;
+
+  int own = shardIndex();
+  auto& victims = victims_[own];
+
+  auto an = shards_[own]->tryAcquire(key, cfg, req, allFeatures);
+  if (an != nullptr) {
+    return an;
+  }
+
+  for (int victim: victims) {
+    an = shards_[victim]->tryAcquire(key, cfg, req, allFeatures);
+    if (an != nullptr) {
+      return an;
+    }
+  }
+
+  // analyzers are built only by the own shard, so their memory is on the node of the thread;
+  // other shards give away only idle analyzers which can be reconfigured in place
+  an = shards_[own]->acquireSlow(key, cfg, req, allFeatures, true, status);
+  for (size_t i = 0; i < victims.size() && *status == AcquireStatus::Busy; ++i) {
+    an = shards_[victims[i]]->acquireSlow(key, cfg, req, allFeatures, false, status);
+  }
+
+  if (*status == AcquireStatus::BuildFailed) {
+    // the analyzer has returned to the fresh list and can be taken by a waiter
+    notifyWaiters();
+  }
+
+  return an;
+}
+
+CachedAnalyzer *AnalyzerCache::acquireWaiting(const SharedConfig &cfg, const AnalysisRequest &req, bool allFeatures,
+                                              Deadline deadline, AcquireStatus *status) {
+  auto an = acquire(cfg, req, allFeatures, status);
+  if (*status != AcquireStatus::Busy) {
+    return an;
+  }
+
+  // convert the client deadline to the steady clock, it is infinite when not set
+  auto waitStart = Clock::now();
+  auto maxWait = poolCfg_.maxWait;
+  auto waitLimit = waitStart + maxWait;
+  auto clientLeft = deadline - std::chrono::system_clock::now();
+  bool clientBound = clientLeft < maxWait;
+  if (clientBound) {
+    waitLimit = waitStart + std::chrono::duration_cast<Clock::duration>(clientLeft);
+  }
+
+  if (waiters_.fetch_add(1, std::memory_order_relaxed) >= poolCfg_.maxWaiters) {
+    waiters_.fetch_sub(1, std::memory_order_relaxed);
+    *status = AcquireStatus::QueueFull;
+    return nullptr;
+  }
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+
+  std::unique_lock<std::mutex> lock{waitMutex_};
+  while (true) {
+    auto seen = releases_;
+    lock.unlock();
+    an = acquire(cfg, req, allFeatures, status);
+    lock.lock();
+    if (*status != AcquireStatus::Busy) {
+      break;
+    }
+
+    if (!waitCv_.wait_until(lock, waitLimit, [&]() { return releases_ != seen; })) {
+      *status = clientBound ? AcquireStatus::DeadlineExceeded : AcquireStatus::Timeout;
+      break;
+    }
+  }
+  lock.unlock();
+
+  waiters_.fetch_sub(1, std::memory_order_relaxed);
+  return an;
+}
+
+i32 AnalyzerCache::liveAnalyzers() const {
+  i32 result = 0;
+  for (auto& shard: shards_) {
+    result += shard->liveAnalyzers();
+  }
+  return result;
+}
+
+AnalyzerCacheStats AnalyzerCache::stats() const {
+  AnalyzerCacheStats result;
+  for (auto& shard: shards_) {
+    shard->addStats(&result);
+  }
+  return result;
+}
+
+int AnalyzerCache::shrinkIdle(TimePoint threshold) {
+  int destroyed = 0;
+  for (auto& shard: shards_) {
+    destroyed += shard->shrinkIdle(threshold);
+  }
+  return destroyed;
+}
+
+Status AnalyzerCache::warmup(const std::vector<WarmupProfile> &profiles, const std::function<void(int)> &threadInit) {
+  std::vector<const WarmupProfile*> tasks;
+  for (auto& p: profiles) {
+    for (int i = 0; i < p.count; ++i) {
+      tasks.push_back(&p);
+    }
+  }
+
+  if (tasks.size() > static_cast<size_t>(poolCfg_.maxSize)) {
+    return JPPS_INVALID_PARAMETER << "warmup profiles need " << tasks.size()
+                                  << " analyzers, but the pool has only " << poolCfg_.maxSize;
+  }
+
+  // analyzers are held until everything is built, otherwise the same ones would be reused
+  std::vector<CachedAnalyzer*> built(tasks.size(), nullptr);
+  size_t numShards = shards_.size();
+  auto worker = [&](int shard) {
+    threadInit(shard);
+    bindThread(shard);
+    AnalysisRequest req;
+    // round robin, so every profile is present in as many shards as possible
+    for (size_t i = static_cast<size_t>(shard); i < tasks.size(); i += numShards) {
+      auto task = tasks[i];
+      req.set_type(task->type);
+      built[i] = acquire(task->config, req, task->allFeatures);
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < numShards && i < tasks.size(); ++i) {
+    threads.emplace_back(worker, static_cast<int>(i));
+  }
+  for (auto& t: threads) {
+    t.join();
+  }
+
+  size_t failed = 0;
+  for (auto an: built) {
+    if (an == nullptr) {
+      ++failed;
+    } else {
+      release(an);
+    }
+  }
+
+  if (failed != 0) {
+    return JPPS_INVALID_STATE << "failed to build " << failed << " analyzers during warmup";
+  }
+
+  return Status::Ok();
+}
+
 } // namespace grpc
-} // namespace jumanpp
\ No newline at end of file
+} // namespace jumanpp
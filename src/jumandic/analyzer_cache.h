@@ -9,14 +9,21 @@
 #include "core/input/pex_stream_reader.h"
 #include "core/env.h"
 #include "jumandic-svc.pb.h"
+#include "config_cache.h"
+#include "metrics.h"
 #include <chrono>
+#include <istream>
+#include <streambuf>
 #include <atomic>
 #include <mutex>
+#include <condition_variable>
+#include <functional>
 
 namespace jumanpp {
 namespace grpc {
 
 class AnalyzerCache;
+class AnalyzerShard;
 
 enum class AnalyzerState {
   Uninitialized,
@@ -27,17 +34,83 @@ enum class AnalyzerState {
 
 using Clock = std::chrono::steady_clock;
 using TimePoint = Clock::time_point;
+using Deadline = std::chrono::system_clock::time_point;
+
+enum class AcquireStatus {
+  Ok,
+  Busy, // all analyzers are in use
+  BuildFailed,
+  QueueFull, // all analyzers are in use and there are too many waiting requests
+  Timeout, // waited for the maximum allowed time
+  DeadlineExceeded // waited until the request deadline
+};
+
+/**
+ * Compact fingerprint of everything which makes two analyzers incompatible:
+ * beams, rnn usage, feature pattern storage and request type.
+ *
+ * Two different configs can have the same fingerprint (it is a hash),
+ * so the full check with CachedAnalyzer::isAvailableFor is still done after
+ * getting an analyzer from a bucket.
+ */
+class AnalyzerKey {
+  u64 value_ = 0;
+
+public:
+  AnalyzerKey() = default;
+  explicit AnalyzerKey(u64 value): value_{value} {}
+
+  static AnalyzerKey of(const JumanppConfig& cfg, RequestType type, bool ignoreRnn, bool allFeatures);
+  // configHash is a precomputed result of configHash(cfg, ignoreRnn)
+  static AnalyzerKey of(u64 configHash, RequestType type, bool allFeatures);
+  static u64 configHash(const JumanppConfig& cfg, bool ignoreRnn);
+
+  u64 value() const { return value_; }
+  bool operator==(const AnalyzerKey& o) const { return value_ == o.value_; }
+  bool operator!=(const AnalyzerKey& o) const { return value_ != o.value_; }
+};
+
+/**
+ * Stream buffer over a string owned by someone else, the data is not copied.
+ */
+class StringViewBuf: public std::streambuf {
+public:
+  void reset(const std::string& data) {
+    auto begin = const_cast<char*>(data.data());
+    setg(begin, begin, begin + data.size());
+  }
+};
 
 class CachedAnalyzer {
   core::analysis::AnalyzerConfig analyzerConfig;
   core::ScoringConfig scoringConfig;
-  core::analysis::Analyzer analyzer_;
+  // is destroyed when the pool shrinks, so the memory goes away
+  std::unique_ptr<core::analysis::Analyzer> analyzer_;
   RequestType lastRequestType = RequestType::Normal;
+  // type of the last read input
+  RequestType readerType_ = RequestType::Normal;
+  // reads partial annotation requests, Normal ones go to the analyzer directly
   std::unique_ptr<core::input::StreamReader> reader_;
+  // input of the Normal requests, points to the request message
+  StringPiece input_;
+  // input of the reader, also points to the request message
+  StringViewBuf inputBuf_;
+  std::istream inputStream_{&inputBuf_};
   std::string comment_;
   TimePoint lastUsage_ = TimePoint::min();
-  AnalyzerState state_ = AnalyzerState::Uninitialized;
+  std::atomic<AnalyzerState> state_{AnalyzerState::Uninitialized};
   core::analysis::ScorerDef cachedDef_;
+  // index in the shard
+  u32 index_ = 0;
+  // unique in the whole pool, reported in request traces
+  u32 id_ = 0;
+  // how the analyzer was acquired the last time
+  ResultSource source_ = ResultSource::Rebuild;
+  AnalyzerShard* shard_ = nullptr;
+  AnalyzerKey key_;
+  i32 bucket_ = -1;
+  // number of times the analyzer was taken without any changes
+  std::atomic<u64> reuses_{0};
 
   void setBaseConfig(const core::analysis::AnalyzerConfig &global, const core::JumanppEnv &env, bool allFeatures);
 
@@ -52,40 +125,222 @@ class CachedAnalyzer {
   }
 
   Status buildAnalyzer(const core::JumanppEnv& env);
+  void destroyAnalyzer();
+
+  /**
+   * Local beam, scorers and feature pattern storage define allocated buffers.
+   * Analyzers with the same ones differ only in global beam parameters.
+   */
+  bool hasSameShape(const JumanppConfig& cfg, int numScorers, bool allFeatures) const;
+  // changes only global beam parameters, keeping lattice and scorer state
+  Status reconfigure(const JumanppConfig& cfg);
 
 public:
   bool isAvailableFor(const JumanppConfig& cfg, const AnalysisRequest& req, bool allFeatures) const;
+  // the same check without the state, for an analyzer which the caller holds
+  bool isConfiguredFor(const JumanppConfig& cfg, const AnalysisRequest& req, bool allFeatures) const;
+  // the request must stay alive until analyze() returns, the sentence is not copied
   Status readInput(const AnalysisRequest& req, const AnalyzerCache& cache);
   Status analyze();
-  bool hasResult() const { return state_ == AnalyzerState::WithResult; }
-  core::analysis::AnalyzerImpl* impl() { return analyzer_.impl(); }
-  core::analysis::Analyzer* analyzer() { return &analyzer_; }
-  const core::analysis::WeightBuffer* weights() const { return &analyzer_.scorer()->feature->weights(); }
+  bool hasResult() const { return state_.load(std::memory_order_acquire) == AnalyzerState::WithResult; }
+  core::analysis::AnalyzerImpl* impl() { return analyzer_->impl(); }
+  core::analysis::Analyzer* analyzer() { return analyzer_.get(); }
+  const core::analysis::WeightBuffer* weights() const { return &analyzer_->scorer()->feature->weights(); }
   StringPiece comment() const { return comment_; }
+  u32 id() const { return id_; }
+  ResultSource source() const { return source_; }
   friend class AnalyzerCache;
+  friend class AnalyzerShard;
   int localBeam() const { return scoringConfig.beamSize; }
 };
 
-class AnalyzerCache {
-  core::input::PexStreamReader cachedReader_;
+/**
+ * Lock-free LIFO list of analyzers (Treiber stack).
+ * Nodes are analyzer indices, links are stored by the cache.
+ * Head contains a modification tag in the upper half to prevent ABA.
+ */
+struct AnalyzerBucket {
+  std::atomic<u64> key{0};
+  std::atomic<u64> head{0};
+  // number of analyzers which have this bucket as home, both idle and in use
+  std::atomic<i32> assigned{0};
+};
+
+struct AnalyzerPoolConfig {
+  // built analyzers which are never destroyed
+  int minSize = 0;
+  int maxSize = 40;
+  // NUMA node of each shard, sizes are split between shards evenly; one shard when empty
+  std::vector<int> shardNodes;
+  // destroy analyzers which were idle for idleTtl, keeping at least minSize
+  bool adaptive = false;
+  Clock::duration idleTtl = std::chrono::seconds(60);
+  int maxWaiters = 0;
+  Clock::duration maxWait = std::chrono::seconds(1);
+};
+
+// analyzers which are built before the server starts
+struct WarmupProfile {
+  int count = 0;
+  JumanppConfig config;
+  RequestType type = RequestType::Normal;
+  bool allFeatures = false;
+};
+
+struct AnalyzerCacheStats {
+  // analyzer was taken from its bucket as is
+  u64 reuses = 0;
+  // analyzer of another config got new global beam parameters
+  u64 reconfigures = 0;
+  // analyzer was initialized from scratch
+  u64 rebuilds = 0;
+  i32 live = 0;
+  // number of analyzers in each AnalyzerState
+  i32 states[4] = {};
+};
+
+/**
+ * Analyzers are grouped in buckets by their config fingerprint.
+ * Idle analyzers are kept in a lock-free list of their bucket,
+ * so acquiring an already built analyzer and releasing it
+ * do not take any locks.
+ *
+ * The mutex is taken only when there are no idle analyzers for the config.
+ * In that case an analyzer which was never used, an idle one which only needs
+ * new global beams, or the least recently used idle one from another bucket is rebuilt.
+ * Finding it scans all idle analyzers, which is cheap compared to the rebuild.
+ */
+class AnalyzerShard {
   std::vector<std::unique_ptr<CachedAnalyzer>> cache_;
-  core::analysis::AnalyzerConfig defaultCfg_;
+  std::unique_ptr<std::atomic<u32>[]> links_;
+  std::unique_ptr<AnalyzerBucket[]> buckets_;
+  u32 bucketMask_ = 0;
+  // analyzers which were never built, they are not assigned to any bucket
+  std::atomic<u64> fresh_{0};
+  const core::analysis::AnalyzerConfig* defaultCfg_ = nullptr;
   const core::JumanppEnv* env_ = nullptr;
   std::mutex mutex_;
+  int minSize_ = 0;
+  int node_ = 0;
+  // number of built analyzers, modified only under the mutex
+  std::atomic<i32> live_{0};
+  std::atomic<u64> rebuilds_{0};
+  std::atomic<u64> reconfigures_{0};
+  // idle analyzers which acquireSlow has taken off the stacks, used under the mutex
+  std::vector<CachedAnalyzer*> idle_;
+
+  void push(std::atomic<u64>* head, CachedAnalyzer* analyzer);
+  CachedAnalyzer* pop(std::atomic<u64>* head);
+
+  i32 findBucket(AnalyzerKey key) const;
+  i32 assignBucket(AnalyzerKey key);
+  CachedAnalyzer* popFromBucket(i32 bucket, const JumanppConfig& cfg, const AnalysisRequest& req, bool allFeatures);
 
 public:
-  Status initialize(const core::JumanppEnv* env, const core::analysis::AnalyzerConfig& defaultConfig, int capacity) {
-    env_ = env;
-    defaultCfg_ = defaultConfig;
-    JPP_RETURN_IF_ERROR(cachedReader_.initialize(*env_->coreHolder()));
-    for (int i = 0; i < capacity; ++i) {
-      cache_.emplace_back(new CachedAnalyzer);
-    }
-    return Status::Ok();
+  // analyzers of the shard get ids starting from firstId
+  Status initialize(const core::JumanppEnv* env, const core::analysis::AnalyzerConfig* defaultConfig,
+                    int capacity, int minSize, int node, u32 firstId);
+
+  int capacity() const { return static_cast<int>(cache_.size()); }
+  int node() const { return node_; }
+  i32 liveAnalyzers() const { return live_.load(std::memory_order_relaxed); }
+  void addStats(AnalyzerCacheStats* stats) const;
+  int shrinkIdle(TimePoint threshold);
+
+  // takes an idle analyzer of the same config without any locks
+  CachedAnalyzer* tryAcquire(AnalyzerKey key, const JumanppConfig& cfg, const AnalysisRequest& req, bool allFeatures);
+  // builds or reconfigures an analyzer, status is Busy if all analyzers of the shard are in use;
+  // without build (for other shards) only an idle analyzer of the same shape is reconfigured
+  CachedAnalyzer* acquireSlow(AnalyzerKey key, const JumanppConfig& cfg, const AnalysisRequest& req, bool allFeatures,
+                              bool build, AcquireStatus* status);
+  void release(CachedAnalyzer* analyzer);
+};
+
+/**
+ * The pool is split into shards, one per worker thread, so analyzers of a worker
+ * are allocated on its NUMA node and workers do not contend on the same lists.
+ *
+ * A worker first looks for an idle analyzer of the config in its own shard,
+ * then steals one from other shards, starting with the ones on the same node.
+ * Only when nobody has an idle analyzer of the config an analyzer is rebuilt,
+ * always in the own shard. When the own shard is busy, an idle analyzer of another
+ * shard is taken only if its global beams can be reconfigured in place.
+ */
+class AnalyzerCache {
+  core::input::PexStreamReader cachedReader_;
+  std::vector<std::unique_ptr<AnalyzerShard>> shards_;
+  // for each shard, other shards in the order of stealing
+  std::vector<std::vector<int>> victims_;
+  core::analysis::AnalyzerConfig defaultCfg_;
+  bool hasRnn_ = false;
+  AnalyzerPoolConfig poolCfg_;
+
+  // requests waiting for an analyzer to be released
+  std::atomic<i32> waiters_{0};
+  std::mutex waitMutex_;
+  std::condition_variable waitCv_;
+  u64 releases_ = 0;
+
+  static thread_local int currentShard_;
+
+  void notifyWaiters();
+  CachedAnalyzer* acquireKey(AnalyzerKey key, const JumanppConfig& cfg, const AnalysisRequest& req, bool allFeatures,
+                             AcquireStatus* status);
+  int shardIndex() const { return currentShard_ < static_cast<int>(shards_.size()) ? currentShard_ : 0; }
+
+public:
+  Status initialize(const core::JumanppEnv* env, const core::analysis::AnalyzerConfig& defaultConfig,
+                    const AnalyzerPoolConfig& poolConfig);
+
+  // analyzers acquired by the calling thread will be taken from the shard first
+  static void bindThread(int shard) { currentShard_ = shard; }
+
+  AnalyzerKey keyFor(const JumanppConfig& cfg, const AnalysisRequest& req, bool allFeatures) const {
+    return AnalyzerKey::of(cfg, req.type(), hasRnn_ && cfg.ignore_rnn(), allFeatures);
+  }
+
+  AnalyzerKey keyFor(const SharedConfig& cfg, const AnalysisRequest& req, bool allFeatures) const {
+    return AnalyzerKey::of(cfg.fingerprint, req.type(), allFeatures);
   }
 
+  // value of SharedConfig::fingerprint for the config
+  u64 fingerprint(const JumanppConfig& cfg) const {
+    return AnalyzerKey::configHash(cfg, hasRnn_ && cfg.ignore_rnn());
+  }
+
+  const AnalyzerPoolConfig& poolConfig() const { return poolCfg_; }
+  int numShards() const { return static_cast<int>(shards_.size()); }
+  i32 liveAnalyzers() const;
+  // number of requests waiting for an analyzer to be released
+  i32 waiters() const { return waiters_.load(std::memory_order_relaxed); }
+  AnalyzerCacheStats stats() const;
+
+  /**
+   * Builds analyzers for all profiles, spreading them between shards.
+   * Each shard is filled by its own thread which calls threadInit(shard) first.
+   */
+  Status warmup(const std::vector<WarmupProfile>& profiles, const std::function<void(int)>& threadInit);
+
+  /**
+   * Destroys analyzers which were not used since the threshold,
+   * keeping at least minSize of built analyzers.
+   * @return number of destroyed analyzers
+   */
+  int shrinkIdle(TimePoint threshold);
+
   const core::input::PexStreamReader& cachedReader() const { return cachedReader_; }
-  CachedAnalyzer* acquire(const JumanppConfig& cfg, const AnalysisRequest& req, bool allFeatures);
+  CachedAnalyzer* acquire(const JumanppConfig& cfg, const AnalysisRequest& req, bool allFeatures,
+                          AcquireStatus* status = nullptr);
+  // uses the precomputed fingerprint of the config
+  CachedAnalyzer* acquire(const SharedConfig& cfg, const AnalysisRequest& req, bool allFeatures,
+                          AcquireStatus* status = nullptr);
+  /**
+   * Requests which could not get an analyzer immediately wait for a release,
+   * but not longer than maxWait and at most maxWaiters of them at once.
+   * Others fail with AcquireStatus::QueueFull.
+   */
+  CachedAnalyzer* acquireWaiting(const SharedConfig& cfg, const AnalysisRequest& req, bool allFeatures,
+                                 Deadline deadline, AcquireStatus* status);
   void release(CachedAnalyzer* analyzer);
 };
 
@@ -102,6 +357,10 @@ public:
     }
   }
 
+  ScopedAnalyzer(AnalyzerCache& cache, const SharedConfig& cfg, const AnalysisRequest& req, bool allFeatures,
+                 Deadline deadline, AcquireStatus* status): cache_{cache},
+                                                           analyzer_{cache.acquireWaiting(cfg, req, allFeatures, deadline, status)} {}
+
   CachedAnalyzer* value() { return analyzer_; }
 
   explicit operator bool() const { return analyzer_ != nullptr; }
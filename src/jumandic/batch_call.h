@@ -0,0 +1,292 @@
+//
+// Created by Arseny Tolmachev on 2018/03/09.
+//
+
+#ifndef JUMANPP_GRPC_BATCH_CALL_H
+#define JUMANPP_GRPC_BATCH_CALL_H
+
+#include "unary_call.h"
+
+namespace jumanpp {
+namespace grpc {
+
+// per call state which batch workers share
+struct BatchParams {
+  JumanppGrpcEnv* env = nullptr;
+  // requests without their own config use it as is
+  ConfigPtr config;
+  const CallLiveness* liveness = nullptr;
+  Deadline deadline = Deadline::max();
+  // hosts format replies without names of grammar ids
+  bool idsOnly = false;
+};
+
+/**
+ * Analyzes a batch of requests on several compute threads.
+ *
+ * The compute thread which calls run is the first worker,
+ * other workers are submitted to the compute pool.
+ * Each worker takes requests one by one and keeps its analyzer
+ * while requests have a compatible config.
+ * The worker which finishes last calls host->batchDone.
+ *
+ * Host needs to implement
+ *  Status formatOutput(Output* out, CachedAnalyzer* ana, const AnalysisRequest& req, int index),
+ *  slot(int index) which returns a pointer to the reply message of a request and
+ *  void batchDone(const ::grpc::Status& status).
+ */
+template <typename Output, typename Host>
+class BatchRunner {
+  struct Worker: public ComputeTask {
+    BatchRunner* runner_;
+    Output output_;
+    // merged into the trace of the call by the last worker
+    RequestTrace trace_;
+
+    explicit Worker(BatchRunner* runner): runner_{runner} {}
+
+    void Run() override {
+      runner_->runWorker(this);
+    }
+  };
+
+  std::vector<std::unique_ptr<Worker>> workers_;
+  std::atomic<int> next_{0};
+  std::atomic<int> running_{0};
+  std::mutex errorMutex_;
+  ::grpc::Status error_;
+  Host* host_ = nullptr;
+  const AnalysisBatch* batch_ = nullptr;
+  BatchParams params_;
+  RequestTrace* trace_ = nullptr;
+
+  void runWorker(Worker* worker) {
+    auto& cache = params_.env->analyzers();
+    auto& results = params_.env->results();
+    std::string cachedData;
+    int total = batch_->requests_size();
+    CachedAnalyzer* ana = nullptr;
+    AnalyzerKey anaKey;
+    // owned: a config which is not interned could be freed and its address reused by the next one
+    ConfigPtr anaConfig;
+    RequestType anaType = RequestType::Normal;
+    auto& trace = worker->trace_;
+    ::grpc::Status status;
+
+    for (int i = next_.fetch_add(1); i < total; i = next_.fetch_add(1)) {
+      // the rest of the batch is not analyzed when the client has gone
+      status = params_.liveness->check();
+      if (!status.ok()) {
+        Metrics::abandoned(Host::Kind);
+        break;
+      }
+
+      auto& req = batch_->requests(i);
+      status = params_.env->budget().check(req);
+      if (!status.ok()) {
+        break;
+      }
+
+      ConfigPtr cfg = params_.config;
+      if (req.has_config()) {
+        cfg = params_.env->configs().merged(*cfg, req.config());
+      }
+      auto smaller = params_.env->applyBudget(req, *cfg, &trace);
+      if (smaller) {
+        cfg = std::move(smaller);
+      }
+
+      auto slot = host_->slot(i);
+      bool cacheable = results.accepts(req);
+      ResultKey resultKey;
+      if (cacheable) {
+        resultKey = ResultKey{slot->GetDescriptor()->full_name(), false, cfg->config, req, params_.idsOnly};
+        if (results.lookup(resultKey, &cachedData) && slot->ParseFromString(cachedData)) {
+          slot->set_comment(req.key());
+          trace.cacheHit();
+          continue;
+        }
+      }
+
+      // interned configs are compared by pointer, the key is computed only when they differ,
+      // keys are hashes, so equal ones are confirmed by the full check as in AnalyzerShard
+      bool sameAnalyzer = ana != nullptr && req.type() == anaType &&
+                          (cfg == anaConfig ||
+                           (cache.keyFor(*cfg, req, false) == anaKey && ana->isConfiguredFor(cfg->config, req, false)));
+      if (!sameAnalyzer) {
+        if (ana != nullptr) {
+          cache.release(ana);
+        }
+        AcquireStatus acquired;
+        StageTimer timer{Host::Kind, &trace};
+        ana = cache.acquireWaiting(*cfg, req, false, params_.deadline, &acquired);
+        timer.lap(Stage::Acquire);
+        if (ana == nullptr) {
+          status = acquireFailure(acquired);
+          break;
+        }
+        anaKey = cache.keyFor(*cfg, req, false);
+        anaType = req.type();
+        trace.analyzed(ana->id(), ana->source());
+      } else {
+        trace.analyzed(ana->id(), ResultSource::Reuse);
+      }
+      anaConfig = cfg;
+
+      StageTimer timer{Host::Kind, &trace};
+      Status s = ana->readInput(req, cache);
+      timer.lap(Stage::ReadInput);
+      if (!s) {
+        status = ::grpc::Status{::grpc::StatusCode::INVALID_ARGUMENT, s.message().str()};
+        break;
+      }
+
+      s = ana->analyze();
+      timer.lap(Stage::Analyze);
+      if (!s) {
+        status = ::grpc::Status{::grpc::StatusCode::INTERNAL, s.message().str()};
+        break;
+      }
+
+      s = host_->formatOutput(&worker->output_, ana, req, i);
+      if (!s) {
+        status = ::grpc::Status{::grpc::StatusCode::INTERNAL, s.message().str()};
+        break;
+      }
+
+      if (cacheable) {
+        slot->clear_comment(); // cached replies do not contain the request key
+        results.insert(resultKey, slot->SerializeAsString());
+        slot->set_comment(req.key());
+      }
+      timer.lap(Stage::Format);
+    }
+
+    if (ana != nullptr) {
+      cache.release(ana);
+    }
+
+    finishWorker(status);
+  }
+
+  void finishWorker(const ::grpc::Status& status) {
+    if (!status.ok()) {
+      std::lock_guard<std::mutex> guard{errorMutex_};
+      if (error_.ok()) {
+        error_ = status;
+      }
+      next_.store(batch_->requests_size()); // stop other workers
+    }
+
+    if (running_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      // this is the last worker, nothing should touch the call after sending the reply
+      for (auto& w: workers_) {
+        trace_->merge(w->trace_);
+      }
+      std::unique_lock<std::mutex> lock{errorMutex_};
+      auto result = error_;
+      lock.unlock();
+      host_->batchDone(result);
+    }
+  }
+
+public:
+  /**
+   * Analyzes all requests of the batch, the batch must not be empty.
+   * Worker traces are added to the trace.
+   */
+  void run(Host* host, const AnalysisBatch* batch, const BatchParams& params, RequestTrace* trace) {
+    host_ = host;
+    batch_ = batch;
+    params_ = params;
+    trace_ = trace;
+    next_.store(0, std::memory_order_relaxed);
+    error_ = ::grpc::Status::OK;
+
+    int total = batch->requests_size();
+    int numWorkers = std::min(params.env->poolThreads(), total);
+    running_.store(numWorkers);
+    for (int i = static_cast<int>(workers_.size()); i < numWorkers; ++i) {
+      workers_.emplace_back(new Worker{this});
+    }
+    for (auto& w: workers_) {
+      w->trace_ = RequestTrace{};
+    }
+    trace->messages = static_cast<u32>(total);
+
+    // helpers are optional, the first worker takes whatever they don't
+    int skipped = 0;
+    for (int i = 1; i < numWorkers; ++i) {
+      if (!params.env->compute().trySubmit(workers_[i].get())) {
+        skipped += 1;
+      }
+    }
+    running_.fetch_sub(skipped, std::memory_order_acq_rel);
+
+    runWorker(workers_[0].get());
+  }
+
+  // workers and their formatters are kept for the next use
+  void reset() {
+    params_.config.reset();
+  }
+};
+
+/**
+ * Unary call which analyzes an AnalysisBatch with BatchRunner.
+ *
+ * Child needs to implement
+ *  void prepareReply(int size) which allocates reply slots,
+ *  and formatOutput and slot of BatchRunner.
+ */
+template <typename Reply, typename Output, typename Child>
+class BatchUnaryCall: public BaseUnaryCall<Reply, Child> {
+  BatchRunner<Output, Child> runner_;
+
+protected:
+  AnalysisBatch& batch_ = *this->arena_.template create<AnalysisBatch>();
+  Reply& reply_ = *this->arena_.template create<Reply>();
+
+public:
+  explicit BatchUnaryCall(JumanppGrpcEnv* env): BaseUnaryCall<Reply, Child>::BaseUnaryCall(env) {}
+
+  void reset() {
+    BaseUnaryCall<Reply, Child>::reset();
+    batch_.Clear();
+    reply_.Clear();
+    runner_.reset();
+  }
+
+  void handleCall() {
+    int total = batch_.requests_size();
+    child().prepareReply(total);
+    if (total == 0) {
+      this->finish(reply_);
+      return;
+    }
+
+    BatchParams params;
+    params.env = this->env_;
+    params.config = this->config_;
+    params.liveness = &this->liveness_;
+    params.deadline = this->context_.deadline();
+    params.idsOnly = this->idsOnly_;
+    runner_.run(&child(), &batch_, params, &this->trace_);
+  }
+
+  // called by the last worker
+  void batchDone(const ::grpc::Status& status) {
+    if (status.ok()) {
+      this->finish(reply_);
+    } else {
+      this->finishWithError(status);
+    }
+  }
+
+  Child& child() { return static_cast<Child&>(*this); }
+};
+
+} // namespace grpc
+} // namespace jumanpp
+
+#endif //JUMANPP_GRPC_BATCH_CALL_H
@@ -0,0 +1,232 @@
+//
+// Created by Arseny Tolmachev on 2018/03/21.
+//
+
+#ifndef JUMANPP_GRPC_BATCH_STREAM_CALL_H
+#define JUMANPP_GRPC_BATCH_STREAM_CALL_H
+
+#include "batch_call.h"
+
+namespace jumanpp {
+namespace grpc {
+
+/**
+ * Bidirectional stream which collects incoming messages into batches
+ * and analyzes each batch on all compute threads with BatchRunner.
+ *
+ * Batches are processed one at a time: nothing is read while
+ * a batch is analyzed and its reply is written.
+ * The call goes back to the pool when both the finish and the done tags have returned.
+ *
+ * Child needs to implement
+ *  ::grpc::Status consume(In* message) which takes a read message on an io thread, an error finishes the stream,
+ *  bool batchReady(bool readsDone) which tells if there is enough input for the next batch,
+ *  ConfigPtr prepareBatch(AnalysisBatch* batch, Out* reply) which fills the batch from the consumed input
+ *    and returns the config of its requests,
+ *  ::grpc::Status completeReply(Out* reply) which is called after the whole batch was analyzed,
+ *  and formatOutput and slot of BatchRunner.
+ */
+template <typename In, typename Out, typename Output, typename Child>
+class BatchStreamCallBase: public CallImpl, public ComputeTask {
+  struct Rpc {
+    ::grpc::ServerContext context;
+    ::grpc::ServerAsyncReaderWriter<Out, In> rw{&context};
+  };
+
+  InPlace<Rpc> rpc_;
+  bool started_ = false;
+  bool readsDone_ = false;
+  std::atomic<int> pending_{0};
+  CallLiveness liveness_;
+  bool tracing_ = false;
+  // all batches of the stream
+  RequestTrace trace_;
+  RequestTrace batchTrace_;
+  TimePoint received_;
+  In input_;
+  AnalysisBatch batch_;
+  BatchRunner<Output, Child> runner_;
+
+  void release() {
+    if (pending_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      CallPool<Child>::instance().put(&child());
+    }
+  }
+
+  void finish(const ::grpc::Status& status) {
+    if (!status.ok()) {
+      Metrics::error(Child::Kind);
+    }
+    if (tracing_) {
+      context_.AddTrailingMetadata("jumanpp-timing", trace_.format());
+    }
+    auto degraded = trace_.formatDegraded();
+    if (!degraded.empty()) {
+      context_.AddTrailingMetadata("jumanpp-degraded", degraded);
+    }
+    rw_.Finish(status, &finishTag_);
+  }
+
+  // called on an io thread after a read or a write has finished
+  void proceed() {
+    if (child().batchReady(readsDone_)) {
+      received_ = Clock::now();
+      Metrics::request(Child::Kind);
+      // nothing is read until the batch is done, so a full queue needs no other backpressure
+      env_->compute().submit(this);
+    } else if (readsDone_) {
+      finish(::grpc::Status::OK);
+    } else {
+      rw_.Read(&input_, &readTag_);
+    }
+  }
+
+  void ReadDone(bool ok) {
+    if (ok) {
+      auto status = child().consume(&input_);
+      if (!status.ok()) {
+        finish(status);
+        return;
+      }
+    } else { // client has finished sending messages
+      readsDone_ = true;
+    }
+    proceed();
+  }
+
+  void WriteDone(bool ok) {
+    if (!ok) {
+      finish(::grpc::Status{::grpc::StatusCode::CANCELLED, "failed to write a reply"});
+      return;
+    }
+    proceed();
+  }
+
+  void FinishDone(bool ok) {
+    release();
+  }
+
+  void CallDone(bool ok) {
+    if (context_.IsCancelled()) {
+      liveness_.cancelled.store(true, std::memory_order_relaxed);
+    }
+    release();
+  }
+
+  Forwarder<BatchStreamCallBase, &BatchStreamCallBase::ReadDone> readTag_{this};
+  Forwarder<BatchStreamCallBase, &BatchStreamCallBase::WriteDone> writeTag_{this};
+  Forwarder<BatchStreamCallBase, &BatchStreamCallBase::FinishDone> finishTag_{this};
+  Forwarder<BatchStreamCallBase, &BatchStreamCallBase::CallDone> doneTag_{this};
+
+protected:
+  JumanppGrpcEnv* env_;
+  ::grpc::ServerContext& context_ = rpc_.get().context;
+  ::grpc::ServerAsyncReaderWriter<Out, In>& rw_ = rpc_.get().rw;
+  // config of the stream, from the jumanpp-config-bin header
+  ConfigPtr config_;
+  // client asked for replies without names of grammar ids
+  bool idsOnly_ = false;
+  Out reply_;
+
+public:
+  explicit BatchStreamCallBase(JumanppGrpcEnv* env): env_{env} {}
+
+  // called on recycle, children which keep per stream state hide it
+  void reset() {}
+
+  bool recycle() {
+    rpc_.destroy();
+    started_ = false;
+    readsDone_ = false;
+    config_.reset();
+    trace_ = RequestTrace{};
+    batchTrace_ = RequestTrace{};
+    input_.Clear();
+    batch_.Clear();
+    reply_.Clear();
+    runner_.reset();
+    child().reset();
+    return true;
+  }
+
+  void revive() {
+    rpc_.emplace();
+    liveness_.reset();
+  }
+
+  void Handle() override {
+    if (!started_) {
+      started_ = true;
+      // the done tag can come back before the request handler has finished
+      pending_.store(2, std::memory_order_relaxed);
+      context_.AsyncNotifyWhenDone(&doneTag_);
+      child().startRequest();
+      return;
+    }
+
+    CallPool<Child>::instance().take(env_)->Handle(); //fork call
+    liveness_.start(context_.deadline());
+    config_ = env_->configs().defaultConfig();
+    auto& clientMeta = context_.client_metadata();
+    tracing_ = clientMeta.find("jumanpp-timing") != clientMeta.end();
+    idsOnly_ = clientMeta.find("jumanpp-ids-only") != clientMeta.end();
+    auto iter = clientMeta.find("jumanpp-config-bin");
+    if (iter != clientMeta.end()) {
+      config_ = env_->configs().fromHeader(iter->second);
+      if (!config_) {
+        finish(::grpc::Status{::grpc::StatusCode::INVALID_ARGUMENT, "invalid config header"});
+        return;
+      }
+    }
+    rw_.Read(&input_, &readTag_);
+  }
+
+  // the request has failed, so the done tag will not come back
+  void HandleFailure() override {
+    CallPool<Child>::instance().put(&child());
+  }
+
+  // prepares the batch on a compute thread
+  void Run() override {
+    StageTimer queued{Child::Kind, &batchTrace_, received_};
+    queued.lap(Stage::Queue);
+    batch_.Clear();
+    reply_.Clear();
+    auto cfg = child().prepareBatch(&batch_, &reply_);
+    if (batch_.requests_size() == 0) {
+      batchDone(::grpc::Status::OK);
+      return;
+    }
+
+    BatchParams params;
+    params.env = env_;
+    params.config = std::move(cfg);
+    params.liveness = &liveness_;
+    params.deadline = context_.deadline();
+    params.idsOnly = idsOnly_;
+    runner_.run(&child(), &batch_, params, &batchTrace_);
+  }
+
+  // called by the last batch worker
+  void batchDone(::grpc::Status status) {
+    if (status.ok()) {
+      status = child().completeReply(&reply_);
+    }
+    StageTimer total{Child::Kind, &batchTrace_, received_};
+    total.lap(Stage::Total);
+    trace_.merge(batchTrace_);
+    batchTrace_ = RequestTrace{};
+    if (!status.ok()) {
+      finish(status);
+      return;
+    }
+    rw_.Write(reply_, &writeTag_);
+  }
+
+  Child& child() { return static_cast<Child&>(*this); }
+};
+
+} // namespace grpc
+} // namespace jumanpp
+
+#endif //JUMANPP_GRPC_BATCH_STREAM_CALL_H
@@ -0,0 +1,556 @@
+//
+// Created by Arseny Tolmachev on 2018/03/17.
+//
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <grpc++/grpc++.h>
+#include <grpc++/impl/codegen/sync_stream.h>
+#include "jumandic-svc.grpc.pb.h"
+#include "util/types.hpp"
+#include "args.h"
+
+using namespace jumanpp::grpc;
+using jumanpp::u64;
+
+namespace {
+
+using BenchClock = std::chrono::steady_clock;
+
+struct BenchArgs {
+  std::string target = "localhost:51231";
+  std::string corpus;
+  std::vector<std::string> rpcs;
+  std::vector<std::string> configs;
+  std::string output;
+  int concurrency = 1;
+  double qps = 0;
+  int durationSec = 10;
+  int warmupSec = 1;
+  int timeoutMs = 10000;
+  bool configHeader = false;
+
+  static bool ParseArgs(BenchArgs* result, int argc, const char** argv) {
+    args::ArgumentParser parser{"Load generator and latency benchmark for Juman++ gRPC server"};
+    args::ValueFlag<std::string> target{parser, "HOST:PORT", "Server address, localhost:51231 by default", {"target"}};
+    args::ValueFlag<std::string> corpus{parser, "PATH", "Corpus file, one sentence per line", {"corpus"}};
+    args::ValueFlagList<std::string> rpcs{parser, "RPC", "RPC to benchmark, can be repeated. "
+      "One of Juman, JumanStream, TopN, TopNStream, LatticeDump, LatticeDumpStream, "
+      "LatticeDumpWithFeatures, LatticeDumpWithFeaturesStream. All of them by default", {"rpc"}};
+    args::ValueFlagList<std::string> configs{parser, "CONFIG", "Request config as OPTION,..., requests cycle through the given configs. "
+      "Options are local_beam=N, global_beam_left=N, global_beam_right=N, global_beam_check=N, ignore_rnn; default means no config", {"config"}};
+    args::Flag configHeader{parser, "HEADER", "Send configs in jumanpp-config-bin header instead of requests, one config per call or stream", {"config-header"}};
+    args::ValueFlag<int> concurrency{parser, "NUM", "Number of concurrent clients, each stream RPC client uses its own stream", {"concurrency", 'n'}};
+    args::ValueFlag<double> qps{parser, "QPS", "Open loop mode: send requests at the fixed total rate. "
+      "Closed loop mode (default) sends the next request after getting the reply", {"qps"}};
+    args::ValueFlag<int> duration{parser, "SEC", "Measured time for each RPC", {"duration"}};
+    args::ValueFlag<int> warmup{parser, "SEC", "Time before measuring for each RPC", {"warmup"}};
+    args::ValueFlag<int> timeout{parser, "MS", "Deadline of unary calls", {"timeout"}};
+    args::ValueFlag<std::string> output{parser, "PATH", "Write JSON report to the file instead of stdout", {"output", 'o'}};
+    args::HelpFlag help{parser, "HELP", "Prints this message", {'h', "help"}};
+
+    try {
+      if (!parser.ParseCLI(argc, argv)) {
+        return false;
+      }
+    } catch (args::Help& e) {
+      std::cerr << parser;
+      exit(1);
+    } catch (std::exception& e) {
+      std::cerr << e.what();
+      exit(1);
+    }
+
+    if (target) {
+      result->target = target.Get();
+    }
+
+    if (corpus) {
+      result->corpus = corpus.Get();
+    }
+
+    if (rpcs) {
+      result->rpcs = rpcs.Get();
+    }
+
+    if (configs) {
+      result->configs = configs.Get();
+    }
+
+    if (configHeader) {
+      result->configHeader = true;
+    }
+
+    if (concurrency) {
+      result->concurrency = std::max(concurrency.Get(), 1);
+    }
+
+    if (qps) {
+      result->qps = qps.Get();
+    }
+
+    if (duration) {
+      result->durationSec = duration.Get();
+    }
+
+    if (warmup) {
+      result->warmupSec = warmup.Get();
+    }
+
+    if (timeout) {
+      result->timeoutMs = timeout.Get();
+    }
+
+    if (output) {
+      result->output = output.Get();
+    }
+
+    return true;
+  }
+};
+
+bool parseInt(const std::string& value, int* result) {
+  char* end = nullptr;
+  long parsed = std::strtol(value.c_str(), &end, 10);
+  if (value.empty() || *end != 0) {
+    return false;
+  }
+  *result = static_cast<int>(parsed);
+  return true;
+}
+
+bool parseConfig(const std::string& spec, JumanppConfig* cfg) {
+  if (spec.empty() || spec == "default") {
+    return true;
+  }
+
+  std::stringstream ss{spec};
+  std::string option;
+  while (std::getline(ss, option, ',')) {
+    auto eq = option.find('=');
+    auto name = option.substr(0, eq);
+    if (eq == std::string::npos) {
+      if (name != "ignore_rnn") {
+        return false;
+      }
+      cfg->set_ignore_rnn(true);
+      continue;
+    }
+
+    int value = 0;
+    if (!parseInt(option.substr(eq + 1), &value)) {
+      return false;
+    }
+    if (name == "local_beam") {
+      cfg->set_local_beam(value);
+    } else if (name == "global_beam_left") {
+      cfg->set_global_beam_left(value);
+    } else if (name == "global_beam_right") {
+      cfg->set_global_beam_right(value);
+    } else if (name == "global_beam_check") {
+      cfg->set_global_beam_check(value);
+    } else {
+      return false;
+    }
+  }
+  return true;
+}
+
+struct Workload {
+  std::vector<std::string> sentences;
+  // empty config means the server default
+  std::vector<JumanppConfig> configs;
+  bool configHeader = false;
+
+  void fill(u64 index, AnalysisRequest* req) const {
+    req->set_key(std::to_string(index));
+    req->set_sentence(sentences[index % sentences.size()]);
+    req->clear_config();
+    if (!configHeader && !configs.empty()) {
+      auto& cfg = configs[index % configs.size()];
+      if (cfg.ByteSizeLong() != 0) {
+        req->mutable_config()->CopyFrom(cfg);
+      }
+    }
+  }
+
+  // config header is sent once per call or stream
+  void prepare(u64 index, ::grpc::ClientContext* ctx) const {
+    if (configHeader && !configs.empty()) {
+      auto& cfg = configs[index % configs.size()];
+      if (cfg.ByteSizeLong() != 0) {
+        ctx->AddMetadata("jumanpp-config-bin", cfg.SerializeAsString());
+      }
+    }
+  }
+};
+
+// results of a single client thread
+struct ClientStats {
+  std::vector<u64> latencyUs;
+  u64 sent = 0;
+  u64 errors = 0;
+  u64 inputBytes = 0;
+  std::string lastError;
+
+  void record(BenchClock::time_point start, BenchClock::time_point end, size_t bytes) {
+    latencyUs.push_back(static_cast<u64>(std::chrono::duration_cast<std::chrono::microseconds>(end - start).count()));
+    inputBytes += bytes;
+  }
+
+  void error(const ::grpc::Status& status) {
+    errors += 1;
+    lastError = status.error_message();
+  }
+};
+
+struct RunConfig {
+  const Workload* workload;
+  BenchClock::time_point measureStart;
+  BenchClock::time_point end;
+  std::chrono::milliseconds timeout;
+  // time between requests of a single client in the open loop mode, zero for the closed loop
+  BenchClock::duration interval;
+  int clients;
+};
+
+struct Rpc {
+  const char* name;
+  // performs a unary call, empty for stream RPCs
+  std::function<::grpc::Status(JumanppJumandic::Stub*, ::grpc::ClientContext*, const AnalysisRequest&)> call;
+  // runs one stream of a client, empty for unary RPCs
+  std::function<void(JumanppJumandic::Stub*, const RunConfig&, int, ClientStats*)> stream;
+};
+
+/**
+ * Requests of client i have indices i, i + clients, i + 2 * clients, ...
+ * In the open loop mode latency is measured from the time the request was scheduled,
+ * so a slow server can not hide its queueing by slowing down the client.
+ */
+void runUnary(const Rpc& rpc, JumanppJumandic::Stub* stub, const RunConfig& run, int client, ClientStats* stats) {
+  AnalysisRequest req;
+  auto scheduled = BenchClock::now() + run.interval * client / run.clients;
+  for (u64 idx = client; ; idx += run.clients) {
+    if (run.interval != BenchClock::duration::zero()) {
+      std::this_thread::sleep_until(scheduled);
+    } else {
+      scheduled = BenchClock::now();
+    }
+    if (scheduled >= run.end) {
+      break;
+    }
+
+    run.workload->fill(idx, &req);
+    ::grpc::ClientContext ctx;
+    ctx.set_deadline(std::chrono::system_clock::now() + run.timeout);
+    run.workload->prepare(idx, &ctx);
+    auto status = rpc.call(stub, &ctx, req);
+    auto done = BenchClock::now();
+    if (scheduled >= run.measureStart) {
+      stats->sent += 1;
+      if (status.ok()) {
+        stats->record(scheduled, done, req.sentence().size());
+      } else {
+        stats->error(status);
+      }
+    }
+    scheduled += run.interval;
+  }
+}
+
+/**
+ * In the closed loop mode the client waits for each reply before writing the next request.
+ * In the open loop mode a separate thread writes requests on schedule and
+ * replies, which come in the request order, are matched with the schedule.
+ */
+template <typename Reply>
+void runStream(std::unique_ptr<::grpc::ClientReaderWriter<AnalysisRequest, Reply>> (JumanppJumandic::Stub::*method)(::grpc::ClientContext*),
+               JumanppJumandic::Stub* stub, const RunConfig& run, int client, ClientStats* stats) {
+  ::grpc::ClientContext ctx;
+  run.workload->prepare(client, &ctx);
+  auto rw = (stub->*method)(&ctx);
+  AnalysisRequest req;
+  Reply reply;
+
+  if (run.interval == BenchClock::duration::zero()) {
+    for (u64 idx = client; ; idx += run.clients) {
+      auto start = BenchClock::now();
+      if (start >= run.end) {
+        break;
+      }
+      run.workload->fill(idx, &req);
+      if (!rw->Write(req) || !rw->Read(&reply)) {
+        break;
+      }
+      if (start >= run.measureStart) {
+        stats->sent += 1;
+        stats->record(start, BenchClock::now(), req.sentence().size());
+      }
+    }
+    rw->WritesDone();
+    while (rw->Read(&reply)) {}
+  } else {
+    std::mutex mutex;
+    // scheduled time and sentence size of requests waiting for replies
+    std::deque<std::pair<BenchClock::time_point, size_t>> pending;
+
+    std::thread writer{[&]() {
+      AnalysisRequest wreq;
+      auto scheduled = BenchClock::now() + run.interval * client / run.clients;
+      for (u64 idx = client; scheduled < run.end; idx += run.clients, scheduled += run.interval) {
+        std::this_thread::sleep_until(scheduled);
+        run.workload->fill(idx, &wreq);
+        {
+          std::lock_guard<std::mutex> guard{mutex};
+          pending.emplace_back(scheduled, wreq.sentence().size());
+        }
+        if (!rw->Write(wreq)) {
+          break;
+        }
+      }
+      rw->WritesDone();
+    }};
+
+    while (rw->Read(&reply)) {
+      auto done = BenchClock::now();
+      std::pair<BenchClock::time_point, size_t> item;
+      {
+        std::lock_guard<std::mutex> guard{mutex};
+        item = pending.front();
+        pending.pop_front();
+      }
+      if (item.first >= run.measureStart) {
+        stats->sent += 1;
+        stats->record(item.first, done, item.second);
+      }
+    }
+    writer.join();
+
+    for (auto& item: pending) { // requests which did not get a reply
+      if (item.first >= run.measureStart) {
+        stats->sent += 1;
+        stats->errors += 1;
+      }
+    }
+  }
+
+  auto status = rw->Finish();
+  if (!status.ok()) {
+    stats->error(status);
+  }
+}
+
+template <typename Reply, typename Method>
+Rpc unaryRpc(const char* name, Method method) {
+  return Rpc{name, [method](JumanppJumandic::Stub* stub, ::grpc::ClientContext* ctx, const AnalysisRequest& req) {
+    Reply reply;
+    return (stub->*method)(ctx, req, &reply);
+  }, nullptr};
+}
+
+template <typename Reply, typename Method>
+Rpc streamRpc(const char* name, Method method) {
+  return Rpc{name, nullptr, [method](JumanppJumandic::Stub* stub, const RunConfig& run, int client, ClientStats* stats) {
+    runStream<Reply>(method, stub, run, client, stats);
+  }};
+}
+
+std::vector<Rpc> allRpcs() {
+  using Stub = JumanppJumandic::Stub;
+  return {
+    unaryRpc<jumanpp::JumanSentence>("Juman", &Stub::Juman),
+    streamRpc<jumanpp::JumanSentence>("JumanStream", &Stub::JumanStream),
+    unaryRpc<jumanpp::Lattice>("TopN", &Stub::TopN),
+    streamRpc<jumanpp::Lattice>("TopNStream", &Stub::TopNStream),
+    unaryRpc<jumanpp::LatticeDump>("LatticeDump", &Stub::LatticeDump),
+    streamRpc<jumanpp::LatticeDump>("LatticeDumpStream", &Stub::LatticeDumpStream),
+    unaryRpc<jumanpp::LatticeDump>("LatticeDumpWithFeatures", &Stub::LatticeDumpWithFeatures),
+    streamRpc<jumanpp::LatticeDump>("LatticeDumpWithFeaturesStream", &Stub::LatticeDumpWithFeaturesStream),
+  };
+}
+
+u64 percentile(const std::vector<u64>& sorted, double p) {
+  if (sorted.empty()) {
+    return 0;
+  }
+  auto rank = static_cast<size_t>(p * (sorted.size() - 1) + 0.5);
+  return sorted[std::min(rank, sorted.size() - 1)];
+}
+
+void writeJsonString(std::ostream& os, const std::string& str) {
+  os << '"';
+  for (char c: str) {
+    if (c == '"' || c == '\\') {
+      os << '\\' << c;
+    } else if (static_cast<unsigned char>(c) < 0x20) {
+      os << "\\u" << std::hex << std::setw(4) << std::setfill('0') << static_cast<int>(c) << std::dec;
+    } else {
+      os << c;
+    }
+  }
+  os << '"';
+}
+
+void report(std::ostream& os, const Rpc& rpc, const BenchArgs& args, std::vector<ClientStats>& clients, double seconds) {
+  std::vector<u64> latency;
+  u64 sent = 0;
+  u64 errors = 0;
+  u64 bytes = 0;
+  std::string lastError;
+  for (auto& c: clients) {
+    latency.insert(latency.end(), c.latencyUs.begin(), c.latencyUs.end());
+    sent += c.sent;
+    errors += c.errors;
+    bytes += c.inputBytes;
+    if (!c.lastError.empty()) {
+      lastError = c.lastError;
+    }
+  }
+  std::sort(latency.begin(), latency.end());
+  double mean = 0;
+  for (auto l: latency) {
+    mean += l;
+  }
+  if (!latency.empty()) {
+    mean /= latency.size();
+  }
+
+  os << "{\"rpc\": \"" << rpc.name << "\", "
+     << "\"mode\": \"" << (args.qps > 0 ? "open" : "closed") << "\", "
+     << "\"concurrency\": " << args.concurrency << ", "
+     << "\"target_qps\": " << args.qps << ", "
+     << "\"duration_s\": " << seconds << ", "
+     << "\"requests\": " << sent << ", "
+     << "\"errors\": " << errors << ", "
+     << "\"qps\": " << sent / seconds << ", "
+     << "\"sentences_per_sec\": " << latency.size() / seconds << ", "
+     << "\"input_bytes_per_sec\": " << bytes / seconds << ", "
+     << "\"latency_us\": {"
+     << "\"mean\": " << static_cast<u64>(mean) << ", "
+     << "\"p50\": " << percentile(latency, 0.5) << ", "
+     << "\"p90\": " << percentile(latency, 0.9) << ", "
+     << "\"p99\": " << percentile(latency, 0.99) << ", "
+     << "\"p999\": " << percentile(latency, 0.999) << ", "
+     << "\"max\": " << (latency.empty() ? 0 : latency.back()) << "}";
+  if (!lastError.empty()) {
+    os << ", \"last_error\": ";
+    writeJsonString(os, lastError);
+  }
+  os << "}";
+}
+
+} // namespace
+
+int main(int argc, char const *argv[]) {
+  BenchArgs args;
+  if (!BenchArgs::ParseArgs(&args, argc, argv)) {
+    std::cerr << "Failed to parse args";
+    exit(1);
+  }
+
+  Workload workload;
+  std::ifstream corpus{args.corpus};
+  if (!corpus) {
+    std::cerr << "Failed to open corpus " << args.corpus << "\n";
+    exit(1);
+  }
+  std::string line;
+  while (std::getline(corpus, line)) {
+    if (!line.empty()) {
+      workload.sentences.push_back(line);
+    }
+  }
+  if (workload.sentences.empty()) {
+    std::cerr << "Corpus " << args.corpus << " does not have any sentences\n";
+    exit(1);
+  }
+
+  for (auto& spec: args.configs) {
+    workload.configs.emplace_back();
+    if (!parseConfig(spec, &workload.configs.back())) {
+      std::cerr << "Invalid config: " << spec << "\n";
+      exit(1);
+    }
+  }
+  workload.configHeader = args.configHeader;
+
+  std::vector<Rpc> rpcs;
+  for (auto& rpc: allRpcs()) {
+    if (args.rpcs.empty() || std::find(args.rpcs.begin(), args.rpcs.end(), rpc.name) != args.rpcs.end()) {
+      rpcs.push_back(rpc);
+    }
+  }
+  if (rpcs.empty() || (!args.rpcs.empty() && rpcs.size() != args.rpcs.size())) {
+    std::cerr << "Unknown RPC name\n";
+    exit(1);
+  }
+
+  ::grpc::ChannelArguments channelArgs;
+  channelArgs.SetMaxReceiveMessageSize(-1);
+  auto channel = ::grpc::CreateCustomChannel(args.target, ::grpc::InsecureChannelCredentials(), channelArgs);
+  auto stub = JumanppJumandic::NewStub(channel);
+
+  std::ostream* os = &std::cout;
+  std::ofstream file;
+  if (!args.output.empty()) {
+    file.open(args.output);
+    os = &file;
+  }
+
+  *os << "{\"target\": ";
+  writeJsonString(*os, args.target);
+  *os << ", \"corpus\": ";
+  writeJsonString(*os, args.corpus);
+  *os << ", \"sentences\": " << workload.sentences.size() << ", \"results\": [\n";
+
+  for (size_t i = 0; i < rpcs.size(); ++i) {
+    auto& rpc = rpcs[i];
+    std::cerr << "Running " << rpc.name << "\n";
+
+    RunConfig run;
+    run.workload = &workload;
+    run.clients = args.concurrency;
+    run.timeout = std::chrono::milliseconds(args.timeoutMs);
+    run.interval = BenchClock::duration::zero();
+    if (args.qps > 0) {
+      run.interval = std::chrono::duration_cast<BenchClock::duration>(
+        std::chrono::duration<double>(args.concurrency / args.qps));
+    }
+    run.measureStart = BenchClock::now() + std::chrono::seconds(args.warmupSec);
+    run.end = run.measureStart + std::chrono::seconds(args.durationSec);
+
+    std::vector<ClientStats> stats(static_cast<size_t>(args.concurrency));
+    std::vector<std::thread> threads;
+    for (int c = 0; c < args.concurrency; ++c) {
+      threads.emplace_back([&, c]() {
+        if (rpc.stream != nullptr) {
+          rpc.stream(stub.get(), run, c, &stats[c]);
+        } else {
+          runUnary(rpc, stub.get(), run, c, &stats[c]);
+        }
+      });
+    }
+    for (auto& t: threads) {
+      t.join();
+    }
+
+    double seconds = std::max(args.durationSec, 1);
+    *os << "  ";
+    report(*os, rpc, args, stats, seconds);
+    *os << (i + 1 < rpcs.size() ? ",\n" : "\n");
+    os->flush();
+  }
+
+  *os << "]}\n";
+  return 0;
+}
@@ -0,0 +1,66 @@
+//
+// Created by Arseny Tolmachev on 2018/03/19.
+//
+
+#include "budget.h"
+
+namespace jumanpp {
+namespace grpc {
+
+::grpc::Status RequestBudget::check(const AnalysisRequest &req) const {
+  if (config_.maxInputBytes != 0 && req.sentence().size() > config_.maxInputBytes) {
+    return ::grpc::Status{::grpc::StatusCode::INVALID_ARGUMENT,
+                          "input is longer than " + std::to_string(config_.maxInputBytes) + " bytes"};
+  }
+  return ::grpc::Status::OK;
+}
+
+Status RequestBudget::initialize(const BudgetConfig &config) {
+  auto& limits = config.degraded;
+  int globalLimits = (limits.global_beam_left() > 0) + (limits.global_beam_right() > 0) +
+                     (limits.global_beam_check() > 0);
+  if (globalLimits != 0 && globalLimits != 3) {
+    return JPPS_INVALID_PARAMETER << "degraded global_beam_left, global_beam_right and global_beam_check must be set together";
+  }
+  if (config.degradeWaiters != 0 && globalLimits == 0) {
+    return JPPS_INVALID_PARAMETER << "load degradation changes only global beams, the degraded config has none";
+  }
+  config_ = config;
+  return Status::Ok();
+}
+
+bool RequestBudget::degrade(const JumanppConfig &cfg, Degradation reason, JumanppConfig *overrides) const {
+  auto& limits = config_.degraded;
+  bool changed = false;
+  // other settings would rebuild analyzers exactly when the pool is saturated
+  bool globalOnly = reason == Degradation::Load;
+
+  if (!globalOnly && limits.local_beam() > 0 && cfg.local_beam() > limits.local_beam()) {
+    overrides->set_local_beam(limits.local_beam());
+    changed = true;
+  }
+
+  // non-positive global beam means that it is disabled, so any limit makes it smaller
+  if (limits.global_beam_left() > 0 &&
+      (cfg.global_beam_left() <= 0 || cfg.global_beam_left() > limits.global_beam_left())) {
+    // zero fields are not merged, so they would keep the values of cfg
+    overrides->set_global_beam_left(limits.global_beam_left());
+    if (limits.global_beam_right() > 0) {
+      overrides->set_global_beam_right(limits.global_beam_right());
+    }
+    if (limits.global_beam_check() > 0) {
+      overrides->set_global_beam_check(limits.global_beam_check());
+    }
+    changed = true;
+  }
+
+  if (!globalOnly && limits.ignore_rnn() && !cfg.ignore_rnn()) {
+    overrides->set_ignore_rnn(true);
+    changed = true;
+  }
+
+  return changed;
+}
+
+} // namespace grpc
+} // namespace jumanpp
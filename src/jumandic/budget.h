@@ -0,0 +1,71 @@
+//
+// Created by Arseny Tolmachev on 2018/03/19.
+//
+
+#ifndef JUMANPP_GRPC_BUDGET_H
+#define JUMANPP_GRPC_BUDGET_H
+
+#include <grpc++/support/status.h>
+#include "util/types.hpp"
+#include "util/status.hpp"
+#include "metrics.h"
+#include "jumandic-svc.pb.h"
+
+namespace jumanpp {
+namespace grpc {
+
+struct BudgetConfig {
+  // longer inputs are rejected, 0 for no limit
+  size_t maxInputBytes = 0;
+  // longer inputs are analyzed with the degraded config, 0 disables
+  size_t degradeInputBytes = 0;
+  // all requests are degraded while at least this number of requests wait for an analyzer, 0 disables
+  i32 degradeWaiters = 0;
+  /**
+   * Beams of degraded requests are not larger than these, ignore_rnn is forced if it is set.
+   * Global beam limits are set together or not at all.
+   * Load degradation uses only them: analyzers change global beams without being rebuilt,
+   * local beam and ignore_rnn limits apply to long inputs.
+   */
+  JumanppConfig degraded;
+};
+
+/**
+ * Server side limits of a single request.
+ *
+ * A long input holds an analyzer for a long time, so it can be analyzed
+ * with smaller beams to keep the latency of other requests.
+ * The same happens to all requests when the analyzer pool is overloaded.
+ */
+class RequestBudget {
+  BudgetConfig config_;
+
+public:
+  // fails when the degraded limits are inconsistent or can't be used for a configured reason
+  Status initialize(const BudgetConfig& config);
+
+  // INVALID_ARGUMENT for inputs over the size limit
+  ::grpc::Status check(const AnalysisRequest& req) const;
+
+  // reason to use the degraded config, waiters is the number of requests waiting for an analyzer
+  Degradation reason(const AnalysisRequest& req, i32 waiters) const {
+    if (config_.degradeInputBytes != 0 && req.sentence().size() > config_.degradeInputBytes) {
+      return Degradation::InputLength;
+    }
+    if (config_.degradeWaiters != 0 && waiters >= config_.degradeWaiters) {
+      return Degradation::Load;
+    }
+    return Degradation::None;
+  }
+
+  /**
+   * Fills the fields of cfg which need to be changed to fit into degraded limits of the reason.
+   * @return false if cfg already is within the limits
+   */
+  bool degrade(const JumanppConfig& cfg, Degradation reason, JumanppConfig* overrides) const;
+};
+
+} // namespace grpc
+} // namespace jumanpp
+
+#endif //JUMANPP_GRPC_BUDGET_H
@@ -0,0 +1,179 @@
+//
+// Created by Arseny Tolmachev on 2018/03/22.
+//
+
+#ifndef JUMANPP_GRPC_BULK_CALL_H
+#define JUMANPP_GRPC_BULK_CALL_H
+
+#include <deque>
+#include "batch_stream_call.h"
+#include "compression.h"
+#include "jumandic/shared/juman_pb_format.h"
+
+namespace jumanpp {
+namespace grpc {
+
+/**
+ * Analyzes raw text which is streamed in chunks, one sentence per line.
+ *
+ * Lines are collected into frames of many sentences, each frame is analyzed
+ * as a batch and returned as a single (optionally compressed) message,
+ * so short sentences do not pay for a message each.
+ */
+class JumanBulkCall: public BatchStreamCallBase<BulkChunk, BulkFrame, jumandic::JumanPbFormat, JumanBulkCall> {
+  static constexpr int DefaultFrame = 256;
+  static constexpr int MaxFrame = 4096;
+  // longer lines fail the stream, otherwise text without newlines would be buffered forever
+  static constexpr size_t MaxLine = 1 << 20;
+
+  BulkOptions options_;
+  bool hasOptions_ = false;
+  // options are applied to the stream config by the first frame
+  ConfigPtr frameConfig_;
+  // the last line of the received text which has not ended yet
+  std::string partial_;
+  std::deque<std::string> lines_;
+  i64 nextLine_ = 0;
+  JumanBatchResult results_;
+  std::string serialized_;
+
+  int frameSize() const {
+    int size = options_.frame_sentences();
+    if (size <= 0) {
+      return DefaultFrame;
+    }
+    return std::min(size, MaxFrame);
+  }
+
+  static ::grpc::Status lineTooLong() {
+    return ::grpc::Status{::grpc::StatusCode::INVALID_ARGUMENT,
+                          "line is longer than " + std::to_string(MaxLine) + " bytes"};
+  }
+
+  void addLine(const char* data, size_t length) {
+    if (length != 0 && data[length - 1] == '\r') {
+      length -= 1;
+    }
+    lines_.emplace_back(data, length);
+  }
+
+public:
+  static constexpr RpcKind Kind = RpcKind::JumanBulk;
+
+  explicit JumanBulkCall(JumanppGrpcEnv* env): BatchStreamCallBase(env) {}
+
+  void reset() {
+    options_.Clear();
+    hasOptions_ = false;
+    frameConfig_.reset();
+    partial_.clear();
+    lines_.clear();
+    nextLine_ = 0;
+    results_.Clear();
+  }
+
+  void startRequest() {
+    env_->service().RequestJumanBulk(&context_, &rw_, env_->poolQueue(), env_->poolQueue(), this);
+  }
+
+  ::grpc::Status consume(BulkChunk* chunk) {
+    if (!hasOptions_) {
+      options_.Swap(chunk->mutable_options());
+      hasOptions_ = true;
+      if (!Compression_IsValid(options_.compression())) {
+        return ::grpc::Status{::grpc::StatusCode::INVALID_ARGUMENT, "unknown compression"};
+      }
+    }
+
+    auto& text = chunk->text();
+    size_t start = 0;
+    for (auto pos = text.find('\n'); pos != std::string::npos; pos = text.find('\n', start)) {
+      if (partial_.size() + (pos - start) > MaxLine) {
+        return lineTooLong();
+      }
+      if (partial_.empty()) {
+        addLine(text.data() + start, pos - start);
+      } else {
+        partial_.append(text, start, pos - start);
+        addLine(partial_.data(), partial_.size());
+        partial_.clear();
+      }
+      start = pos + 1;
+    }
+    if (partial_.size() + (text.size() - start) > MaxLine) {
+      return lineTooLong();
+    }
+    partial_.append(text, start, std::string::npos);
+    return ::grpc::Status::OK;
+  }
+
+  bool batchReady(bool readsDone) {
+    if (readsDone && !partial_.empty()) { // text does not end with a newline
+      addLine(partial_.data(), partial_.size());
+      partial_.clear();
+    }
+    auto available = static_cast<int>(lines_.size());
+    return available >= frameSize() || (readsDone && available != 0);
+  }
+
+  ConfigPtr prepareBatch(AnalysisBatch* batch, BulkFrame* frame) {
+    if (!frameConfig_) {
+      frameConfig_ = config_;
+      if (options_.has_config()) {
+        frameConfig_ = env_->configs().merged(*config_, options_.config());
+      }
+    }
+
+    int size = std::min(frameSize(), static_cast<int>(lines_.size()));
+    auto requests = batch->mutable_requests();
+    requests->Reserve(size);
+    auto sentences = results_.mutable_sentences();
+    sentences->Reserve(size);
+    for (int i = 0; i < size; ++i) {
+      requests->Add()->mutable_sentence()->swap(lines_.front());
+      lines_.pop_front();
+      sentences->Add();
+    }
+
+    frame->set_first_line(nextLine_);
+    frame->set_sentences(size);
+    frame->set_compression(options_.compression());
+    nextLine_ += size;
+    return frameConfig_;
+  }
+
+  ::grpc::Status completeReply(BulkFrame* frame) {
+    bool ok = true;
+    if (options_.compression() == Compression::Uncompressed) {
+      ok = results_.SerializeToString(frame->mutable_data());
+    } else {
+      ok = results_.SerializeToString(&serialized_) &&
+           compressFrame(options_.compression(), serialized_, frame->mutable_data());
+    }
+    results_.Clear();
+    if (!ok) {
+      return ::grpc::Status{::grpc::StatusCode::INTERNAL, "failed to compress a frame"};
+    }
+    return ::grpc::Status::OK;
+  }
+
+  JumanSentence* slot(int index) { return results_.mutable_sentences(index); }
+
+  Status formatOutput(jumandic::JumanPbFormat* output, CachedAnalyzer* ana, const AnalysisRequest& /*req*/, int index) {
+    if (!output->isInitialized()) {
+      JPP_RETURN_IF_ERROR(output->initialize(ana->analyzer()->output(), env_->idResolver(), false));
+    }
+    JPP_RETURN_IF_ERROR(output->format(*ana->analyzer(), ""));
+    auto sentence = results_.mutable_sentences(index);
+    sentence->CopyFrom(*output->objectPtr());
+    if (idsOnly_) {
+      env_->grammar().strip(sentence);
+    }
+    return Status::Ok();
+  }
+};
+
+} // namespace grpc
+} // namespace jumanpp
+
+#endif //JUMANPP_GRPC_BULK_CALL_H
@@ -0,0 +1,69 @@
+//
+// Created by Arseny Tolmachev on 2018/03/15.
+//
+
+#ifndef JUMANPP_GRPC_CALL_ARENA_H
+#define JUMANPP_GRPC_CALL_ARENA_H
+
+#include <atomic>
+#include <google/protobuf/arena.h>
+#include "util/types.hpp"
+
+namespace jumanpp {
+namespace grpc {
+
+/**
+ * Protobuf arena for messages of a single call or stream message.
+ * The first block is a part of the object, so messages of small calls
+ * do not need arena blocks from the heap. Contents of string fields which
+ * do not fit into the small string buffer are still allocated with malloc.
+ */
+template <size_t InitialBlock>
+class CallArena {
+  alignas(16) char block_[InitialBlock];
+  ::google::protobuf::Arena arena_;
+
+  static ::google::protobuf::ArenaOptions options(char* block) {
+    ::google::protobuf::ArenaOptions opts;
+    opts.initial_block = block;
+    opts.initial_block_size = InitialBlock;
+    return opts;
+  }
+
+public:
+  CallArena(): arena_{options(block_)} {}
+
+  template <typename T>
+  T* create() {
+    return ::google::protobuf::Arena::CreateMessage<T>(&arena_);
+  }
+
+  ::google::protobuf::Arena* get() { return &arena_; }
+  u64 spaceUsed() const { return arena_.SpaceUsed(); }
+  // the arena had to allocate blocks on the heap
+  bool overflowed() const { return arena_.SpaceAllocated() > InitialBlock; }
+
+  // frees everything except the initial block, messages created before become invalid
+  void reset() { arena_.Reset(); }
+};
+
+// arena usage over all calls
+struct ArenaCounters {
+  std::atomic<u64> arenas{0};
+  std::atomic<u64> overflows{0};
+  std::atomic<u64> bytesUsed{0};
+
+  template <size_t N>
+  void record(const CallArena<N>& arena) {
+    arenas.fetch_add(1, std::memory_order_relaxed);
+    if (arena.overflowed()) {
+      overflows.fetch_add(1, std::memory_order_relaxed);
+    }
+    bytesUsed.fetch_add(arena.spaceUsed(), std::memory_order_relaxed);
+  }
+};
+
+} // namespace grpc
+} // namespace jumanpp
+
+#endif //JUMANPP_GRPC_CALL_ARENA_H
@@ -0,0 +1,104 @@
+//
+// Created by Arseny Tolmachev on 2018/03/15.
+//
+
+#ifndef JUMANPP_GRPC_CALL_POOL_H
+#define JUMANPP_GRPC_CALL_POOL_H
+
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include <vector>
+
+namespace jumanpp {
+namespace grpc {
+
+class JumanppGrpcEnv;
+
+/**
+ * Storage for an object which can be destroyed and created again at the same address.
+ * gRPC contexts and writers can not be reset, so reused calls recreate them.
+ * References to the object stay valid after the recreation.
+ */
+template <typename T>
+class InPlace {
+  typename std::aligned_storage<sizeof(T), alignof(T)>::type storage_;
+  bool alive_ = false;
+
+public:
+  InPlace() { emplace(); }
+  ~InPlace() { destroy(); }
+  InPlace(const InPlace&) = delete;
+  InPlace& operator=(const InPlace&) = delete;
+
+  T& get() { return *reinterpret_cast<T*>(&storage_); }
+
+  void emplace() {
+    new (&storage_) T();
+    alive_ = true;
+  }
+
+  void destroy() {
+    if (alive_) {
+      get().~T();
+      alive_ = false;
+    }
+  }
+};
+
+/**
+ * Finished calls of a single type, ready to accept a new RPC.
+ * They keep formatters and message buffers of the previous use.
+ *
+ * Call needs to implement
+ *  bool recycle() which releases per RPC state and returns false if the object should be deleted and
+ *  void revive() which prepares it for the next RPC.
+ */
+template <typename Call>
+class CallPool {
+  std::mutex mutex_;
+  std::vector<Call*> idle_;
+
+  static constexpr size_t MaxIdle = 256;
+
+public:
+  static CallPool& instance() {
+    static CallPool pool;
+    return pool;
+  }
+
+  Call* take(JumanppGrpcEnv* env) {
+    std::unique_lock<std::mutex> lock{mutex_};
+    if (idle_.empty()) {
+      lock.unlock();
+      return new Call{env};
+    }
+    auto call = idle_.back();
+    idle_.pop_back();
+    lock.unlock();
+    call->revive();
+    return call;
+  }
+
+  void put(Call* call) {
+    if (call->recycle()) {
+      std::lock_guard<std::mutex> guard{mutex_};
+      if (idle_.size() < MaxIdle) {
+        idle_.push_back(call);
+        return;
+      }
+    }
+    delete call;
+  }
+
+  ~CallPool() {
+    for (auto call: idle_) {
+      delete call;
+    }
+  }
+};
+
+} // namespace grpc
+} // namespace jumanpp
+
+#endif //JUMANPP_GRPC_CALL_POOL_H
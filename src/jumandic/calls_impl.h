@@ -7,7 +7,11 @@
 
 #include "stream_call.h"
 #include "unary_call.h"
-#include "core/proto/lattice_dump_output.h"
+#include "batch_call.h"
+#include "document_call.h"
+#include "bulk_call.h"
+#include "columnar_format.h"
+#include "lattice_filter.h"
 #include "jumandic/shared/juman_pb_format.h"
 #include "jumandic/shared/jumanpp_pb_format.h"
 
@@ -15,8 +19,10 @@ namespace jumanpp {
 namespace grpc {
 
 class DefaultConfigCall : public BaseUnaryCall<JumanppConfig, DefaultConfigCall> {
-  JumanppConfig topConf_;
+  JumanppConfig& topConf_ = *arena_.create<JumanppConfig>();
 public:
+  static constexpr RpcKind Kind = RpcKind::DefaultConfig;
+
   explicit DefaultConfigCall(JumanppGrpcEnv* env): BaseUnaryCall(env) {}
 
   void startCall() {
@@ -25,71 +31,152 @@ public:
 
   void handleCall() {
     topConf_.CopyFrom(env_->defaultConfig());
-    replier_.Finish(config_, ::grpc::Status::OK, this);
+    finish(config_->config);
+  }
+};
+
+class MetricsCall : public BaseUnaryCall<MetricsReply, MetricsCall> {
+  MetricsRequest& request_ = *arena_.create<MetricsRequest>();
+  MetricsReply& reply_ = *arena_.create<MetricsReply>();
+public:
+  static constexpr RpcKind Kind = RpcKind::Metrics;
+
+  explicit MetricsCall(JumanppGrpcEnv* env): BaseUnaryCall(env) {}
+
+  void startCall() {
+    env_->service().RequestMetrics(&context_, &request_, &replier_, env_->poolQueue(), env_->poolQueue(), this);
+  }
+
+  void handleCall() {
+    reply_.set_text(env_->metricsText());
+    finish(reply_);
+  }
+};
+
+class DictionaryTablesCall : public BaseUnaryCall<DictionaryTablesReply, DictionaryTablesCall> {
+  DictionaryTablesRequest& request_ = *arena_.create<DictionaryTablesRequest>();
+  DictionaryTablesReply& reply_ = *arena_.create<DictionaryTablesReply>();
+public:
+  static constexpr RpcKind Kind = RpcKind::DictionaryTables;
+
+  explicit DictionaryTablesCall(JumanppGrpcEnv* env): BaseUnaryCall(env) {}
+
+  void startCall() {
+    env_->service().RequestDictionaryTables(&context_, &request_, &replier_, env_->poolQueue(), env_->poolQueue(), this);
+  }
+
+  void handleCall() {
+    env_->grammar().fill(request_, &reply_);
+    finish(reply_);
   }
 };
 
 class JumanUnaryCall : public AnaReqBasedUnaryCall<JumanSentence, JumanUnaryCall> {
   jumandic::JumanPbFormat output_;
+  // the formatter owns its sentence, so names are removed from a copy
+  JumanSentence stripped_;
 
 public:
+  static constexpr RpcKind Kind = RpcKind::Juman;
+
   explicit JumanUnaryCall(JumanppGrpcEnv* env): AnaReqBasedUnaryCall(env) {}
 
   void startCall() {
-    env_->service().RequestJuman(&context_, &req_, &replier_, env_->poolQueue(), env_->poolQueue(), this);
+    env_->service().RequestJuman(&context_, &request_, &replier_, env_->poolQueue(), env_->poolQueue(), this);
   }
 
-  void handleOutput(CachedAnalyzer* ana) {
-    Status s = output_.initialize(ana->analyzer()->output(), env_->idResolver(), false);
-    if (!s) {
-      replier_.FinishWithError(
-        ::grpc::Status{::grpc::StatusCode::INTERNAL, s.message().str()},
-        this);
-      return;
+  Status formatOutput(CachedAnalyzer* ana) {
+    // pooled calls keep the formatter initialized
+    if (!output_.isInitialized()) {
+      JPP_RETURN_IF_ERROR(output_.initialize(ana->analyzer()->output(), env_->idResolver(), false));
     }
-
-    s = output_.format(*ana->analyzer(), req_.key());
-    if (!s) {
-      replier_.FinishWithError(
-        ::grpc::Status{::grpc::StatusCode::INTERNAL, s.message().str()},
-        this);
-      return;
+    JPP_RETURN_IF_ERROR(output_.format(*ana->analyzer(), "")); // comment goes to the wire separately
+    if (idsOnly_) {
+      stripped_.CopyFrom(*output_.objectPtr());
+      env_->grammar().strip(&stripped_);
     }
-
-    replier_.Finish(*output_.objectPtr(), ::grpc::Status::OK, this);
+    return Status::Ok();
   }
 
+  const JumanSentence& reply() const { return idsOnly_ ? stripped_ : *output_.objectPtr(); }
 };
 
-class JumanStreamCall : public BidiStreamCallBase<JumanSentence, JumanStreamCall> {
+class JumanStreamCall : public BidiStreamCallBase<JumanSentence, jumandic::JumanPbFormat, JumanStreamCall> {
 public:
-  jumandic::JumanPbFormat output_;
+  static constexpr RpcKind Kind = RpcKind::JumanStream;
 
   explicit JumanStreamCall(JumanppGrpcEnv* env): BidiStreamCallBase(env) {}
 
   void startRequest() {
-    env_->service().RequestJumanStream(&context_, &rw_, env_->mainQueue(), env_->poolQueue(), this);
+    env_->service().RequestJumanStream(&context_, &rw_, env_->poolQueue(), env_->poolQueue(), this);
   }
 
-  void sendReply(CachedAnalyzer* an) {
+  Status formatOutput(jumandic::JumanPbFormat* output, CachedAnalyzer* an, const AnalysisRequest& /*req*/) {
+    if (!output->isInitialized()) {
+      JPP_RETURN_IF_ERROR(output->initialize(an->analyzer()->output(), env_->idResolver(), false));
+    }
+
+    JPP_RETURN_IF_ERROR(output->format(*an->analyzer(), ""));
+    if (idsOnly_) {
+      env_->grammar().strip(reply(output));
+    }
+    return Status::Ok();
+  }
+};
+
+class JumanColumnsUnaryCall : public AnaReqBasedUnaryCall<ColumnarSentence, JumanColumnsUnaryCall> {
+  ColumnarFormat output_;
+
+public:
+  static constexpr RpcKind Kind = RpcKind::JumanColumns;
+
+  explicit JumanColumnsUnaryCall(JumanppGrpcEnv* env): AnaReqBasedUnaryCall(env) {}
+
+  void startCall() {
+    env_->service().RequestJumanColumns(&context_, &request_, &replier_, env_->poolQueue(), env_->poolQueue(), this);
+  }
+
+  Status formatOutput(CachedAnalyzer* ana) {
     if (!output_.isInitialized()) {
-      auto s = output_.initialize(an->analyzer()->output(), env_->idResolver(), false);
-      if (!s) {
-        rw_.Finish(::grpc::Status{::grpc::StatusCode::INTERNAL, s.message().str()}, &outputTag_);
-        state_ = Failed;
-        return;
-      }
+      JPP_RETURN_IF_ERROR(output_.initialize(ana->analyzer()->output(), env_->idResolver()));
     }
+    output_.namesTo(idsOnly_ ? &env_->grammar() : nullptr);
+    return output_.format(*ana->analyzer(), ""); // comment goes to the wire separately
+  }
+
+  const ColumnarSentence& reply() const { return *output_.objectPtr(); }
+};
 
-    Status s = output_.format(*an->analyzer(), an->comment());
+class JumanColumnsStreamCall : public BidiStreamCallBase<ColumnarSentence, ColumnarFormat, JumanColumnsStreamCall> {
+  GrammarNameFilter sentNames_;
 
-    if (!s) {
-      rw_.Finish(::grpc::Status{::grpc::StatusCode::INTERNAL, s.message().str()}, &outputTag_);
-      state_ = Failed;
-      return;
+public:
+  static constexpr RpcKind Kind = RpcKind::JumanColumnsStream;
+
+  explicit JumanColumnsStreamCall(JumanppGrpcEnv* env): BidiStreamCallBase(env) {}
+
+  void reset() {
+    sentNames_.reset();
+  }
+
+  void startRequest() {
+    env_->service().RequestJumanColumnsStream(&context_, &rw_, env_->poolQueue(), env_->poolQueue(), this);
+  }
+
+  Status formatOutput(ColumnarFormat* output, CachedAnalyzer* an, const AnalysisRequest& /*req*/) {
+    if (!output->isInitialized()) {
+      JPP_RETURN_IF_ERROR(output->initialize(an->analyzer()->output(), env_->idResolver()));
     }
 
-    rw_.Write(*output_.objectPtr(), &outputTag_);
+    output->namesTo(idsOnly_ ? &env_->grammar() : nullptr);
+    return output->format(*an->analyzer(), "");
+  }
+
+  ColumnarSentence* reply(ColumnarFormat* output) { return output->mutableObject(); }
+
+  // replies (cached ones too) contain all their names, the client has seen some of them
+  void outgoing(ColumnarSentence* reply) {
+    sentNames_.filter(reply);
   }
 };
 
@@ -97,206 +184,202 @@ class TopNUnaryCall : public AnaReqBasedUnaryCall<Lattice, TopNUnaryCall> {
   jumandic::JumanppProtobufOutput output_;
 
 public:
+  static constexpr RpcKind Kind = RpcKind::TopN;
+
   explicit TopNUnaryCall(JumanppGrpcEnv* env): AnaReqBasedUnaryCall(env) {}
 
   void startCall() {
-    env_->service().RequestTopN(&context_, &req_, &replier_, env_->poolQueue(), env_->poolQueue(), this);
+    env_->service().RequestTopN(&context_, &request_, &replier_, env_->poolQueue(), env_->poolQueue(), this);
   }
 
-  void handleOutput(CachedAnalyzer* ana) {
+  Status formatOutput(CachedAnalyzer* ana) {
     int topN = req_.top_n();
     if (topN == 0) {
       topN = ana->localBeam();
     }
 
-    Status s = output_.initialize(ana->analyzer()->output(), env_->idResolver(), topN, false);
-    if (!s) {
-      replier_.FinishWithError(
-        ::grpc::Status{::grpc::StatusCode::INTERNAL, s.message().str()},
-        this);
-      return;
-    }
-
-    s = output_.format(*ana->analyzer(), req_.key());
-    if (!s) {
-      replier_.FinishWithError(
-        ::grpc::Status{::grpc::StatusCode::INTERNAL, s.message().str()},
-        this);
-      return;
+    if (!output_.isInitialized()) {
+      JPP_RETURN_IF_ERROR(output_.initialize(ana->analyzer()->output(), env_->idResolver(), 1, false));
     }
-
-    replier_.Finish(*output_.objectPtr(), ::grpc::Status::OK, this);
+    output_.setTopN(topN);
+    return output_.format(*ana->analyzer(), ""); // comment goes to the wire separately
   }
+
+  const Lattice& reply() const { return *output_.objectPtr(); }
 };
 
-class TopNStreamCall : public BidiStreamCallBase<Lattice, TopNStreamCall> {
+class TopNStreamCall : public BidiStreamCallBase<Lattice, jumandic::JumanppProtobufOutput, TopNStreamCall> {
 public:
-  jumandic::JumanppProtobufOutput output_;
+  static constexpr RpcKind Kind = RpcKind::TopNStream;
 
   explicit TopNStreamCall(JumanppGrpcEnv* env): BidiStreamCallBase(env) {}
 
   void startRequest() {
-    env_->service().RequestTopNStream(&context_, &rw_, env_->mainQueue(), env_->poolQueue(), this);
+    env_->service().RequestTopNStream(&context_, &rw_, env_->poolQueue(), env_->poolQueue(), this);
   }
 
-  void sendReply(CachedAnalyzer* an) {
-    if (!output_.isInitialized()) {
-      Status s = output_.initialize(an->analyzer()->output(), env_->idResolver(), 1, false);
-      if (!s) {
-        rw_.Finish(::grpc::Status{::grpc::StatusCode::INTERNAL, s.message().str()}, &outputTag_);
-        state_ = Failed;
-        return;
-      }
+  Status formatOutput(jumandic::JumanppProtobufOutput* output, CachedAnalyzer* an, const AnalysisRequest& req) {
+    if (!output->isInitialized()) {
+      JPP_RETURN_IF_ERROR(output->initialize(an->analyzer()->output(), env_->idResolver(), 1, false));
     }
 
-    int topN = input_.top_n();
+    int topN = req.top_n();
     if (topN == 0) {
       topN = an->localBeam();
     }
 
-    output_.setTopN(topN);
-    Status s = output_.format(*an->analyzer(), an->comment());
+    output->setTopN(topN);
+    return output->format(*an->analyzer(), "");
+  }
+};
 
-    if (!s) {
-      rw_.Finish(::grpc::Status{::grpc::StatusCode::INTERNAL, s.message().str()}, &outputTag_);
-      state_ = Failed;
-      return;
-    }
+// lattice dumps of unary calls, with or without features
+template <bool AllFeatures, typename Child>
+class LatticeDumpUnaryBase : public AnaReqBasedUnaryCall<LatticeDump, Child> {
+  LatticeDumpFormat<AllFeatures> output_;
 
-    rw_.Write(*output_.objectPtr(), &outputTag_);
+public:
+  explicit LatticeDumpUnaryBase(JumanppGrpcEnv* env): AnaReqBasedUnaryCall<LatticeDump, Child>(env) {
+    this->allFeatures_ = AllFeatures;
   }
+
+  ::grpc::Status checkRequest(const AnalysisRequest& req) const { return LatticeDumpFilter::check(req); }
+
+  Status formatOutput(CachedAnalyzer* ana) {
+    return output_.format(ana, "", this->req_); // comment goes to the wire separately
+  }
+
+  const LatticeDump& reply() const { return *output_.objectPtr(); }
 };
 
-class LatticeDumpUnaryCall : public  AnaReqBasedUnaryCall<LatticeDump, LatticeDumpUnaryCall> {
+// lattice dumps of streaming calls, with or without features
+template <bool AllFeatures, typename Child>
+class LatticeDumpStreamBase : public BidiStreamCallBase<LatticeDump, LatticeDumpFormat<AllFeatures>, Child> {
 public:
-  explicit LatticeDumpUnaryCall(JumanppGrpcEnv* env): AnaReqBasedUnaryCall(env) {}
-
+  explicit LatticeDumpStreamBase(JumanppGrpcEnv* env):
+      BidiStreamCallBase<LatticeDump, LatticeDumpFormat<AllFeatures>, Child>(env) {
+    this->allFeatures_ = AllFeatures;
+  }
 
-  core::output::LatticeDumpOutput output_{false, false};
+  ::grpc::Status checkRequest(const AnalysisRequest& req) const { return LatticeDumpFilter::check(req); }
 
-  void startCall() {
-    env_->service().RequestLatticeDump(&context_, &req_, &replier_, env_->poolQueue(), env_->poolQueue(), this);
+  Status formatOutput(LatticeDumpFormat<AllFeatures>* output, CachedAnalyzer* an, const AnalysisRequest& req) {
+    return output->format(an, "", req);
   }
+};
 
-  void handleOutput(CachedAnalyzer* ana) {
-    Status s = output_.initialize(ana->impl(), &ana->analyzer()->scorer()->feature->weights());
-    if (!s) {
-      replier_.FinishWithError(
-        ::grpc::Status{::grpc::StatusCode::INTERNAL, s.message().str()},
-        this);
-      return;
-    }
+class LatticeDumpUnaryCall : public LatticeDumpUnaryBase<false, LatticeDumpUnaryCall> {
+public:
+  static constexpr RpcKind Kind = RpcKind::LatticeDump;
 
-    s = output_.format(*ana->analyzer(), req_.key());
-    if (!s) {
-      replier_.FinishWithError(
-        ::grpc::Status{::grpc::StatusCode::INTERNAL, s.message().str()},
-        this);
-      return;
-    }
+  explicit LatticeDumpUnaryCall(JumanppGrpcEnv* env): LatticeDumpUnaryBase(env) {}
 
-    replier_.Finish(*output_.objectPtr(), ::grpc::Status::OK, this);
+  void startCall() {
+    env_->service().RequestLatticeDump(&context_, &request_, &replier_, env_->poolQueue(), env_->poolQueue(), this);
   }
 };
 
-class LatticeDumpStreamImpl: public BidiStreamCallBase<LatticeDump, LatticeDumpStreamImpl> {
+class LatticeDumpStreamImpl: public LatticeDumpStreamBase<false, LatticeDumpStreamImpl> {
 public:
-  core::output::LatticeDumpOutput output_{false, false};
+  static constexpr RpcKind Kind = RpcKind::LatticeDumpStream;
 
-  explicit LatticeDumpStreamImpl(JumanppGrpcEnv* env): BidiStreamCallBase(env) {}
+  explicit LatticeDumpStreamImpl(JumanppGrpcEnv* env): LatticeDumpStreamBase(env) {}
 
   void startRequest() {
-    env_->service().RequestLatticeDumpStream(&context_, &rw_, env_->mainQueue(), env_->poolQueue(), this);
-  }
-
-  void sendReply(CachedAnalyzer* an) {
-    if (!output_.wasInitialized()) {
-      auto aimpl = an->impl();
-      auto weights = an->weights();
-      auto s = output_.initialize(aimpl, weights);
-      if (!s) {
-        rw_.Finish(::grpc::Status{::grpc::StatusCode::INTERNAL, s.message().str()}, &outputTag_);
-        state_ = Failed;
-        return;
-      }
-    }
+    env_->service().RequestLatticeDumpStream(&context_, &rw_, env_->poolQueue(), env_->poolQueue(), this);
+  }
+};
 
-    Status s = output_.format(*an->analyzer(), an->comment());
+class FullLatticeDumpUnaryCall : public LatticeDumpUnaryBase<true, FullLatticeDumpUnaryCall> {
+public:
+  static constexpr RpcKind Kind = RpcKind::LatticeDumpWithFeatures;
 
-    if (!s) {
-      rw_.Finish(::grpc::Status{::grpc::StatusCode::INTERNAL, s.message().str()}, &outputTag_);
-      state_ = Failed;
-      return;
-    }
+  explicit FullLatticeDumpUnaryCall(JumanppGrpcEnv* env): LatticeDumpUnaryBase(env) {}
 
-    rw_.Write(*output_.objectPtr(), &outputTag_);
+  void startCall() {
+    env_->service().RequestLatticeDumpWithFeatures(&context_, &request_, &replier_, env_->poolQueue(), env_->poolQueue(), this);
   }
 };
 
-class FullLatticeDumpUnaryCall : public AnaReqBasedUnaryCall<LatticeDump, FullLatticeDumpUnaryCall> {
+class LatticeDumpStreamFullImpl: public LatticeDumpStreamBase<true, LatticeDumpStreamFullImpl> {
 public:
-  explicit FullLatticeDumpUnaryCall(JumanppGrpcEnv* env): AnaReqBasedUnaryCall(env) {
-    allFeatures_ = true;
+  static constexpr RpcKind Kind = RpcKind::LatticeDumpWithFeaturesStream;
+
+  explicit LatticeDumpStreamFullImpl(JumanppGrpcEnv* env): LatticeDumpStreamBase(env) {}
+
+  void startRequest() {
+    env_->service().RequestLatticeDumpWithFeaturesStream(&context_, &rw_, env_->poolQueue(), env_->poolQueue(), this);
   }
+};
+
+class JumanBatchCall : public BatchUnaryCall<JumanBatchResult, jumandic::JumanPbFormat, JumanBatchCall> {
+public:
+  static constexpr RpcKind Kind = RpcKind::JumanBatch;
 
-  core::output::LatticeDumpOutput output_{true, false};
+  explicit JumanBatchCall(JumanppGrpcEnv* env): BatchUnaryCall(env) {}
 
   void startCall() {
-    env_->service().RequestLatticeDumpWithFeatures(&context_, &req_, &replier_, env_->poolQueue(), env_->poolQueue(), this);
+    env_->service().RequestJumanBatch(&context_, &batch_, &replier_, env_->poolQueue(), env_->poolQueue(), this);
   }
 
-  void handleOutput(CachedAnalyzer* ana) {
-    Status s = output_.initialize(ana->impl(), &ana->analyzer()->scorer()->feature->weights());
-    if (!s) {
-      replier_.FinishWithError(
-        ::grpc::Status{::grpc::StatusCode::INTERNAL, s.message().str()},
-        this);
-      return;
+  void prepareReply(int size) {
+    auto sentences = reply_.mutable_sentences();
+    sentences->Reserve(size);
+    for (int i = 0; i < size; ++i) {
+      sentences->Add();
     }
+  }
 
-    s = output_.format(*ana->analyzer(), req_.key());
-    if (!s) {
-      replier_.FinishWithError(
-        ::grpc::Status{::grpc::StatusCode::INTERNAL, s.message().str()},
-        this);
-      return;
-    }
+  JumanSentence* slot(int index) { return reply_.mutable_sentences(index); }
 
-    replier_.Finish(*output_.objectPtr(), ::grpc::Status::OK, this);
+  Status formatOutput(jumandic::JumanPbFormat* output, CachedAnalyzer* ana, const AnalysisRequest& req, int index) {
+    if (!output->isInitialized()) {
+      JPP_RETURN_IF_ERROR(output->initialize(ana->analyzer()->output(), env_->idResolver(), false));
+    }
+    JPP_RETURN_IF_ERROR(output->format(*ana->analyzer(), req.key()));
+    auto sentence = reply_.mutable_sentences(index);
+    sentence->CopyFrom(*output->objectPtr());
+    if (idsOnly_) {
+      env_->grammar().strip(sentence);
+    }
+    return Status::Ok();
   }
 };
 
-class LatticeDumpStreamFullImpl: public BidiStreamCallBase<LatticeDump, LatticeDumpStreamFullImpl> {
+class TopNBatchCall : public BatchUnaryCall<LatticeBatchResult, jumandic::JumanppProtobufOutput, TopNBatchCall> {
 public:
-  core::output::LatticeDumpOutput output_{true, false};
+  static constexpr RpcKind Kind = RpcKind::TopNBatch;
 
-  explicit LatticeDumpStreamFullImpl(JumanppGrpcEnv* env): BidiStreamCallBase(env) {}
+  explicit TopNBatchCall(JumanppGrpcEnv* env): BatchUnaryCall(env) {}
 
-  void startRequest() {
-    env_->service().RequestLatticeDumpWithFeaturesStream(&context_, &rw_, env_->mainQueue(), env_->poolQueue(), this);
-  }
-
-  void sendReply(CachedAnalyzer* an) {
-    if (!output_.wasInitialized()) {
-      auto aimpl = an->impl();
-      auto weights = an->weights();
-      auto s = output_.initialize(aimpl, weights);
-      if (!s) {
-        rw_.Finish(::grpc::Status{::grpc::StatusCode::INTERNAL, s.message().str()}, &outputTag_);
-        state_ = Failed;
-        return;
-      }
+  void startCall() {
+    env_->service().RequestTopNBatch(&context_, &batch_, &replier_, env_->poolQueue(), env_->poolQueue(), this);
+  }
+
+  void prepareReply(int size) {
+    auto lattices = reply_.mutable_lattices();
+    lattices->Reserve(size);
+    for (int i = 0; i < size; ++i) {
+      lattices->Add();
     }
+  }
+
+  Lattice* slot(int index) { return reply_.mutable_lattices(index); }
 
-    Status s = output_.format(*an->analyzer(), an->comment());
+  Status formatOutput(jumandic::JumanppProtobufOutput* output, CachedAnalyzer* ana, const AnalysisRequest& req, int index) {
+    if (!output->isInitialized()) {
+      JPP_RETURN_IF_ERROR(output->initialize(ana->analyzer()->output(), env_->idResolver(), 1, false));
+    }
 
-    if (!s) {
-      rw_.Finish(::grpc::Status{::grpc::StatusCode::INTERNAL, s.message().str()}, &outputTag_);
-      state_ = Failed;
-      return;
+    int topN = req.top_n();
+    if (topN == 0) {
+      topN = ana->localBeam();
     }
 
-    rw_.Write(*output_.objectPtr(), &outputTag_);
+    output->setTopN(topN);
+    JPP_RETURN_IF_ERROR(output->format(*ana->analyzer(), req.key()));
+    reply_.mutable_lattices(index)->CopyFrom(*output->objectPtr());
+    return Status::Ok();
   }
 };
 
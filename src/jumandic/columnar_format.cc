@@ -0,0 +1,102 @@
+//
+// Created by Arseny Tolmachev on 2018/03/23.
+//
+
+#include "columnar_format.h"
+#include <algorithm>
+
+namespace jumanpp {
+namespace grpc {
+
+namespace {
+
+u32 endOf(const std::string& column) {
+  return static_cast<u32>(column.size());
+}
+
+} // namespace
+
+Status ColumnarFormat::initialize(const core::analysis::OutputManager& om,
+                                  const jumandic::JumandicIdResolver* resolver) {
+  return juman_.initialize(om, resolver, false);
+}
+
+void ColumnarFormat::addName(GrammarField field, i32 parent, i32 id, const std::string& name) {
+  if (tables_ != nullptr) {
+    tables_->record(field, parent, id, name);
+    return;
+  }
+  auto key = grammarNameKey(field, parent, id);
+  // a sentence uses only a handful of distinct ids
+  if (std::find(named_.begin(), named_.end(), key) != named_.end()) {
+    return;
+  }
+  named_.push_back(key);
+  auto entry = columns_.add_names();
+  entry->set_field(field);
+  entry->set_parent(parent);
+  entry->set_id(id);
+  entry->set_name(name);
+}
+
+void ColumnarFormat::addRow(const JumanMorpheme& morpheme) {
+  columns_.mutable_surfaces()->append(morpheme.surface());
+  columns_.add_surface_ends(endOf(columns_.surfaces()));
+  columns_.mutable_readings()->append(morpheme.reading());
+  columns_.add_reading_ends(endOf(columns_.readings()));
+  columns_.mutable_baseforms()->append(morpheme.baseform());
+  columns_.add_baseform_ends(endOf(columns_.baseforms()));
+
+  auto& ids = morpheme.posid();
+  auto& names = morpheme.stringpos();
+  columns_.add_pos(ids.pos());
+  columns_.add_subpos(ids.subpos());
+  columns_.add_conj_type(ids.conjtype());
+  columns_.add_conj_form(ids.conjform());
+  addName(GrammarField::Pos, 0, ids.pos(), names.pos());
+  addName(GrammarField::Subpos, ids.pos(), ids.subpos(), names.subpos());
+  addName(GrammarField::ConjType, 0, ids.conjtype(), names.conjtype());
+  addName(GrammarField::ConjForm, ids.conjtype(), ids.conjform(), names.conjform());
+
+  auto features = columns_.mutable_features();
+  auto start = features->size();
+  for (auto& f: morpheme.features()) {
+    if (features->size() != start) {
+      features->push_back(' ');
+    }
+    features->append(f.key());
+    if (!f.value().empty()) {
+      features->push_back(':');
+      features->append(f.value());
+    }
+  }
+  columns_.add_feature_ends(endOf(*features));
+}
+
+Status ColumnarFormat::format(const core::analysis::Analyzer& analyzer, StringPiece comment) {
+  JPP_RETURN_IF_ERROR(juman_.format(analyzer, comment));
+  auto& sentence = *juman_.objectPtr();
+
+  columns_.Clear();
+  named_.clear();
+  columns_.set_comment(sentence.comment());
+  for (auto& m: sentence.morphemes()) {
+    addRow(m);
+    for (auto& v: m.variants()) {
+      columns_.add_variant_rows(static_cast<u32>(columns_.pos_size()));
+      addRow(v);
+    }
+  }
+  return Status::Ok();
+}
+
+void GrammarNameFilter::filter(ColumnarSentence* sentence) {
+  auto names = sentence->mutable_names();
+  auto kept = std::remove_if(names->begin(), names->end(), [this](const GrammarName& n) {
+    return !sent_.insert(grammarNameKey(n.field(), n.parent(), n.id())).second;
+  });
+  names->erase(kept, names->end());
+}
+
+} // namespace grpc
+} // namespace jumanpp
@@ -0,0 +1,67 @@
+//
+// Created by Arseny Tolmachev on 2018/03/23.
+//
+
+#ifndef JUMANPP_GRPC_COLUMNAR_FORMAT_H
+#define JUMANPP_GRPC_COLUMNAR_FORMAT_H
+
+#include <unordered_set>
+#include <vector>
+#include "jumandic/shared/juman_pb_format.h"
+#include "jumandic-svc.pb.h"
+#include "grammar_tables.h"
+
+namespace jumanpp {
+namespace grpc {
+
+/**
+ * Formats the top-1 analysis as a ColumnarSentence.
+ *
+ * Morphemes are taken from JumanPbFormat, which fills the JUMAN grammar ids
+ * with JumandicIdResolver. Its sentence object is reused between calls,
+ * so only the columns are built for every sentence.
+ * The sentence contains names of all grammar ids which it uses,
+ * unless they go to the grammar tables.
+ */
+class ColumnarFormat {
+  jumandic::JumanPbFormat juman_;
+  ColumnarSentence columns_;
+  // names which were added to the current sentence
+  std::vector<u64> named_;
+  GrammarTables* tables_ = nullptr;
+
+  void addRow(const JumanMorpheme& morpheme);
+  void addName(GrammarField field, i32 parent, i32 id, const std::string& name);
+
+public:
+  bool isInitialized() const { return juman_.isInitialized(); }
+
+  Status initialize(const core::analysis::OutputManager& om, const jumandic::JumandicIdResolver* resolver);
+
+  // names are recorded in the tables instead of the sentence, nullptr returns them to the sentence
+  void namesTo(GrammarTables* tables) { tables_ = tables; }
+
+  Status format(const core::analysis::Analyzer& analyzer, StringPiece comment);
+
+  const ColumnarSentence* objectPtr() const { return &columns_; }
+
+  // is valid until the next format call
+  ColumnarSentence* mutableObject() { return &columns_; }
+};
+
+/**
+ * Removes names which were already sent from replies of a stream.
+ */
+class GrammarNameFilter {
+  std::unordered_set<u64> sent_;
+
+public:
+  void filter(ColumnarSentence* sentence);
+
+  void reset() { sent_.clear(); }
+};
+
+} // namespace grpc
+} // namespace jumanpp
+
+#endif //JUMANPP_GRPC_COLUMNAR_FORMAT_H
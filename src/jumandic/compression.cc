@@ -0,0 +1,50 @@
+//
+// Created by Arseny Tolmachev on 2018/03/22.
+//
+
+#include "compression.h"
+#include <zlib.h>
+
+namespace jumanpp {
+namespace grpc {
+
+namespace {
+
+// windowBits over 15 make zlib write a gzip header instead of a zlib one
+constexpr int GzipWindowBits = 15 + 16;
+
+bool gzip(const std::string& data, std::string* output) {
+  z_stream zs{};
+  if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, GzipWindowBits, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+    return false;
+  }
+
+  output->resize(deflateBound(&zs, static_cast<uLong>(data.size())));
+  zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+  zs.avail_in = static_cast<uInt>(data.size());
+  zs.next_out = reinterpret_cast<Bytef*>(&(*output)[0]);
+  zs.avail_out = static_cast<uInt>(output->size());
+
+  // the buffer has the size of the bound, so a single call finishes the stream
+  int result = deflate(&zs, Z_FINISH);
+  output->resize(zs.total_out);
+  deflateEnd(&zs);
+  return result == Z_STREAM_END;
+}
+
+} // namespace
+
+bool compressFrame(Compression method, const std::string& data, std::string* output) {
+  switch (method) {
+    case Compression::Uncompressed:
+      output->assign(data);
+      return true;
+    case Compression::Gzip:
+      return gzip(data, output);
+    default:
+      return false;
+  }
+}
+
+} // namespace grpc
+} // namespace jumanpp
@@ -0,0 +1,24 @@
+//
+// Created by Arseny Tolmachev on 2018/03/22.
+//
+
+#ifndef JUMANPP_GRPC_COMPRESSION_H
+#define JUMANPP_GRPC_COMPRESSION_H
+
+#include <string>
+#include "util/types.hpp"
+#include "jumandic-svc.pb.h"
+
+namespace jumanpp {
+namespace grpc {
+
+/**
+ * Compresses frames of bulk replies.
+ * Output is replaced, false means that the compression has failed.
+ */
+bool compressFrame(Compression method, const std::string& data, std::string* output);
+
+} // namespace grpc
+} // namespace jumanpp
+
+#endif //JUMANPP_GRPC_COMPRESSION_H
@@ -0,0 +1,130 @@
+//
+// Created by Arseny Tolmachev on 2018/03/13.
+//
+
+#ifndef JUMANPP_GRPC_COMPUTE_POOL_H
+#define JUMANPP_GRPC_COMPUTE_POOL_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "util/types.hpp"
+#include "interfaces.h"
+
+namespace jumanpp {
+namespace grpc {
+
+/**
+ * Threads which run analysis, separate from completion queue threads.
+ *
+ * Completion queue handlers only submit tasks here, so a long sentence
+ * does not delay reads, writes and new calls of other clients.
+ * Tasks never run on the submitting thread. The queue is bounded:
+ * when it is full, new calls are rejected with trySubmit, and streams
+ * which use submit stop reading until their queued task has started.
+ */
+class ComputePool {
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::deque<ComputeTask*> tasks_;
+  size_t capacity_ = 0;
+  bool continue_ = true;
+  std::vector<std::thread> threads_;
+  std::function<void(int)> threadInit_;
+  std::atomic<u64> submitted_{0};
+  std::atomic<u64> rejected_{0};
+  std::atomic<u64> overflows_{0};
+
+  static void Run(ComputePool* inst, int worker) {
+    inst->threadInit_(worker);
+    std::unique_lock<std::mutex> lock{inst->mutex_};
+    while (true) {
+      inst->cv_.wait(lock, [inst]() { return !inst->tasks_.empty() || !inst->continue_; });
+      if (inst->tasks_.empty()) {
+        return;
+      }
+      auto task = inst->tasks_.front();
+      inst->tasks_.pop_front();
+      lock.unlock();
+      task->Run();
+      lock.lock();
+    }
+  }
+
+public:
+  // threadInit is called with the thread index in each compute thread before it takes tasks
+  void start(int nthreads, size_t capacity, std::function<void(int)> threadInit) {
+    capacity_ = std::max<size_t>(capacity, 1);
+    threadInit_ = std::move(threadInit);
+    for (int i = 0; i < nthreads; ++i) {
+      threads_.emplace_back(&Run, this, i);
+    }
+  }
+
+  // queues the task unless the queue is full, returns false without queueing it then
+  bool trySubmit(ComputeTask* task) {
+    std::unique_lock<std::mutex> lock{mutex_};
+    if (tasks_.size() >= capacity_) {
+      lock.unlock();
+      rejected_.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+    tasks_.push_back(task);
+    lock.unlock();
+    submitted_.fetch_add(1, std::memory_order_relaxed);
+    cv_.notify_one();
+    return true;
+  }
+
+  /**
+   * Always queues the task, returns false when the queue was already full.
+   * The caller must not submit anything else until this task has started,
+   * so the queue can't grow over its capacity by more than one task per caller.
+   */
+  bool submit(ComputeTask* task) {
+    std::unique_lock<std::mutex> lock{mutex_};
+    bool fits = tasks_.size() < capacity_;
+    tasks_.push_back(task);
+    lock.unlock();
+    submitted_.fetch_add(1, std::memory_order_relaxed);
+    if (!fits) {
+      overflows_.fetch_add(1, std::memory_order_relaxed);
+    }
+    cv_.notify_one();
+    return fits;
+  }
+
+  u64 submitted() const { return submitted_.load(std::memory_order_relaxed); }
+  // tasks which were not queued because the queue was full
+  u64 rejected() const { return rejected_.load(std::memory_order_relaxed); }
+  // tasks which were queued over the capacity, their callers have paused
+  u64 overflows() const { return overflows_.load(std::memory_order_relaxed); }
+
+  // remaining tasks are still executed
+  void stop() {
+    {
+      std::lock_guard<std::mutex> guard{mutex_};
+      continue_ = false;
+    }
+    cv_.notify_all();
+  }
+
+  ~ComputePool() {
+    stop();
+    for (auto& t: threads_) {
+      if (t.joinable()) {
+        t.join();
+      }
+    }
+  }
+};
+
+} // namespace grpc
+} // namespace jumanpp
+
+#endif //JUMANPP_GRPC_COMPUTE_POOL_H
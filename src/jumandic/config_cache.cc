@@ -0,0 +1,81 @@
+//
+// Created by Arseny Tolmachev on 2018/03/16.
+//
+
+#include "config_cache.h"
+#include <mutex>
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/io/zero_copy_stream_impl_lite.h>
+
+namespace jumanpp {
+namespace grpc {
+
+void ConfigCache::initialize(const JumanppConfig &defaultConfig, std::function<u64(const JumanppConfig &)> fingerprint,
+                             size_t maxEntries) {
+  fingerprint_ = std::move(fingerprint);
+  maxEntries_ = maxEntries;
+  default_ = make(defaultConfig);
+}
+
+ConfigPtr ConfigCache::make(const JumanppConfig &cfg) const {
+  auto result = std::make_shared<SharedConfig>();
+  result->config.CopyFrom(cfg);
+  result->fingerprint = fingerprint_(cfg);
+  return result;
+}
+
+ConfigPtr ConfigCache::find(const Table &table, const std::string &key) const {
+  std::shared_lock<std::shared_timed_mutex> lock{mutex_};
+  auto it = table.find(key);
+  if (it == table.end()) {
+    return nullptr;
+  }
+  return it->second;
+}
+
+ConfigPtr ConfigCache::intern(Table *table, std::string key, ConfigPtr cfg) {
+  std::unique_lock<std::shared_timed_mutex> lock{mutex_};
+  if (table->size() >= maxEntries_) {
+    return cfg;
+  }
+  // other thread could have interned the same config, use its object
+  auto res = table->emplace(std::move(key), std::move(cfg));
+  return res.first->second;
+}
+
+ConfigPtr ConfigCache::fromHeader(const ::grpc::string_ref &header) {
+  std::string key{header.data(), header.size()};
+  auto cached = find(headers_, key);
+  if (cached) {
+    return cached;
+  }
+
+  JumanppConfig cfg{default_->config};
+  ::google::protobuf::io::ArrayInputStream is(header.data(), static_cast<int>(header.size()));
+  ::google::protobuf::io::CodedInputStream cis(&is);
+  if (!cfg.MergeFromCodedStream(&cis)) {
+    return nullptr;
+  }
+
+  return intern(&headers_, std::move(key), make(cfg));
+}
+
+ConfigPtr ConfigCache::merged(const SharedConfig &base, const JumanppConfig &request) {
+  JumanppConfig cfg{base.config};
+  cfg.MergeFrom(request);
+  // the config has only scalar fields, so equal configs have equal bytes
+  auto key = cfg.SerializeAsString();
+  auto cached = find(merged_, key);
+  if (cached) {
+    return cached;
+  }
+  return intern(&merged_, std::move(key), make(cfg));
+}
+
+size_t ConfigCache::size() const {
+  std::shared_lock<std::shared_timed_mutex> lock{mutex_};
+  return headers_.size() + merged_.size();
+}
+
+} // namespace grpc
+} // namespace jumanpp
@@ -0,0 +1,78 @@
+//
+// Created by Arseny Tolmachev on 2018/03/16.
+//
+
+#ifndef JUMANPP_GRPC_CONFIG_CACHE_H
+#define JUMANPP_GRPC_CONFIG_CACHE_H
+
+#include <functional>
+#include <memory>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <grpc++/support/string_ref.h>
+#include "util/types.hpp"
+#include "jumandic-svc.pb.h"
+
+namespace jumanpp {
+namespace grpc {
+
+/**
+ * Parsed config which is shared between calls and is never modified.
+ */
+struct SharedConfig {
+  JumanppConfig config;
+  // part of AnalyzerKey which depends on the config
+  u64 fingerprint = 0;
+};
+
+using ConfigPtr = std::shared_ptr<const SharedConfig>;
+
+/**
+ * Interns configs by the bytes of jumanpp-config-bin header
+ * and by the result of merging a per request config.
+ *
+ * Clients usually send one of a few configs, so after a short time
+ * a call gets its config without parsing anything.
+ * Interned configs live as long as the cache, when the table is full
+ * new configs are parsed for each call and are not remembered.
+ */
+class ConfigCache {
+  using Table = std::unordered_map<std::string, ConfigPtr>;
+
+  mutable std::shared_timed_mutex mutex_;
+  Table headers_;
+  // keyed by serialized merged config
+  Table merged_;
+  ConfigPtr default_;
+  std::function<u64(const JumanppConfig&)> fingerprint_;
+  size_t maxEntries_ = 0;
+
+  ConfigPtr make(const JumanppConfig& cfg) const;
+  ConfigPtr find(const Table& table, const std::string& key) const;
+  ConfigPtr intern(Table* table, std::string key, ConfigPtr cfg);
+
+public:
+  /**
+   * @param fingerprint computes SharedConfig::fingerprint
+   * @param maxEntries maximum number of interned configs of each kind
+   */
+  void initialize(const JumanppConfig& defaultConfig, std::function<u64(const JumanppConfig&)> fingerprint,
+                  size_t maxEntries);
+
+  // used by calls without the config header
+  const ConfigPtr& defaultConfig() const { return default_; }
+
+  // the default config merged with the header, nullptr if the header is not a valid config
+  ConfigPtr fromHeader(const ::grpc::string_ref& header);
+
+  // base config merged with the config of a request
+  ConfigPtr merged(const SharedConfig& base, const JumanppConfig& request);
+
+  size_t size() const;
+};
+
+} // namespace grpc
+} // namespace jumanpp
+
+#endif //JUMANPP_GRPC_CONFIG_CACHE_H
@@ -0,0 +1,154 @@
+//
+// Created by Arseny Tolmachev on 2018/03/20.
+//
+
+#ifndef JUMANPP_GRPC_DOCUMENT_CALL_H
+#define JUMANPP_GRPC_DOCUMENT_CALL_H
+
+#include "batch_call.h"
+#include "batch_stream_call.h"
+#include "sentence_splitter.h"
+#include "jumandic/shared/juman_pb_format.h"
+
+namespace jumanpp {
+namespace grpc {
+
+/**
+ * Sentences of a document, they are analyzed as a batch.
+ */
+class DocumentPieces {
+  std::vector<TextPiece> pieces_;
+
+public:
+  // splits the document, fills the batch and returns the config of its requests
+  ConfigPtr prepare(JumanppGrpcEnv* env, const DocumentRequest& doc, const ConfigPtr& base, AnalysisBatch* batch) {
+    pieces_.clear();
+    SentenceSplitter splitter{doc.split()};
+    splitter.split(doc.text(), &pieces_);
+
+    auto& text = doc.text();
+    batch->mutable_requests()->Reserve(static_cast<int>(pieces_.size()));
+    for (auto& p: pieces_) {
+      batch->add_requests()->mutable_sentence()->assign(text.data() + p.offset, p.length);
+    }
+
+    // all pieces share the config, so it is merged once
+    if (doc.has_config()) {
+      return env->configs().merged(*base, doc.config());
+    }
+    return base;
+  }
+
+  void prepareReply(const DocumentRequest& doc, DocumentResult* reply) const {
+    reply->set_key(doc.key());
+    auto sentences = reply->mutable_sentences();
+    sentences->Reserve(static_cast<int>(pieces_.size()));
+    for (auto& p: pieces_) {
+      auto sentence = sentences->Add();
+      sentence->set_offset(static_cast<i32>(p.offset));
+      sentence->set_length(static_cast<i32>(p.length));
+    }
+  }
+
+  static Status formatOutput(JumanppGrpcEnv* env, jumandic::JumanPbFormat* output, CachedAnalyzer* ana,
+                             DocumentSentence* sentence, bool idsOnly) {
+    if (!output->isInitialized()) {
+      JPP_RETURN_IF_ERROR(output->initialize(ana->analyzer()->output(), env->idResolver(), false));
+    }
+    JPP_RETURN_IF_ERROR(output->format(*ana->analyzer(), ""));
+    sentence->mutable_sentence()->CopyFrom(*output->objectPtr());
+    if (idsOnly) {
+      env->grammar().strip(sentence->mutable_sentence());
+    }
+    return Status::Ok();
+  }
+};
+
+/**
+ * Splits a document into sentences and analyzes them in parallel.
+ */
+class JumanDocumentCall : public BatchUnaryCall<DocumentResult, jumandic::JumanPbFormat, JumanDocumentCall> {
+  DocumentRequest& doc_ = *arena_.create<DocumentRequest>();
+  DocumentPieces pieces_;
+
+public:
+  static constexpr RpcKind Kind = RpcKind::JumanDocument;
+
+  explicit JumanDocumentCall(JumanppGrpcEnv* env): BatchUnaryCall(env) {}
+
+  void reset() {
+    BatchUnaryCall::reset();
+    doc_.Clear();
+  }
+
+  void startCall() {
+    env_->service().RequestJumanDocument(&context_, &doc_, &replier_, env_->poolQueue(), env_->poolQueue(), this);
+  }
+
+  void handleCall() {
+    config_ = pieces_.prepare(env_, doc_, config_, &batch_);
+    BatchUnaryCall::handleCall();
+  }
+
+  void prepareReply(int /*size*/) {
+    pieces_.prepareReply(doc_, &reply_);
+  }
+
+  JumanSentence* slot(int index) { return reply_.mutable_sentences(index)->mutable_sentence(); }
+
+  Status formatOutput(jumandic::JumanPbFormat* output, CachedAnalyzer* ana, const AnalysisRequest& /*req*/, int index) {
+    return DocumentPieces::formatOutput(env_, output, ana, reply_.mutable_sentences(index), idsOnly_);
+  }
+};
+
+/**
+ * Stream of documents, each of them is analyzed like in JumanDocumentCall.
+ */
+class JumanDocumentStreamCall: public BatchStreamCallBase<DocumentRequest, DocumentResult, jumandic::JumanPbFormat,
+                                                          JumanDocumentStreamCall> {
+  DocumentRequest doc_;
+  bool hasDoc_ = false;
+  DocumentPieces pieces_;
+
+public:
+  static constexpr RpcKind Kind = RpcKind::JumanDocumentStream;
+
+  explicit JumanDocumentStreamCall(JumanppGrpcEnv* env): BatchStreamCallBase(env) {}
+
+  void reset() {
+    doc_.Clear();
+    hasDoc_ = false;
+  }
+
+  void startRequest() {
+    env_->service().RequestJumanDocumentStream(&context_, &rw_, env_->poolQueue(), env_->poolQueue(), this);
+  }
+
+  ::grpc::Status consume(DocumentRequest* message) {
+    doc_.Swap(message);
+    hasDoc_ = true;
+    return ::grpc::Status::OK;
+  }
+
+  bool batchReady(bool /*readsDone*/) const { return hasDoc_; }
+
+  ConfigPtr prepareBatch(AnalysisBatch* batch, DocumentResult* reply) {
+    hasDoc_ = false;
+    auto cfg = pieces_.prepare(env_, doc_, config_, batch);
+    pieces_.prepareReply(doc_, reply);
+    return cfg;
+  }
+
+  ::grpc::Status completeReply(DocumentResult* /*reply*/) { return ::grpc::Status::OK; }
+
+  JumanSentence* slot(int index) { return reply_.mutable_sentences(index)->mutable_sentence(); }
+
+  Status formatOutput(jumandic::JumanPbFormat* output, CachedAnalyzer* ana, const AnalysisRequest& /*req*/, int index) {
+    return DocumentPieces::formatOutput(env_, output, ana, reply_.mutable_sentences(index), idsOnly_);
+  }
+};
+
+} // namespace grpc
+} // namespace jumanpp
+
+#endif //JUMANPP_GRPC_DOCUMENT_CALL_H
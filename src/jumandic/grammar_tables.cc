@@ -0,0 +1,103 @@
+//
+// Created by Arseny Tolmachev on 2018/03/23.
+//
+
+#include "grammar_tables.h"
+#include <random>
+
+namespace jumanpp {
+namespace grpc {
+
+namespace {
+
+constexpr int NumFields = GrammarField_ARRAYSIZE;
+
+} // namespace
+
+GrammarTables::GrammarTables(): known_{new std::atomic<bool>[NumFields * MaxFastId * MaxFastId]} {
+  for (int i = 0; i < NumFields * MaxFastId * MaxFastId; ++i) {
+    known_[i].store(false, std::memory_order_relaxed);
+  }
+}
+
+void GrammarTables::initialize(const core::VersionInfo &version) {
+  version_ = version.dictionary;
+  version_ += '/';
+  version_ += version.model;
+  // names are in the order in which this process has met them,
+  // offsets from a restarted server or another replica must not match
+  std::random_device random;
+  std::uniform_int_distribution<u64> epoch;
+  version_ += '/';
+  version_ += std::to_string(epoch(random));
+}
+
+void GrammarTables::record(GrammarField field, i32 parent, i32 id, const std::string &name) {
+  bool fast = parent >= 0 && parent < MaxFastId && id >= 0 && id < MaxFastId;
+  std::atomic<bool>* flag = nullptr;
+  if (fast) {
+    flag = &known_[(static_cast<int>(field) * MaxFastId + parent) * MaxFastId + id];
+    if (flag->load(std::memory_order_acquire)) {
+      return;
+    }
+  }
+
+  std::lock_guard<std::mutex> guard{mutex_};
+  if (fast) {
+    if (flag->load(std::memory_order_relaxed)) {
+      return;
+    }
+  } else if (!slowKnown_.insert(grammarNameKey(field, parent, id)).second) {
+    return;
+  }
+
+  names_.emplace_back();
+  auto& entry = names_.back();
+  entry.set_field(field);
+  entry.set_parent(parent);
+  entry.set_id(id);
+  entry.set_name(name);
+  if (fast) {
+    flag->store(true, std::memory_order_release);
+  }
+}
+
+void GrammarTables::strip(JumanMorpheme *morpheme) {
+  if (!morpheme->has_stringpos()) {
+    return;
+  }
+  auto& ids = morpheme->posid();
+  auto& names = morpheme->stringpos();
+  record(GrammarField::Pos, 0, ids.pos(), names.pos());
+  record(GrammarField::Subpos, ids.pos(), ids.subpos(), names.subpos());
+  record(GrammarField::ConjType, 0, ids.conjtype(), names.conjtype());
+  record(GrammarField::ConjForm, ids.conjtype(), ids.conjform(), names.conjform());
+  morpheme->clear_stringpos();
+}
+
+void GrammarTables::strip(JumanSentence *sentence) {
+  for (auto& m: *sentence->mutable_morphemes()) {
+    strip(&m);
+    for (auto& v: *m.mutable_variants()) {
+      strip(&v);
+    }
+  }
+}
+
+void GrammarTables::fill(const DictionaryTablesRequest &request, DictionaryTablesReply *reply) const {
+  reply->set_version(version_);
+  std::lock_guard<std::mutex> guard{mutex_};
+  size_t start = 0;
+  if (request.version() == version_ && request.known() > 0) {
+    start = std::min(static_cast<size_t>(request.known()), names_.size());
+  }
+  reply->set_offset(static_cast<i32>(start));
+  auto out = reply->mutable_names();
+  out->Reserve(static_cast<int>(names_.size() - start));
+  for (size_t i = start; i < names_.size(); ++i) {
+    *out->Add() = names_[i];
+  }
+}
+
+} // namespace grpc
+} // namespace jumanpp
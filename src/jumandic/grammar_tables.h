@@ -0,0 +1,70 @@
+//
+// Created by Arseny Tolmachev on 2018/03/23.
+//
+
+#ifndef JUMANPP_GRPC_GRAMMAR_TABLES_H
+#define JUMANPP_GRPC_GRAMMAR_TABLES_H
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_set>
+#include <vector>
+#include "core/env.h"
+#include "util/types.hpp"
+#include "jumandic-svc.pb.h"
+
+namespace jumanpp {
+namespace grpc {
+
+// identifies a name of a JUMAN grammar id
+inline u64 grammarNameKey(GrammarField field, i32 parent, i32 id) {
+  return (static_cast<u64>(field) << 56) ^
+         (static_cast<u64>(static_cast<u32>(parent)) << 24) ^
+         static_cast<u64>(static_cast<u32>(id));
+}
+
+/**
+ * Names of JUMAN grammar ids for clients which receive only the ids.
+ *
+ * The dictionary does not list names by JUMAN id, so they are recorded
+ * when sentences are stripped of them: a name is always recorded
+ * before a reply which uses its id is sent.
+ * Names are only appended, clients fetch the ones after those they already have.
+ * The order is different in every process, so the version has a random epoch.
+ */
+class GrammarTables {
+  // names with ids below this are checked without locking
+  static constexpr i32 MaxFastId = 128;
+
+  std::string version_;
+  std::unique_ptr<std::atomic<bool>[]> known_;
+  mutable std::mutex mutex_;
+  std::vector<GrammarName> names_;
+  // keys of names with larger ids
+  std::unordered_set<u64> slowKnown_;
+
+  void strip(JumanMorpheme* morpheme);
+
+public:
+  GrammarTables();
+
+  // tables are valid for a single dictionary and model in this process
+  void initialize(const core::VersionInfo& version);
+
+  const std::string& version() const { return version_; }
+
+  void record(GrammarField field, i32 parent, i32 id, const std::string& name);
+
+  // records names of all morphemes of the sentence and clears them
+  void strip(JumanSentence* sentence);
+
+  // names which the client does not have, all of them when its version is different
+  void fill(const DictionaryTablesRequest& request, DictionaryTablesReply* reply) const;
+};
+
+} // namespace grpc
+} // namespace jumanpp
+
+#endif //JUMANPP_GRPC_GRAMMAR_TABLES_H
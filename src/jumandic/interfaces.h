@@ -11,6 +11,31 @@ namespace grpc {
 struct CallImpl {
   virtual ~CallImpl() = default;
   virtual void Handle() = 0;
+  // the operation of this tag has failed
+  virtual void HandleFailure() { delete this; }
+};
+
+// tag which passes the result of an operation to a member function of the call
+template <typename T, void (T::*Fn)(bool)>
+class Forwarder: public CallImpl {
+  T* impl_;
+
+public:
+  explicit Forwarder(T* ptr): impl_{ptr} {}
+
+  void Handle() override {
+    (impl_->*Fn)(true);
+  }
+
+  void HandleFailure() override {
+    (impl_->*Fn)(false);
+  }
+};
+
+// work which is executed by compute threads, outside of completion queue handlers
+struct ComputeTask {
+  virtual ~ComputeTask() = default;
+  virtual void Run() = 0;
 };
 
 } // namespace grpc
@@ -0,0 +1,165 @@
+//
+// Created by Arseny Tolmachev on 2018/03/24.
+//
+
+#include "lattice_filter.h"
+#include <algorithm>
+#include <limits>
+#include <map>
+
+namespace jumanpp {
+namespace grpc {
+
+namespace {
+
+using ::google::protobuf::Descriptor;
+using ::google::protobuf::FieldDescriptor;
+using ::google::protobuf::Message;
+
+bool hasOptions(const AnalysisRequest& req) {
+  return req.has_dump() && (req.dump().fields().paths_size() != 0 || req.dump().top_k() > 0 ||
+                            req.dump().beam_only() || req.dump().has_min_score());
+}
+
+bool prunesNodes(const LatticeDumpOptions& options) {
+  return options.top_k() > 0 || options.beam_only() || options.has_min_score();
+}
+
+// moves kept elements of a repeated field to its front and removes the rest
+template <typename T, typename Keep>
+void compact(::google::protobuf::RepeatedPtrField<T>* items, Keep keep) {
+  int kept = 0;
+  for (int i = 0; i < items->size(); ++i) {
+    if (keep(items->Mutable(i))) {
+      if (kept != i) {
+        items->SwapElements(kept, i);
+      }
+      ++kept;
+    }
+  }
+  items->DeleteSubrange(kept, items->size() - kept);
+}
+
+/**
+ * Field paths of a mask as a tree.
+ * Unlike FieldMaskUtil, paths go through repeated message fields:
+ * "nodes.boundary" keeps the boundary of every node.
+ */
+class MaskTree {
+  std::map<const FieldDescriptor*, MaskTree> children_;
+  // the field is kept with all its subfields
+  bool whole_ = false;
+
+public:
+  bool add(const Descriptor* type, const std::string& path) {
+    std::vector<const FieldDescriptor*> fields;
+    size_t start = 0;
+    while (true) {
+      auto dot = path.find('.', start);
+      auto name = path.substr(start, dot == std::string::npos ? std::string::npos : dot - start);
+      auto field = type == nullptr ? nullptr : type->FindFieldByName(name);
+      if (field == nullptr) {
+        return false;
+      }
+      fields.push_back(field);
+      if (dot == std::string::npos) {
+        break;
+      }
+      type = field->message_type();
+      start = dot + 1;
+    }
+
+    auto tree = this;
+    for (auto f: fields) {
+      tree = &tree->children_[f];
+      if (tree->whole_) { // a shorter path has kept the whole field
+        return true;
+      }
+    }
+    tree->whole_ = true;
+    tree->children_.clear();
+    return true;
+  }
+
+  void trim(Message* msg) const {
+    auto refl = msg->GetReflection();
+    std::vector<const FieldDescriptor*> fields;
+    refl->ListFields(*msg, &fields);
+    for (auto f: fields) {
+      auto it = children_.find(f);
+      if (it == children_.end()) {
+        refl->ClearField(msg, f);
+      } else if (!it->second.whole_) {
+        if (f->is_repeated()) {
+          int size = refl->FieldSize(*msg, f);
+          for (int i = 0; i < size; ++i) {
+            it->second.trim(refl->MutableRepeatedMessage(msg, f, i));
+          }
+        } else {
+          it->second.trim(refl->MutableMessage(msg, f));
+        }
+      }
+    }
+  }
+};
+
+} // namespace
+
+::grpc::Status LatticeDumpFilter::check(const AnalysisRequest &req) {
+  if (!hasOptions(req)) {
+    return ::grpc::Status::OK;
+  }
+  auto& options = req.dump();
+  MaskTree mask;
+  for (auto& path: options.fields().paths()) {
+    if (!mask.add(LatticeDump::descriptor(), path)) {
+      return ::grpc::Status{::grpc::StatusCode::INVALID_ARGUMENT, "unknown field in the lattice dump field mask: " + path};
+    }
+  }
+  return ::grpc::Status::OK;
+}
+
+bool LatticeDumpFilter::keepNode(LatticeNode *node, const LatticeDumpOptions &options) {
+  auto ranks = node->mutable_ranks();
+  // beam_only and min_score look at the ranks which are left after top_k
+  if (options.top_k() > 0) {
+    compact(ranks, [&](const auto* r) { return r->rank() < options.top_k(); });
+  }
+  if (ranks->size() == 0) {
+    return !options.beam_only() && !options.has_min_score();
+  }
+
+  if (options.has_min_score()) {
+    float best = -std::numeric_limits<float>::infinity();
+    for (auto& r: *ranks) {
+      best = std::max(best, r.score());
+    }
+    if (best < options.min_score().value()) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void LatticeDumpFilter::apply(LatticeDump *dump, const AnalysisRequest &req) {
+  if (!hasOptions(req)) {
+    return;
+  }
+  auto& options = req.dump();
+
+  if (prunesNodes(options)) {
+    compact(dump->mutable_nodes(), [&](LatticeNode* node) { return keepNode(node, options); });
+  }
+
+  if (options.fields().paths_size() != 0) {
+    MaskTree mask;
+    mask.add(LatticeDump::descriptor(), "comment");
+    for (auto& path: options.fields().paths()) {
+      mask.add(LatticeDump::descriptor(), path);
+    }
+    mask.trim(dump);
+  }
+}
+
+} // namespace grpc
+} // namespace jumanpp
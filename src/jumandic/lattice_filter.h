@@ -0,0 +1,57 @@
+//
+// Created by Arseny Tolmachev on 2018/03/24.
+//
+
+#ifndef JUMANPP_GRPC_LATTICE_FILTER_H
+#define JUMANPP_GRPC_LATTICE_FILTER_H
+
+#include <grpc++/support/status.h>
+#include "core/proto/lattice_dump_output.h"
+#include "analyzer_cache.h"
+#include "jumandic-svc.pb.h"
+
+namespace jumanpp {
+namespace grpc {
+
+/**
+ * Cuts lattice dumps down to the parts which a request has asked for
+ * with LatticeDumpOptions: nodes are pruned by their ranks, then
+ * fields which are not in the field mask are cleared.
+ */
+class LatticeDumpFilter {
+  static bool keepNode(LatticeNode* node, const LatticeDumpOptions& options);
+
+public:
+  // INVALID_ARGUMENT for unknown field mask paths
+  static ::grpc::Status check(const AnalysisRequest& req);
+
+  // filters the dump in place, does nothing when the request has no options
+  static void apply(LatticeDump* dump, const AnalysisRequest& req);
+};
+
+/**
+ * Lattice dump output of unary and streaming calls, filtered by the options of a request.
+ * The output rebuilds its dump on every call, so the filter works on it in place.
+ */
+template <bool AllFeatures>
+class LatticeDumpFormat {
+  core::output::LatticeDumpOutput output_{AllFeatures, false};
+
+public:
+  Status format(CachedAnalyzer* ana, StringPiece comment, const AnalysisRequest& req) {
+    // pooled calls keep the output initialized
+    if (!output_.wasInitialized()) {
+      JPP_RETURN_IF_ERROR(output_.initialize(ana->impl(), ana->weights()));
+    }
+    JPP_RETURN_IF_ERROR(output_.format(*ana->analyzer(), comment));
+    LatticeDumpFilter::apply(const_cast<LatticeDump*>(output_.objectPtr()), req);
+    return Status::Ok();
+  }
+
+  const LatticeDump* objectPtr() const { return output_.objectPtr(); }
+};
+
+} // namespace grpc
+} // namespace jumanpp
+
+#endif //JUMANPP_GRPC_LATTICE_FILTER_H
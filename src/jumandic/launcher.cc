@@ -17,6 +17,24 @@ struct JumanppGrpcArgs {
   std::string configPath;
   int port = -1;
   int nthreads = 1;
+  int ioThreads = -1;
+  int computeQueue = -1;
+  int maxQueue = -1;
+  int maxWaitMs = 1000;
+  int poolMin = 0;
+  int poolMax = -1;
+  bool poolAdaptive = false;
+  int poolTtl = 60;
+  std::vector<std::string> warmup;
+  int streamWindow = -1;
+  int resultCacheMb = 0;
+  int resultCacheShards = 16;
+  int resultCacheMaxSentence = 4096;
+  int maxInput = 0;
+  int degradeInput = 0;
+  int degradeWaiters = 0;
+  std::string degradeConfig;
+  bool pinThreads = false;
   bool printVersion = false;
   bool generic = false;
 
@@ -25,6 +43,26 @@ struct JumanppGrpcArgs {
     args::ValueFlag<std::string> configPath{parser, "PATH", "Config path", {"config", "conf", 'c'}};
     args::ValueFlag<int> port{parser, "PORT", "Port to listen. -1 for automatic (will be printed to stdout).", {"port"}};
     args::ValueFlag<int> nthreads{parser, "NUM", "Number of computation threads", {"threads", 't'}};
+    args::ValueFlag<int> ioThreads{parser, "NUM", "Number of threads which handle network events, max(1, threads / 4) by default", {"io-threads"}};
+    args::ValueFlag<int> computeQueue{parser, "NUM", "Maximum number of analysis tasks waiting for a computation thread, 16 * threads by default", {"compute-queue"}};
+    args::ValueFlag<int> maxQueue{parser, "NUM", "Maximum number of requests waiting for a free analyzer, the number of compute threads by default", {"max-queue"}};
+    args::ValueFlag<int> maxWait{parser, "MS", "Maximum time in milliseconds a request waits for a free analyzer", {"max-wait"}};
+    args::ValueFlag<int> poolMin{parser, "NUM", "Number of analyzers which are never destroyed", {"pool-min"}};
+    args::ValueFlag<int> poolMax{parser, "NUM", "Maximum number of analyzers, max(40, 2 * threads) by default", {"pool-max"}};
+    args::Flag poolAdaptive{parser, "ADAPTIVE", "Destroy analyzers which were idle for --pool-ttl seconds, down to --pool-min", {"pool-adaptive"}};
+    args::ValueFlag<int> poolTtl{parser, "SEC", "Idle time in seconds after which an analyzer is destroyed in the adaptive mode", {"pool-ttl"}};
+    args::ValueFlagList<std::string> warmup{parser, "PROFILE", "Build analyzers before starting the server, as COUNT[:OPTION,...]. "
+      "Options are local_beam=N, global_beam_left=N, global_beam_right=N, global_beam_check=N, ignore_rnn, all_features, partial", {"warmup"}};
+    args::ValueFlag<int> streamWindow{parser, "NUM", "Maximum number of messages of a single stream analyzed at once, threads by default", {"stream-window"}};
+    args::ValueFlag<int> resultCacheMb{parser, "MB", "Size of the cache of replies for repeated sentences in megabytes, 0 (default) disables it", {"result-cache-mb"}};
+    args::ValueFlag<int> resultCacheShards{parser, "NUM", "Number of independently locked parts of the result cache", {"result-cache-shards"}};
+    args::ValueFlag<int> resultCacheMaxSentence{parser, "BYTES", "Replies for longer sentences are not cached", {"result-cache-max-sentence"}};
+    args::ValueFlag<int> maxInput{parser, "BYTES", "Requests with longer sentences are rejected, 0 (default) for no limit", {"max-input"}};
+    args::ValueFlag<int> degradeInput{parser, "BYTES", "Longer sentences are analyzed with --degrade-config", {"degrade-input"}};
+    args::ValueFlag<int> degradeWaiters{parser, "NUM", "Analyze all requests with --degrade-config while at least NUM requests wait for an analyzer", {"degrade-waiters"}};
+    args::ValueFlag<std::string> degradeConfig{parser, "OPTIONS", "Limits of degraded requests as OPTION,..., e.g. local_beam=3,global_beam_left=5,global_beam_right=1,global_beam_check=1,ignore_rnn. "
+      "Options are the same as config options of --warmup", {"degrade-config"}};
+    args::Flag pinThreads{parser, "PIN", "Pin computation threads to cpus, spreading them over NUMA nodes", {"pin-threads"}};
     args::HelpFlag help{parser, "HELP", "Prints this message", {'h', "help"}};
     args::Flag version{parser, "VERSION", "Print version", {'v', "version"}};
     args::Flag generic{parser, "GENERIC", "Handle non-jumandic models", {"generic"}};
@@ -53,6 +91,78 @@ struct JumanppGrpcArgs {
       result->nthreads = nthreads.Get();
     }
 
+    if (ioThreads) {
+      result->ioThreads = ioThreads.Get();
+    }
+
+    if (computeQueue) {
+      result->computeQueue = computeQueue.Get();
+    }
+
+    if (maxQueue) {
+      result->maxQueue = maxQueue.Get();
+    }
+
+    if (maxWait) {
+      result->maxWaitMs = maxWait.Get();
+    }
+
+    if (poolMin) {
+      result->poolMin = poolMin.Get();
+    }
+
+    if (poolMax) {
+      result->poolMax = poolMax.Get();
+    }
+
+    if (poolAdaptive) {
+      result->poolAdaptive = true;
+    }
+
+    if (poolTtl) {
+      result->poolTtl = poolTtl.Get();
+    }
+
+    if (warmup) {
+      result->warmup = warmup.Get();
+    }
+
+    if (streamWindow) {
+      result->streamWindow = streamWindow.Get();
+    }
+
+    if (resultCacheMb) {
+      result->resultCacheMb = resultCacheMb.Get();
+    }
+
+    if (resultCacheShards) {
+      result->resultCacheShards = resultCacheShards.Get();
+    }
+
+    if (resultCacheMaxSentence) {
+      result->resultCacheMaxSentence = resultCacheMaxSentence.Get();
+    }
+
+    if (maxInput) {
+      result->maxInput = maxInput.Get();
+    }
+
+    if (degradeInput) {
+      result->degradeInput = degradeInput.Get();
+    }
+
+    if (degradeWaiters) {
+      result->degradeWaiters = degradeWaiters.Get();
+    }
+
+    if (degradeConfig) {
+      result->degradeConfig = degradeConfig.Get();
+    }
+
+    if (pinThreads) {
+      result->pinThreads = true;
+    }
+
     if (version) {
       result->printVersion = true;
     }
@@ -72,8 +182,27 @@ int main(int argc, char const *argv[]) {
     exit(1);
   }
 
+  AnalyzerPoolConfig poolConfig;
+  poolConfig.minSize = args.poolMin;
+  poolConfig.maxSize = args.poolMax;
+  if (poolConfig.maxSize <= 0) {
+    poolConfig.maxSize = std::max(40, args.nthreads * 2);
+  }
+  poolConfig.adaptive = args.poolAdaptive;
+  poolConfig.idleTtl = std::chrono::seconds(args.poolTtl);
+  poolConfig.maxWait = std::chrono::milliseconds(args.maxWaitMs);
+
   JumanppGrpcEnv env;
-  auto s = env.loadConfig(args.configPath, args.generic);
+  int ioThreads = args.ioThreads > 0 ? args.ioThreads : std::max(1, args.nthreads / 4);
+  int computeQueue = args.computeQueue > 0 ? args.computeQueue : args.nthreads * 16;
+  env.configureThreads(args.nthreads, ioThreads, computeQueue, args.pinThreads);
+  poolConfig.maxWaiters = args.maxQueue;
+  if (poolConfig.maxWaiters < 0) {
+    // analyzers are acquired only by compute threads, each of them waits for at most one
+    poolConfig.maxWaiters = env.poolThreads();
+  }
+  poolConfig.shardNodes = env.shardNodes();
+  auto s = env.loadConfig(args.configPath, args.generic, poolConfig);
   if (!s) {
     if (args.printVersion) {
       env.printVersion();
@@ -87,6 +216,57 @@ int main(int argc, char const *argv[]) {
     exit(1);
   }
 
+  if (!args.warmup.empty()) {
+    std::vector<WarmupProfile> profiles;
+    for (auto& spec: args.warmup) {
+      profiles.emplace_back();
+      s = parseWarmupProfile(spec, &profiles.back());
+      if (!s) {
+        std::cerr << s;
+        exit(1);
+      }
+    }
+
+    auto warmupStart = std::chrono::steady_clock::now();
+    s = env.warmup(profiles);
+    if (!s) {
+      std::cerr << "Warmup failed: " << s;
+      exit(1);
+    }
+    auto warmupTime = std::chrono::steady_clock::now() - warmupStart;
+    std::cerr << "Warmed up " << env.analyzers().liveAnalyzers() << " analyzers in "
+              << std::chrono::duration_cast<std::chrono::milliseconds>(warmupTime).count() << "ms\n";
+  }
+
+  env.setStreamWindow(args.streamWindow > 0 ? args.streamWindow : args.nthreads);
+
+  ResultCacheConfig resultCacheConfig;
+  resultCacheConfig.maxBytes = static_cast<size_t>(std::max(args.resultCacheMb, 0)) * 1024 * 1024;
+  resultCacheConfig.shards = args.resultCacheShards;
+  resultCacheConfig.maxSentence = static_cast<size_t>(std::max(args.resultCacheMaxSentence, 0));
+  env.results().initialize(resultCacheConfig);
+
+  BudgetConfig budgetConfig;
+  budgetConfig.maxInputBytes = static_cast<size_t>(std::max(args.maxInput, 0));
+  budgetConfig.degradeInputBytes = static_cast<size_t>(std::max(args.degradeInput, 0));
+  budgetConfig.degradeWaiters = std::max(args.degradeWaiters, 0);
+  if (!args.degradeConfig.empty()) {
+    s = parseConfigOptions(args.degradeConfig, &budgetConfig.degraded);
+    if (!s) {
+      std::cerr << s;
+      exit(1);
+    }
+  } else if (budgetConfig.degradeInputBytes != 0 || budgetConfig.degradeWaiters != 0) {
+    std::cerr << "--degrade-input and --degrade-waiters need --degrade-config\n";
+    exit(1);
+  }
+  s = env.budget().initialize(budgetConfig);
+  if (!s) {
+    std::cerr << s;
+    exit(1);
+  }
+
+  // server starts accepting calls only after the warmup has finished
   ::grpc::ServerBuilder bldr;
   std::string address = "[::]:";
   if (args.port > 0) {    
@@ -100,12 +280,22 @@ int main(int argc, char const *argv[]) {
 
   env.registerService(&bldr);
   auto server = bldr.BuildAndStart();
+  // metrics do not depend on the model
+  env.callImpl<MetricsCall>();
   if (!args.generic) {
     env.callImpl<DefaultConfigCall>();
+    env.callImpl<DictionaryTablesCall>();
     env.callImpl<JumanUnaryCall>();
     env.callImpl<JumanStreamCall>();
+    env.callImpl<JumanColumnsUnaryCall>();
+    env.callImpl<JumanColumnsStreamCall>();
     env.callImpl<TopNUnaryCall>();
     env.callImpl<TopNStreamCall>();
+    env.callImpl<JumanBatchCall>();
+    env.callImpl<TopNBatchCall>();
+    env.callImpl<JumanDocumentCall>();
+    env.callImpl<JumanDocumentStreamCall>();
+    env.callImpl<JumanBulkCall>();
   }
   env.callImpl<LatticeDumpStreamImpl>();
   env.callImpl<LatticeDumpUnaryCall>();
@@ -117,7 +307,7 @@ int main(int argc, char const *argv[]) {
               << std::flush;
   }
 
-  env.start(args.nthreads);
+  env.start();
 
   return 0;
 }
\ No newline at end of file
@@ -0,0 +1,233 @@
+//
+// Created by Arseny Tolmachev on 2018/03/18.
+//
+
+#include "metrics.h"
+#include <limits>
+#include <sstream>
+
+namespace jumanpp {
+namespace grpc {
+
+const char* rpcName(RpcKind kind) {
+  switch (kind) {
+    case RpcKind::DefaultConfig: return "DefaultConfig";
+    case RpcKind::Juman: return "Juman";
+    case RpcKind::JumanStream: return "JumanStream";
+    case RpcKind::TopN: return "TopN";
+    case RpcKind::TopNStream: return "TopNStream";
+    case RpcKind::LatticeDump: return "LatticeDump";
+    case RpcKind::LatticeDumpStream: return "LatticeDumpStream";
+    case RpcKind::LatticeDumpWithFeatures: return "LatticeDumpWithFeatures";
+    case RpcKind::LatticeDumpWithFeaturesStream: return "LatticeDumpWithFeaturesStream";
+    case RpcKind::JumanBatch: return "JumanBatch";
+    case RpcKind::TopNBatch: return "TopNBatch";
+    case RpcKind::JumanDocument: return "JumanDocument";
+    case RpcKind::JumanDocumentStream: return "JumanDocumentStream";
+    case RpcKind::JumanBulk: return "JumanBulk";
+    case RpcKind::JumanColumns: return "JumanColumns";
+    case RpcKind::JumanColumnsStream: return "JumanColumnsStream";
+    case RpcKind::DictionaryTables: return "DictionaryTables";
+    case RpcKind::Metrics: return "Metrics";
+    default: return "unknown";
+  }
+}
+
+const char* stageName(Stage stage) {
+  switch (stage) {
+    case Stage::Total: return "total";
+    case Stage::Queue: return "queue";
+    case Stage::Acquire: return "acquire";
+    case Stage::ReadInput: return "read_input";
+    case Stage::Analyze: return "analyze";
+    case Stage::Format: return "format";
+    default: return "unknown";
+  }
+}
+
+const char* sourceName(ResultSource source) {
+  switch (source) {
+    case ResultSource::ResultCache: return "cache";
+    case ResultSource::Reuse: return "reuse";
+    case ResultSource::Reconfigure: return "reconfigure";
+    case ResultSource::Rebuild: return "rebuild";
+    default: return "unknown";
+  }
+}
+
+const char* degradationName(Degradation reason) {
+  switch (reason) {
+    case Degradation::None: return "none";
+    case Degradation::InputLength: return "input_length";
+    case Degradation::Load: return "load";
+    default: return "unknown";
+  }
+}
+
+void RequestTrace::merge(const RequestTrace &o) {
+  for (int i = 0; i < NumStages; ++i) {
+    stages[i] += o.stages[i];
+  }
+  for (int i = 0; i < NumSources; ++i) {
+    sources[i] += o.sources[i];
+  }
+  for (int i = 0; i < NumDegradations; ++i) {
+    degraded[i] += o.degraded[i];
+  }
+  messages += o.messages;
+  if (o.analyzer != -1) {
+    analyzer = o.analyzer;
+  }
+}
+
+std::string RequestTrace::format() const {
+  std::ostringstream os;
+  for (int i = 0; i < NumStages; ++i) {
+    if (i != 0) {
+      os << ',';
+    }
+    os << stageName(static_cast<Stage>(i)) << '=' << stages[i];
+  }
+
+  if (messages > 1) {
+    os << ",messages=" << messages;
+    for (int i = 0; i < NumSources; ++i) {
+      if (sources[i] != 0) {
+        os << ',' << sourceName(static_cast<ResultSource>(i)) << '=' << sources[i];
+      }
+    }
+  } else {
+    if (analyzer != -1) {
+      os << ",analyzer=" << analyzer;
+    }
+    for (int i = 0; i < NumSources; ++i) {
+      if (sources[i] != 0) {
+        os << ",source=" << sourceName(static_cast<ResultSource>(i));
+      }
+    }
+  }
+  return os.str();
+}
+
+std::string RequestTrace::formatDegraded() const {
+  std::string result;
+  for (int i = 0; i < NumDegradations; ++i) {
+    if (degraded[i] == 0) {
+      continue;
+    }
+    if (!result.empty()) {
+      result += ',';
+    }
+    result += degradationName(static_cast<Degradation>(i));
+    result += '=';
+    result += std::to_string(degraded[i]);
+  }
+  return result;
+}
+
+void HistogramSnapshot::add(const Histogram &h) {
+  for (int i = 0; i < Histogram::NumBuckets; ++i) {
+    counts[i] += h.counts[i].load(std::memory_order_relaxed);
+  }
+  sum += h.sum.load(std::memory_order_relaxed);
+}
+
+u64 HistogramSnapshot::total() const {
+  u64 result = 0;
+  for (auto c: counts) {
+    result += c;
+  }
+  return result;
+}
+
+thread_local ThreadMetrics* Metrics::local_ = nullptr;
+
+Metrics &Metrics::instance() {
+  static Metrics metrics;
+  return metrics;
+}
+
+ThreadMetrics *Metrics::registerThread() {
+  std::lock_guard<std::mutex> guard{mutex_};
+  // metrics of finished threads are kept, their counts are still a part of totals
+  threads_.emplace_back(new ThreadMetrics);
+  local_ = threads_.back().get();
+  return local_;
+}
+
+void Metrics::snapshot(MetricsSnapshot *result) const {
+  std::lock_guard<std::mutex> guard{mutex_};
+  for (auto& t: threads_) {
+    for (int r = 0; r < NumRpcs; ++r) {
+      result->requests[r] += t->requests[r].get();
+      result->errors[r] += t->errors[r].get();
+      result->abandoned[r] += t->abandoned[r].get();
+      for (int s = 0; s < NumStages; ++s) {
+        result->stages[r][s].add(t->stages[r][s]);
+      }
+    }
+    result->builds.add(t->builds);
+    result->streamDepth.add(t->streamDepth);
+    for (int i = 0; i < NumDegradations; ++i) {
+      result->degraded[i] += t->degraded[i].get();
+    }
+  }
+}
+
+void MetricsWriter::header(const char *name, const char *type, const char *help) {
+  os_ << "# HELP " << name << " " << help << "\n";
+  os_ << "# TYPE " << name << " " << type << "\n";
+}
+
+void MetricsWriter::value(const char *name, const std::string &labels, u64 value) {
+  os_ << name;
+  if (!labels.empty()) {
+    os_ << "{" << labels << "}";
+  }
+  os_ << " " << value << "\n";
+}
+
+void MetricsWriter::value(const char *name, const std::string &labels, i64 value) {
+  os_ << name;
+  if (!labels.empty()) {
+    os_ << "{" << labels << "}";
+  }
+  os_ << " " << value << "\n";
+}
+
+void MetricsWriter::value(const char *name, const std::string &labels, double value) {
+  os_ << name;
+  if (!labels.empty()) {
+    os_ << "{" << labels << "}";
+  }
+  auto precision = os_.precision(std::numeric_limits<double>::max_digits10);
+  os_ << " " << value << "\n";
+  os_.precision(precision);
+}
+
+void MetricsWriter::histogram(const char *name, const std::string &labels, const HistogramSnapshot &h, double scale) {
+  std::string sep = labels.empty() ? "" : ",";
+  u64 cumulative = 0;
+  for (int i = 0; i < Histogram::NumBuckets - 1; ++i) {
+    cumulative += h.counts[i];
+    os_ << name << "_bucket{" << labels << sep << "le=\"" << static_cast<double>(u64{1} << i) * scale << "\"} "
+        << cumulative << "\n";
+  }
+  cumulative += h.counts[Histogram::NumBuckets - 1];
+  os_ << name << "_bucket{" << labels << sep << "le=\"+Inf\"} " << cumulative << "\n";
+  os_ << name << "_sum";
+  if (!labels.empty()) {
+    os_ << "{" << labels << "}";
+  }
+  auto precision = os_.precision(std::numeric_limits<double>::max_digits10);
+  os_ << " " << static_cast<double>(h.sum) * scale << "\n";
+  os_.precision(precision);
+  os_ << name << "_count";
+  if (!labels.empty()) {
+    os_ << "{" << labels << "}";
+  }
+  os_ << " " << cumulative << "\n";
+}
+
+} // namespace grpc
+} // namespace jumanpp
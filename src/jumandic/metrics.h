@@ -0,0 +1,290 @@
+//
+// Created by Arseny Tolmachev on 2018/03/18.
+//
+
+#ifndef JUMANPP_GRPC_METRICS_H
+#define JUMANPP_GRPC_METRICS_H
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+#include "util/types.hpp"
+
+namespace jumanpp {
+namespace grpc {
+
+enum class RpcKind: u32 {
+  DefaultConfig,
+  Juman,
+  JumanStream,
+  TopN,
+  TopNStream,
+  LatticeDump,
+  LatticeDumpStream,
+  LatticeDumpWithFeatures,
+  LatticeDumpWithFeaturesStream,
+  JumanBatch,
+  TopNBatch,
+  JumanDocument,
+  JumanDocumentStream,
+  JumanBulk,
+  JumanColumns,
+  JumanColumnsStream,
+  DictionaryTables,
+  Metrics,
+  Count
+};
+
+enum class Stage: u32 {
+  // from receiving a request (or a stream message) to sending its reply
+  Total,
+  // waiting for a compute thread
+  Queue,
+  // waiting for an analyzer, includes building it
+  Acquire,
+  ReadInput,
+  Analyze,
+  // formatting and serializing the reply
+  Format,
+  Count
+};
+
+// where the analysis result of a request came from
+enum class ResultSource: u32 {
+  ResultCache,
+  // analyzer was taken as is
+  Reuse,
+  // analyzer got new global beam parameters
+  Reconfigure,
+  // analyzer was initialized from scratch
+  Rebuild,
+  Count
+};
+
+// why a request was analyzed with smaller beams than it has asked for
+enum class Degradation: u32 {
+  None,
+  InputLength,
+  // too many requests were waiting for an analyzer
+  Load,
+  Count
+};
+
+const char* rpcName(RpcKind kind);
+const char* stageName(Stage stage);
+const char* sourceName(ResultSource source);
+const char* degradationName(Degradation reason);
+
+constexpr int NumRpcs = static_cast<int>(RpcKind::Count);
+constexpr int NumStages = static_cast<int>(Stage::Count);
+constexpr int NumSources = static_cast<int>(ResultSource::Count);
+constexpr int NumDegradations = static_cast<int>(Degradation::Count);
+
+/**
+ * Histogram with power of two buckets: bucket i holds values in (2^(i-1), 2^i],
+ * the last one holds everything larger.
+ *
+ * It is written only by the thread which owns it, so increments are plain
+ * relaxed load + store without locked instructions.
+ * Other threads may read it at any time.
+ */
+struct Histogram {
+  static constexpr int NumBuckets = 28;
+
+  std::atomic<u64> counts[NumBuckets];
+  std::atomic<u64> sum;
+
+  Histogram() {
+    for (auto& c: counts) {
+      c.store(0, std::memory_order_relaxed);
+    }
+    sum.store(0, std::memory_order_relaxed);
+  }
+
+  static int bucketOf(u64 value) {
+    if (value <= 1) {
+      return 0;
+    }
+    int bucket = 64 - __builtin_clzll(value - 1);
+    return bucket < NumBuckets ? bucket : NumBuckets - 1;
+  }
+
+  void record(u64 value) {
+    auto& cnt = counts[bucketOf(value)];
+    cnt.store(cnt.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    sum.store(sum.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+  }
+};
+
+struct HistogramSnapshot {
+  u64 counts[Histogram::NumBuckets] = {};
+  u64 sum = 0;
+
+  void add(const Histogram& h);
+  u64 total() const;
+};
+
+// single writer counter, see Histogram
+struct LocalCounter {
+  std::atomic<u64> value{0};
+
+  void inc() { value.store(value.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed); }
+  u64 get() const { return value.load(std::memory_order_relaxed); }
+};
+
+// metrics written by a single thread
+struct ThreadMetrics {
+  LocalCounter requests[NumRpcs];
+  LocalCounter errors[NumRpcs];
+  // requests which were dropped because they were cancelled or their deadline has passed
+  LocalCounter abandoned[NumRpcs];
+  // microseconds
+  Histogram stages[NumRpcs][NumStages];
+  // microseconds spent initializing analyzers from scratch
+  Histogram builds;
+  // number of messages a stream has in flight, recorded when a message is read
+  Histogram streamDepth;
+  LocalCounter degraded[NumDegradations];
+};
+
+struct MetricsSnapshot {
+  u64 requests[NumRpcs] = {};
+  u64 errors[NumRpcs] = {};
+  u64 abandoned[NumRpcs] = {};
+  HistogramSnapshot stages[NumRpcs][NumStages];
+  HistogramSnapshot builds;
+  HistogramSnapshot streamDepth;
+  u64 degraded[NumDegradations] = {};
+};
+
+/**
+ * Hot path metrics: each thread writes to its own ThreadMetrics,
+ * they are summed only when somebody asks for a snapshot.
+ */
+class Metrics {
+  mutable std::mutex mutex_;
+  std::vector<std::unique_ptr<ThreadMetrics>> threads_;
+
+  static thread_local ThreadMetrics* local_;
+
+  ThreadMetrics* registerThread();
+
+public:
+  static Metrics& instance();
+
+  // metrics of the calling thread, registered on the first use
+  static ThreadMetrics& local() {
+    auto ptr = local_;
+    if (ptr == nullptr) {
+      ptr = instance().registerThread();
+    }
+    return *ptr;
+  }
+
+  static void request(RpcKind rpc) { local().requests[static_cast<int>(rpc)].inc(); }
+  static void error(RpcKind rpc) { local().errors[static_cast<int>(rpc)].inc(); }
+  static void abandoned(RpcKind rpc) { local().abandoned[static_cast<int>(rpc)].inc(); }
+  static void stage(RpcKind rpc, Stage stage, std::chrono::steady_clock::duration time) {
+    local().stages[static_cast<int>(rpc)][static_cast<int>(stage)].record(micros(time));
+  }
+
+  static u64 micros(std::chrono::steady_clock::duration time) {
+    auto us = std::chrono::duration_cast<std::chrono::microseconds>(time).count();
+    return us > 0 ? static_cast<u64>(us) : 0;
+  }
+
+  void snapshot(MetricsSnapshot* result) const;
+};
+
+/**
+ * Timings of a single call, they are returned to the client
+ * in the jumanpp-timing trailer when the request has a jumanpp-timing header.
+ * Streams and batches sum timings of all their messages.
+ *
+ * Only one thread writes to a trace at a time.
+ */
+struct RequestTrace {
+  // microseconds
+  u64 stages[NumStages] = {};
+  u32 sources[NumSources] = {};
+  // requests which were analyzed with the degraded config, by reason
+  u32 degraded[NumDegradations] = {};
+  u32 messages = 0;
+  // the last used analyzer
+  i64 analyzer = -1;
+
+  void add(Stage stage, u64 micros) { stages[static_cast<int>(stage)] += micros; }
+  void analyzed(u32 analyzerId, ResultSource source) {
+    analyzer = analyzerId;
+    sources[static_cast<int>(source)] += 1;
+  }
+  void cacheHit() { sources[static_cast<int>(ResultSource::ResultCache)] += 1; }
+  void degrade(Degradation reason) {
+    degraded[static_cast<int>(reason)] += 1;
+    Metrics::local().degraded[static_cast<int>(reason)].inc();
+  }
+  void merge(const RequestTrace& o);
+
+  /**
+   * Comma separated key=value pairs, e.g.
+   * total=812,queue=4,acquire=2,read_input=9,analyze=770,format=27,analyzer=3,source=reuse
+   * Traces of several messages have messages=N and a count for each source instead of source=
+   */
+  std::string format() const;
+
+  // value of the jumanpp-degraded trailer, e.g. input_length=1, empty if nothing was degraded
+  std::string formatDegraded() const;
+};
+
+/**
+ * Measures consecutive stages of a request.
+ */
+class StageTimer {
+  RpcKind rpc_;
+  RequestTrace* trace_;
+  std::chrono::steady_clock::time_point start_;
+
+public:
+  StageTimer(RpcKind rpc, RequestTrace* trace): rpc_{rpc}, trace_{trace}, start_{std::chrono::steady_clock::now()} {}
+  // the first lap starts at the given time
+  StageTimer(RpcKind rpc, RequestTrace* trace, std::chrono::steady_clock::time_point start)
+    : rpc_{rpc}, trace_{trace}, start_{start} {}
+
+  // records the time since the previous lap
+  void lap(Stage stage) {
+    auto now = std::chrono::steady_clock::now();
+    auto time = now - start_;
+    Metrics::stage(rpc_, stage, time);
+    trace_->add(stage, Metrics::micros(time));
+    start_ = now;
+  }
+};
+
+/**
+ * Writes metrics in Prometheus text exposition format.
+ */
+class MetricsWriter {
+  std::ostream& os_;
+
+public:
+  explicit MetricsWriter(std::ostream& os): os_{os} {}
+
+  void header(const char* name, const char* type, const char* help);
+  // labels are in form of a="x",b="y" or empty
+  void value(const char* name, const std::string& labels, u64 value);
+  // gauges which can go below zero
+  void value(const char* name, const std::string& labels, i64 value);
+  // printed with all significant digits
+  void value(const char* name, const std::string& labels, double value);
+  // scale converts recorded values to the exported unit, e.g. microseconds to seconds
+  void histogram(const char* name, const std::string& labels, const HistogramSnapshot& h, double scale);
+};
+
+} // namespace grpc
+} // namespace jumanpp
+
+#endif //JUMANPP_GRPC_METRICS_H
@@ -0,0 +1,126 @@
+//
+// Created by Arseny Tolmachev on 2018/03/14.
+//
+
+#include "result_cache.h"
+#include <algorithm>
+#include <functional>
+#include <iterator>
+
+namespace jumanpp {
+namespace grpc {
+
+namespace {
+
+// list node, map node and string headers
+constexpr size_t EntryOverhead = 128;
+
+inline size_t entrySize(const ResultKey& key, const std::string& value) {
+  return key.data().size() + value.size() + EntryOverhead;
+}
+
+template <typename T>
+void appendRaw(std::string* data, T value) {
+  data->append(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+} // namespace
+
+ResultKey::ResultKey(const std::string &kind, bool allFeatures, const JumanppConfig &cfg, const AnalysisRequest &req,
+                     bool idsOnly) {
+  data_.reserve(kind.size() + req.sentence().size() + 40);
+  data_.append(kind);
+  data_.push_back('\0');
+  appendRaw(&data_, static_cast<u8>(allFeatures));
+  appendRaw(&data_, static_cast<u8>(idsOnly));
+  appendRaw(&data_, static_cast<i32>(req.type()));
+  appendRaw(&data_, static_cast<i32>(req.top_n()));
+  appendRaw(&data_, static_cast<i32>(cfg.local_beam()));
+  appendRaw(&data_, static_cast<i32>(cfg.global_beam_left()));
+  appendRaw(&data_, static_cast<i32>(cfg.global_beam_right()));
+  appendRaw(&data_, static_cast<i32>(cfg.global_beam_check()));
+  appendRaw(&data_, static_cast<u8>(cfg.ignore_rnn()));
+  // replies of lattice dumps depend on their options
+  if (req.has_dump()) {
+    auto dumpStart = data_.size();
+    req.dump().AppendToString(&data_);
+    appendRaw(&data_, static_cast<u32>(data_.size() - dumpStart));
+  } else {
+    appendRaw(&data_, static_cast<u32>(0));
+  }
+  data_.append(req.sentence());
+  hash_ = std::hash<std::string>{}(data_);
+}
+
+void ResultCache::initialize(const ResultCacheConfig &config) {
+  config_ = config;
+  if (config.maxBytes == 0) {
+    return;
+  }
+  numShards_ = static_cast<size_t>(std::max(config.shards, 1));
+  shards_.reset(new Shard[numShards_]);
+  shardBytes_ = config.maxBytes / numShards_;
+}
+
+void ResultCache::evict(Shard &shard, std::list<Entry>::iterator it) {
+  shard.bytes -= entrySize(it->key, it->value);
+  shard.index.erase(it->key.hash());
+  shard.lru.erase(it);
+}
+
+bool ResultCache::lookup(const ResultKey &key, std::string *value) {
+  auto& shard = shardFor(key);
+  std::lock_guard<std::mutex> guard{shard.mutex};
+  auto it = shard.index.find(key.hash());
+  if (it == shard.index.end() || !(it->second->key == key)) {
+    misses_.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+  shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+  *value = it->second->value;
+  hits_.fetch_add(1, std::memory_order_relaxed);
+  return true;
+}
+
+void ResultCache::insert(const ResultKey &key, std::string value) {
+  size_t size = entrySize(key, value);
+  if (size > shardBytes_) {
+    return;
+  }
+
+  auto& shard = shardFor(key);
+  std::lock_guard<std::mutex> guard{shard.mutex};
+  auto it = shard.index.find(key.hash());
+  if (it != shard.index.end()) {
+    // the same sentence analyzed concurrently or a hash collision, newer one wins
+    evict(shard, it->second);
+  }
+
+  while (shard.bytes + size > shardBytes_ && !shard.lru.empty()) {
+    evict(shard, std::prev(shard.lru.end()));
+    evictions_.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  shard.lru.push_front(Entry{key, std::move(value)});
+  shard.index[key.hash()] = shard.lru.begin();
+  shard.bytes += size;
+  inserts_.fetch_add(1, std::memory_order_relaxed);
+}
+
+ResultCacheStats ResultCache::stats() const {
+  ResultCacheStats result;
+  result.hits = hits_.load(std::memory_order_relaxed);
+  result.misses = misses_.load(std::memory_order_relaxed);
+  result.inserts = inserts_.load(std::memory_order_relaxed);
+  result.evictions = evictions_.load(std::memory_order_relaxed);
+  for (size_t i = 0; i < numShards_; ++i) {
+    auto& shard = shards_[i];
+    std::lock_guard<std::mutex> guard{shard.mutex};
+    result.entries += shard.lru.size();
+    result.bytes += shard.bytes;
+  }
+  return result;
+}
+
+} // namespace grpc
+} // namespace jumanpp
@@ -0,0 +1,112 @@
+//
+// Created by Arseny Tolmachev on 2018/03/14.
+//
+
+#ifndef JUMANPP_GRPC_RESULT_CACHE_H
+#define JUMANPP_GRPC_RESULT_CACHE_H
+
+#include <atomic>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "util/types.hpp"
+#include "jumandic-svc.pb.h"
+
+namespace jumanpp {
+namespace grpc {
+
+struct ResultCacheConfig {
+  // 0 disables the cache
+  size_t maxBytes = 0;
+  int shards = 16;
+  // longer sentences are not cached, they rarely repeat
+  size_t maxSentence = 4096;
+};
+
+struct ResultCacheStats {
+  u64 hits = 0;
+  u64 misses = 0;
+  u64 inserts = 0;
+  u64 evictions = 0;
+  u64 entries = 0;
+  u64 bytes = 0;
+};
+
+/**
+ * Everything the reply depends on, except the request key which is
+ * copied to the reply comment on a hit.
+ * The full data is kept to compare entries with the same hash.
+ */
+class ResultKey {
+  std::string data_;
+  u64 hash_ = 0;
+
+public:
+  ResultKey() = default;
+
+  /**
+   * @param kind full name of the reply message type,
+   * RPCs with the same output format share entries
+   * @param idsOnly replies without names of grammar ids are stored separately
+   */
+  ResultKey(const std::string& kind, bool allFeatures, const JumanppConfig& cfg, const AnalysisRequest& req,
+            bool idsOnly);
+
+  const std::string& data() const { return data_; }
+  u64 hash() const { return hash_; }
+  bool operator==(const ResultKey& o) const { return hash_ == o.hash_ && data_ == o.data_; }
+};
+
+/**
+ * Serialized replies for recently analyzed sentences.
+ * Replies are stored with an empty comment.
+ *
+ * Entries are split between shards by hash, each shard is a mutex protected LRU list.
+ * The size bound counts keys, values and a fixed per entry overhead.
+ */
+class ResultCache {
+  struct Entry {
+    ResultKey key;
+    std::string value;
+  };
+
+  struct Shard {
+    std::mutex mutex;
+    std::list<Entry> lru; // most recently used first
+    std::unordered_map<u64, std::list<Entry>::iterator> index;
+    size_t bytes = 0;
+  };
+
+  std::unique_ptr<Shard[]> shards_;
+  size_t numShards_ = 0;
+  size_t shardBytes_ = 0;
+  ResultCacheConfig config_;
+  std::atomic<u64> hits_{0};
+  std::atomic<u64> misses_{0};
+  std::atomic<u64> inserts_{0};
+  std::atomic<u64> evictions_{0};
+
+  Shard& shardFor(const ResultKey& key) { return shards_[(key.hash() >> 32) % numShards_]; }
+  void evict(Shard& shard, std::list<Entry>::iterator it);
+
+public:
+  void initialize(const ResultCacheConfig& config);
+
+  bool enabled() const { return numShards_ != 0; }
+  bool accepts(const AnalysisRequest& req) const {
+    return enabled() && req.sentence().size() <= config_.maxSentence;
+  }
+
+  bool lookup(const ResultKey& key, std::string* value);
+  void insert(const ResultKey& key, std::string value);
+
+  ResultCacheStats stats() const;
+};
+
+} // namespace grpc
+} // namespace jumanpp
+
+#endif //JUMANPP_GRPC_RESULT_CACHE_H
@@ -0,0 +1,130 @@
+//
+// Created by Arseny Tolmachev on 2018/03/20.
+//
+
+#include "sentence_splitter.h"
+#include <algorithm>
+#include <iterator>
+
+namespace jumanpp {
+namespace grpc {
+
+namespace {
+
+const char* const DefaultDelimiters[] = {"。", "！", "？"};
+// are included into the sentence which ends before them
+const char* const ClosingBrackets[] = {"」", "』", "）", ")", "】", "”"};
+
+size_t charLength(char lead) {
+  auto c = static_cast<u8>(lead);
+  if (c < 0xC0) { // ascii or a broken sequence
+    return 1;
+  }
+  if (c < 0xE0) {
+    return 2;
+  }
+  if (c < 0xF0) {
+    return 3;
+  }
+  return 4;
+}
+
+bool startsWith(const std::string& text, size_t pos, const char* prefix, size_t length) {
+  return length != 0 && text.compare(pos, length, prefix, length) == 0;
+}
+
+size_t closingAt(const std::string& text, size_t pos) {
+  for (auto bracket: ClosingBrackets) {
+    size_t length = std::char_traits<char>::length(bracket);
+    if (startsWith(text, pos, bracket, length)) {
+      return length;
+    }
+  }
+  return 0;
+}
+
+bool isBlank(const std::string& text, size_t begin, size_t end) {
+  for (size_t i = begin; i < end; ++i) {
+    char c = text[i];
+    if (c != ' ' && c != '\t' && c != '\r') {
+      return false;
+    }
+  }
+  return true;
+}
+
+} // namespace
+
+SentenceSplitter::SentenceSplitter(const SplitOptions &options) {
+  for (auto& d: options.delimiters()) {
+    if (!d.empty()) {
+      delimiters_.push_back(d);
+    }
+  }
+  if (delimiters_.empty()) {
+    delimiters_.assign(std::begin(DefaultDelimiters), std::end(DefaultDelimiters));
+  }
+  if (options.max_length() > 0) {
+    maxLength_ = static_cast<size_t>(options.max_length());
+  }
+}
+
+size_t SentenceSplitter::delimiterAt(const std::string &text, size_t pos) const {
+  for (auto& d: delimiters_) {
+    if (startsWith(text, pos, d.data(), d.size())) {
+      return d.size();
+    }
+  }
+  return 0;
+}
+
+void SentenceSplitter::split(const std::string &text, std::vector<TextPiece> *pieces) const {
+  size_t start = 0;
+  size_t pos = 0;
+  size_t end = text.size();
+
+  auto emit = [&](size_t pieceEnd) {
+    if (!isBlank(text, start, pieceEnd)) {
+      pieces->push_back(TextPiece{static_cast<u32>(start), static_cast<u32>(pieceEnd - start)});
+    }
+    start = pieceEnd;
+  };
+
+  while (pos < end) {
+    if (text[pos] == '\n') {
+      emit(pos);
+      pos += 1;
+      start = pos;
+      continue;
+    }
+
+    size_t length = delimiterAt(text, pos);
+    if (length != 0) {
+      pos += length;
+      // 。」 and ！？ stay in the same sentence
+      while (pos < end) {
+        length = delimiterAt(text, pos);
+        if (length == 0) {
+          length = closingAt(text, pos);
+        }
+        if (length == 0) {
+          break;
+        }
+        pos += length;
+      }
+      emit(pos);
+      continue;
+    }
+
+    length = charLength(text[pos]);
+    if (maxLength_ != 0 && pos > start && pos + length - start > maxLength_) {
+      emit(pos);
+    }
+    pos += length;
+  }
+
+  emit(std::min(pos, end));
+}
+
+} // namespace grpc
+} // namespace jumanpp
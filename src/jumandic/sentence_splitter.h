@@ -0,0 +1,41 @@
+//
+// Created by Arseny Tolmachev on 2018/03/20.
+//
+
+#ifndef JUMANPP_GRPC_SENTENCE_SPLITTER_H
+#define JUMANPP_GRPC_SENTENCE_SPLITTER_H
+
+#include <string>
+#include <vector>
+#include "util/types.hpp"
+#include "jumandic-svc.pb.h"
+
+namespace jumanpp {
+namespace grpc {
+
+// part of a document, in bytes
+struct TextPiece {
+  u32 offset;
+  u32 length;
+};
+
+/**
+ * Splits documents into sentences, so they can be analyzed in parallel.
+ * Pieces which contain only whitespace are skipped.
+ */
+class SentenceSplitter {
+  std::vector<std::string> delimiters_;
+  size_t maxLength_ = 0;
+
+  size_t delimiterAt(const std::string& text, size_t pos) const;
+
+public:
+  explicit SentenceSplitter(const SplitOptions& options);
+
+  void split(const std::string& text, std::vector<TextPiece>* pieces) const;
+};
+
+} // namespace grpc
+} // namespace jumanpp
+
+#endif //JUMANPP_GRPC_SENTENCE_SPLITTER_H
@@ -5,11 +5,13 @@
 #include "service_env.h"
 #include "jumandic/shared/jumanpp_args.h"
 #include "jumandic/shared/jumandic_env.h"
+#include <sstream>
+#include "util/logging.hpp"
 
 namespace jumanpp {
 namespace grpc {
 
-Status JumanppGrpcEnv::loadConfig(StringPiece configPath, bool generic) {
+Status JumanppGrpcEnv::loadConfig(StringPiece configPath, bool generic, const AnalyzerPoolConfig &poolConfig) {
   jumandic::JumanppConf conf;
   JPP_RETURN_IF_ERROR(jumandic::parseCfgFile(configPath, &conf, 1));
   JPP_RETURN_IF_ERROR(jppEnv_.loadModel(conf.modelFile.value()));
@@ -26,13 +28,272 @@ Status JumanppGrpcEnv::loadConfig(StringPiece configPath, bool generic) {
   defaultAconf_.globalBeamSize = conf.globalBeam;
   defaultAconf_.rightGbeamCheck = conf.rightCheck;
   defaultAconf_.rightGbeamSize = conf.rightBeam;
-  JPP_RETURN_IF_ERROR(cache_.initialize(&jppEnv_, defaultAconf_, 40));
+  JPP_RETURN_IF_ERROR(cache_.initialize(&jppEnv_, defaultAconf_, poolConfig));
+  configs_.initialize(defaultConfig_, [this](const JumanppConfig& cfg) { return cache_.fingerprint(cfg); },
+                      MaxInternedConfigs);
   if (!generic) {
     JPP_RETURN_IF_ERROR(idResolver_.initialize(jppEnv_.coreHolder()->dic()));
+    core::VersionInfo vinfo{};
+    jppEnv_.fillVersion(&vinfo);
+    grammar_.initialize(vinfo);
   }
   return Status::Ok();
 }
 
+thread_local int JumanppGrpcEnv::currentWorker_ = 0;
+
+void JumanppGrpcEnv::configureThreads(int computeThreads, int ioThreads, int computeQueue, bool pin) {
+  poolThreads_ = std::max(computeThreads, 1);
+  ioThreads_ = std::max(ioThreads, 1);
+  computeQueue_ = std::max(computeQueue, 1);
+  pinThreads_ = pin;
+  topology_.detect();
+}
+
+std::vector<int> JumanppGrpcEnv::shardNodes() const {
+  std::vector<int> nodes;
+  for (int i = 0; i < poolThreads_; ++i) {
+    nodes.push_back(topology_.nodeOf(i));
+  }
+  return nodes;
+}
+
+void JumanppGrpcEnv::pinThread(int index) {
+  if (pinThreads_ && !pinCurrentThread(topology_.cpuOf(index))) {
+    LOG_WARN() << "Failed to pin compute thread " << index << " to cpu " << topology_.cpuOf(index);
+  }
+}
+
+void JumanppGrpcEnv::initComputeThread(int index) {
+  AnalyzerCache::bindThread(index);
+  pinThread(index);
+}
+
+Status JumanppGrpcEnv::warmup(const std::vector<WarmupProfile> &profiles) {
+  std::vector<WarmupProfile> merged{profiles};
+  for (auto& p: merged) {
+    JumanppConfig cfg{defaultConfig_};
+    cfg.MergeFrom(p.config);
+    p.config = cfg;
+  }
+  // analyzers of a shard are built on the node of its worker
+  return cache_.warmup(merged, [this](int shard) { pinThread(shard); });
+}
+
+std::string JumanppGrpcEnv::metricsText() const {
+  MetricsSnapshot snap;
+  Metrics::instance().snapshot(&snap);
+  std::ostringstream os;
+  MetricsWriter w{os};
+
+  w.header("jumanpp_requests_total", "counter", "Requests, stream messages are counted separately");
+  for (int r = 0; r < NumRpcs; ++r) {
+    w.value("jumanpp_requests_total", std::string("rpc=\"") + rpcName(static_cast<RpcKind>(r)) + "\"", snap.requests[r]);
+  }
+
+  w.header("jumanpp_errors_total", "counter", "Calls or streams which finished with an error");
+  for (int r = 0; r < NumRpcs; ++r) {
+    w.value("jumanpp_errors_total", std::string("rpc=\"") + rpcName(static_cast<RpcKind>(r)) + "\"", snap.errors[r]);
+  }
+
+  w.header("jumanpp_abandoned_total", "counter", "Requests dropped because they were cancelled or past their deadline");
+  for (int r = 0; r < NumRpcs; ++r) {
+    w.value("jumanpp_abandoned_total", std::string("rpc=\"") + rpcName(static_cast<RpcKind>(r)) + "\"", snap.abandoned[r]);
+  }
+
+  w.header("jumanpp_degraded_total", "counter", "Requests analyzed with the degraded config");
+  for (int i = 1; i < NumDegradations; ++i) {
+    auto reason = static_cast<Degradation>(i);
+    w.value("jumanpp_degraded_total", std::string("reason=\"") + degradationName(reason) + "\"", snap.degraded[i]);
+  }
+
+  w.header("jumanpp_stage_seconds", "histogram", "Time spent in each stage of a request");
+  for (int r = 0; r < NumRpcs; ++r) {
+    for (int s = 0; s < NumStages; ++s) {
+      auto& h = snap.stages[r][s];
+      if (h.total() == 0) {
+        continue;
+      }
+      std::string labels = std::string("rpc=\"") + rpcName(static_cast<RpcKind>(r)) + "\",stage=\"" +
+                           stageName(static_cast<Stage>(s)) + "\"";
+      w.histogram("jumanpp_stage_seconds", labels, h, 1e-6);
+    }
+  }
+
+  w.header("jumanpp_analyzer_build_seconds", "histogram", "Time of initializing an analyzer from scratch");
+  w.histogram("jumanpp_analyzer_build_seconds", "", snap.builds, 1e-6);
+
+  auto pool = cache_.stats();
+  static const char* stateNames[] = {"uninitialized", "in_use", "with_result", "not_in_use"};
+  w.header("jumanpp_analyzers", "gauge", "Analyzers of the pool by state");
+  for (int i = 0; i < 4; ++i) {
+    w.value("jumanpp_analyzers", std::string("state=\"") + stateNames[i] + "\"", static_cast<i64>(pool.states[i]));
+  }
+  w.header("jumanpp_analyzers_live", "gauge", "Built analyzers");
+  w.value("jumanpp_analyzers_live", "", static_cast<i64>(pool.live));
+  w.header("jumanpp_analyzer_acquires_total", "counter", "Analyzer acquisitions by kind");
+  w.value("jumanpp_analyzer_acquires_total", "kind=\"reuse\"", pool.reuses);
+  w.value("jumanpp_analyzer_acquires_total", "kind=\"reconfigure\"", pool.reconfigures);
+  w.value("jumanpp_analyzer_acquires_total", "kind=\"rebuild\"", pool.rebuilds);
+
+  w.header("jumanpp_streams_active", "gauge", "Streams which are not finished");
+  w.value("jumanpp_streams_active", "", static_cast<i64>(streamCounters_.active.load(std::memory_order_relaxed)));
+  w.header("jumanpp_streams_total", "counter", "Finished streams");
+  w.value("jumanpp_streams_total", "", streamCounters_.streams.load(std::memory_order_relaxed));
+  w.header("jumanpp_stream_duration_seconds_total", "counter", "Total duration of finished streams");
+  w.value("jumanpp_stream_duration_seconds_total", "", streamCounters_.durationUs.load(std::memory_order_relaxed) * 1e-6);
+  w.header("jumanpp_stream_messages_total", "counter", "Messages of finished streams");
+  w.value("jumanpp_stream_messages_total", "direction=\"request\"", streamCounters_.requests.load(std::memory_order_relaxed));
+  w.value("jumanpp_stream_messages_total", "direction=\"reply\"", streamCounters_.replies.load(std::memory_order_relaxed));
+  w.header("jumanpp_stream_coalesced_replies_total", "counter", "Replies written together with the next one");
+  w.value("jumanpp_stream_coalesced_replies_total", "", streamCounters_.coalesced.load(std::memory_order_relaxed));
+  w.header("jumanpp_stream_max_inflight", "gauge", "The largest number of messages a finished stream had in flight");
+  w.value("jumanpp_stream_max_inflight", "", streamCounters_.maxInFlight.load(std::memory_order_relaxed));
+  w.header("jumanpp_stream_window_stalls_total", "counter", "Reads postponed because of the full stream window");
+  w.value("jumanpp_stream_window_stalls_total", "", streamCounters_.windowStalls.load(std::memory_order_relaxed));
+  w.header("jumanpp_stream_inflight", "histogram", "Messages a stream has in flight when a new one is read");
+  w.histogram("jumanpp_stream_inflight", "", snap.streamDepth, 1);
+
+  w.header("jumanpp_compute_tasks_total", "counter", "Tasks submitted to compute threads");
+  w.value("jumanpp_compute_tasks_total", "", compute_.submitted());
+  w.header("jumanpp_compute_rejected_total", "counter", "Tasks which were not queued because the queue was full");
+  w.value("jumanpp_compute_rejected_total", "", compute_.rejected());
+  w.header("jumanpp_compute_overflows_total", "counter", "Tasks which were queued over the capacity, their streams stopped reading");
+  w.value("jumanpp_compute_overflows_total", "", compute_.overflows());
+
+  auto results = results_.stats();
+  w.header("jumanpp_result_cache_lookups_total", "counter", "Result cache lookups");
+  w.value("jumanpp_result_cache_lookups_total", "result=\"hit\"", results.hits);
+  w.value("jumanpp_result_cache_lookups_total", "result=\"miss\"", results.misses);
+  w.header("jumanpp_result_cache_inserts_total", "counter", "Replies inserted into the result cache");
+  w.value("jumanpp_result_cache_inserts_total", "", results.inserts);
+  w.header("jumanpp_result_cache_evictions_total", "counter", "Replies evicted from the result cache");
+  w.value("jumanpp_result_cache_evictions_total", "", results.evictions);
+  w.header("jumanpp_result_cache_entries", "gauge", "Replies in the result cache");
+  w.value("jumanpp_result_cache_entries", "", results.entries);
+  w.header("jumanpp_result_cache_bytes", "gauge", "Size of the result cache");
+  w.value("jumanpp_result_cache_bytes", "", results.bytes);
+
+  w.header("jumanpp_config_cache_entries", "gauge", "Interned call configs");
+  w.value("jumanpp_config_cache_entries", "", configs_.size());
+
+  w.header("jumanpp_call_arena_overflows_total", "counter", "Calls which needed more memory than the inline arena block");
+  w.value("jumanpp_call_arena_overflows_total", "", arenaCounters_.overflows.load(std::memory_order_relaxed));
+
+  return os.str();
+}
+
+ConfigPtr JumanppGrpcEnv::degraded(const SharedConfig &cfg, Degradation reason) {
+  JumanppConfig overrides;
+  if (!budget_.degrade(cfg.config, reason, &overrides)) {
+    return nullptr;
+  }
+  return configs_.merged(cfg, overrides);
+}
+
+ConfigPtr JumanppGrpcEnv::applyBudget(const AnalysisRequest &req, const SharedConfig &cfg, RequestTrace *trace) {
+  auto reason = budget_.reason(req, cache_.waiters());
+  if (reason == Degradation::None) {
+    return nullptr;
+  }
+  auto smaller = degraded(cfg, reason);
+  if (smaller) {
+    trace->degrade(reason);
+  }
+  return smaller;
+}
+
+namespace {
+
+Status parseInt(const std::string& value, StringPiece spec, int* result) {
+  char* end = nullptr;
+  long parsed = std::strtol(value.c_str(), &end, 10);
+  if (value.empty() || *end != '\0') {
+    return JPPS_INVALID_PARAMETER << "invalid number " << value << " in " << spec;
+  }
+  *result = static_cast<int>(parsed);
+  return Status::Ok();
+}
+
+// sets a JumanppConfig field from NAME=VALUE or ignore_rnn, returns false for unknown options
+bool parseConfigOption(const std::string& option, StringPiece spec, JumanppConfig* cfg, Status* status) {
+  auto eq = option.find('=');
+  auto name = option.substr(0, eq);
+  int value = 0;
+  if (eq != std::string::npos) {
+    *status = parseInt(option.substr(eq + 1), spec, &value);
+  }
+
+  if (name == "ignore_rnn") {
+    cfg->set_ignore_rnn(true);
+  } else if (eq == std::string::npos) {
+    return false;
+  } else if (name == "local_beam") {
+    cfg->set_local_beam(value);
+  } else if (name == "global_beam_left") {
+    cfg->set_global_beam_left(value);
+  } else if (name == "global_beam_right") {
+    cfg->set_global_beam_right(value);
+  } else if (name == "global_beam_check") {
+    cfg->set_global_beam_check(value);
+  } else {
+    return false;
+  }
+  return true;
+}
+
+// calls fn for each comma separated option of data starting from start
+template <typename Fn>
+Status forEachOption(const std::string& data, size_t start, Fn fn) {
+  while (start <= data.size()) {
+    auto comma = data.find(',', start);
+    if (comma == std::string::npos) {
+      comma = data.size();
+    }
+    JPP_RETURN_IF_ERROR(fn(data.substr(start, comma - start)));
+    start = comma + 1;
+  }
+  return Status::Ok();
+}
+
+} // namespace
+
+Status parseConfigOptions(StringPiece spec, JumanppConfig *cfg) {
+  std::string data = spec.str();
+  return forEachOption(data, 0, [&](const std::string& option) -> Status {
+    Status s = Status::Ok();
+    if (!parseConfigOption(option, spec, cfg, &s)) {
+      return JPPS_INVALID_PARAMETER << "unknown option " << option << " in " << spec;
+    }
+    return s;
+  });
+}
+
+Status parseWarmupProfile(StringPiece spec, WarmupProfile *profile) {
+  std::string data = spec.str();
+  auto colon = data.find(':');
+  JPP_RETURN_IF_ERROR(parseInt(data.substr(0, colon), spec, &profile->count));
+  if (profile->count <= 0) {
+    return JPPS_INVALID_PARAMETER << "analyzer count must be positive in warmup profile " << spec;
+  }
+
+  if (colon == std::string::npos) {
+    return Status::Ok();
+  }
+
+  return forEachOption(data, colon + 1, [&](const std::string& option) -> Status {
+    Status s = Status::Ok();
+    if (option == "all_features") {
+      profile->allFeatures = true;
+    } else if (option == "partial") {
+      profile->type = RequestType::PartialAnnotation;
+    } else if (!parseConfigOption(option, spec, &profile->config, &s)) {
+      return JPPS_INVALID_PARAMETER << "unknown option " << option << " in warmup profile " << spec;
+    }
+    return s;
+  });
+}
+
 void JumanppGrpcEnv::printVersion() {
   core::VersionInfo vinfo{};
   jppEnv_.fillVersion(&vinfo);
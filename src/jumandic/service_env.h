@@ -9,6 +9,8 @@
 #include <thread>
 #include <mutex>
 #include <atomic>
+#include <condition_variable>
+#include <functional>
 #include "util/types.hpp"
 #include "util/bounded_queue.h"
 #include "core/env.h"
@@ -16,38 +18,52 @@
 #include "jumandic-svc.grpc.pb.h"
 #include "interfaces.h"
 #include "analyzer_cache.h"
+#include "topology.h"
+#include "compute_pool.h"
+#include "result_cache.h"
+#include "config_cache.h"
+#include "call_arena.h"
+#include "metrics.h"
+#include "budget.h"
+#include "grammar_tables.h"
 #include "jumandic/shared/jumandic_id_resolver.h"
 
 namespace jumanpp {
 namespace grpc {
 
+/**
+ * Runs one thread per completion queue.
+ * A thread polls only its own queue, calls of a queue are handled by the same thread.
+ * Handlers should not do heavy work here, analysis goes to ComputePool.
+ */
 class CQThreadPool {
-  ::grpc::ServerCompletionQueue* queue_ = nullptr;
+  std::vector<::grpc::ServerCompletionQueue*> queues_;
+  std::function<void(int)> threadInit_;
   std::atomic<bool> continue_{true};
   std::vector<std::thread> threads_;
 
-  static void Run(CQThreadPool* inst) {
+  static void Run(CQThreadPool* inst, int worker) {
     void* tag = nullptr;
     bool ok = false;
-    auto q = inst->queue_;
-    if (!q) {
-      return;
-    }
+    auto q = inst->queues_[worker];
+    inst->threadInit_(worker);
 
     while (inst->continue_.load(std::memory_order_consume) && q->Next(&tag, &ok)) {
       if (ok) {
         static_cast<CallImpl*>(tag)->Handle();
       } else {
-        delete static_cast<CallImpl*>(tag);
+        static_cast<CallImpl*>(tag)->HandleFailure();
       }
     }
   }
 
 public:
-  void start(::grpc::ServerCompletionQueue* queue, int nthreads) {
-    queue_ = queue;
-    for (int i = 0; i < nthreads; ++i) {
-      threads_.emplace_back(&Run, this);
+  // threadInit is called with the worker index in the worker thread before it starts polling
+  void start(std::vector<::grpc::ServerCompletionQueue*> queues, std::function<void(int)> threadInit) {
+    queues_ = std::move(queues);
+    threadInit_ = std::move(threadInit);
+    for (int i = 0; i < static_cast<int>(queues_.size()); ++i) {
+      threads_.emplace_back(&Run, this, i);
     }
   }
 
@@ -55,76 +71,294 @@ public:
     continue_ = false;
   }
 
-  ~CQThreadPool() {
+  void join() {
     for (auto &t: threads_) {
-      t.join();
+      if (t.joinable()) {
+        t.join();
+      }
+    }
+  }
+
+  ~CQThreadPool() {
+    join();
+  }
+};
+
+// statistics of a single stream call
+struct StreamStats {
+  TimePoint start;
+  u64 requests = 0;
+  u64 replies = 0;
+  // replies which were written together with the next one
+  u64 coalesced = 0;
+  // reads which were postponed because of the full window
+  u64 windowStalls = 0;
+  u64 maxInFlight = 0;
+};
+
+// totals over all finished streams
+struct StreamCounters {
+  std::atomic<u64> streams{0};
+  std::atomic<u64> requests{0};
+  std::atomic<u64> replies{0};
+  std::atomic<u64> coalesced{0};
+  std::atomic<u64> windowStalls{0};
+  // sum of stream durations in microseconds
+  std::atomic<u64> durationUs{0};
+  // the largest number of messages in flight over all streams
+  std::atomic<u64> maxInFlight{0};
+  // streams which have started and not finished yet
+  std::atomic<i64> active{0};
+
+  void record(const StreamStats& stats) {
+    streams.fetch_add(1, std::memory_order_relaxed);
+    requests.fetch_add(stats.requests, std::memory_order_relaxed);
+    replies.fetch_add(stats.replies, std::memory_order_relaxed);
+    coalesced.fetch_add(stats.coalesced, std::memory_order_relaxed);
+    windowStalls.fetch_add(stats.windowStalls, std::memory_order_relaxed);
+    auto duration = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - stats.start);
+    durationUs.fetch_add(static_cast<u64>(duration.count()), std::memory_order_relaxed);
+    auto max = maxInFlight.load(std::memory_order_relaxed);
+    while (stats.maxInFlight > max) {
+      // max is reloaded when another stream has changed it
+      if (maxInFlight.compare_exchange_weak(max, stats.maxInFlight, std::memory_order_relaxed)) {
+        break;
+      }
+    }
+    active.fetch_sub(1, std::memory_order_relaxed);
+  }
+};
+
+/**
+ * Periodically destroys analyzers which were not used for a while.
+ */
+class PoolReaper {
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  bool continue_ = true;
+  std::thread thread_;
+
+  static void Run(PoolReaper* inst, AnalyzerCache* cache) {
+    auto ttl = cache->poolConfig().idleTtl;
+    auto period = std::max<Clock::duration>(ttl / 4, std::chrono::seconds(1));
+    std::unique_lock<std::mutex> lock{inst->mutex_};
+    while (!inst->cv_.wait_for(lock, period, [inst]() { return !inst->continue_; })) {
+      lock.unlock();
+      cache->shrinkIdle(Clock::now() - ttl);
+      lock.lock();
+    }
+  }
+
+public:
+  void start(AnalyzerCache* cache) {
+    thread_ = std::thread(&Run, this, cache);
+  }
+
+  void stop() {
+    {
+      std::lock_guard<std::mutex> guard{mutex_};
+      continue_ = false;
+    }
+    cv_.notify_all();
+  }
+
+  ~PoolReaper() {
+    stop();
+    if (thread_.joinable()) {
+      thread_.join();
     }
   }
 };
 
 void drainQueue(::grpc::ServerCompletionQueue* queue);
 
+/**
+ * Parses warmup profile in form of COUNT[:OPTION,...], e.g. 4:ignore_rnn,local_beam=3.
+ * Options are JumanppConfig field names, ignore_rnn, all_features and partial.
+ */
+Status parseWarmupProfile(StringPiece spec, WarmupProfile* profile);
+
+// parses comma separated JumanppConfig options of a warmup profile, e.g. ignore_rnn,local_beam=3
+Status parseConfigOptions(StringPiece spec, JumanppConfig* cfg);
+
+/**
+ * Compute threads check it between analysis stages,
+ * so work of calls which nobody waits for anymore is dropped early.
+ */
+struct CallLiveness {
+  // set by the handler of the AsyncNotifyWhenDone tag
+  std::atomic<bool> cancelled{false};
+  Deadline deadline = Deadline::max();
+
+  // must be called before AsyncNotifyWhenDone is armed, the done tag can set cancelled at any time after it
+  void reset() {
+    cancelled.store(false, std::memory_order_relaxed);
+    deadline = Deadline::max();
+  }
+
+  // the request has arrived, its deadline is known now
+  void start(Deadline callDeadline) { deadline = callDeadline; }
+
+  // OK while the client still waits for the reply
+  ::grpc::Status check() const {
+    if (cancelled.load(std::memory_order_relaxed)) {
+      return ::grpc::Status{::grpc::StatusCode::CANCELLED, "call was cancelled"};
+    }
+    if (deadline < std::chrono::system_clock::now()) {
+      return ::grpc::Status{::grpc::StatusCode::DEADLINE_EXCEEDED, "deadline has passed before the analysis"};
+    }
+    return ::grpc::Status::OK;
+  }
+};
+
+inline ::grpc::Status acquireFailure(AcquireStatus status) {
+  switch (status) {
+    case AcquireStatus::QueueFull:
+      return ::grpc::Status{::grpc::StatusCode::RESOURCE_EXHAUSTED, "too many requests are waiting for an analyzer"};
+    case AcquireStatus::Timeout:
+      return ::grpc::Status{::grpc::StatusCode::RESOURCE_EXHAUSTED, "timed out waiting for an analyzer"};
+    case AcquireStatus::DeadlineExceeded:
+      return ::grpc::Status{::grpc::StatusCode::DEADLINE_EXCEEDED, "deadline exceeded while waiting for an analyzer"};
+    default:
+      return ::grpc::Status{::grpc::StatusCode::INTERNAL, "failed to acquire analyzer"};
+  }
+}
+
+/**
+ * Unary analysis RPCs are raw: calls parse requests and serialize replies themselves,
+ * see WireReply. Other RPCs use generated message types.
+ */
+using JumandicService =
+  JumanppJumandic::WithRawMethod_Juman<
+  JumanppJumandic::WithRawMethod_TopN<
+  JumanppJumandic::WithRawMethod_LatticeDump<
+  JumanppJumandic::WithRawMethod_LatticeDumpWithFeatures<
+  JumanppJumandic::WithRawMethod_JumanColumns<
+  JumanppJumandic::AsyncService>>>>>;
+
 class JumanppGrpcEnv {
+  static constexpr size_t MaxInternedConfigs = 1024;
+
   core::JumanppEnv jppEnv_;
   CQThreadPool threadpool_;
-  JumanppJumandic::AsyncService asyncService_;
-  std::unique_ptr<::grpc::ServerCompletionQueue> mainQueue_;
-  std::unique_ptr<::grpc::ServerCompletionQueue> poolQueue_;
+  ComputePool compute_;
+  PoolReaper reaper_;
+  JumandicService asyncService_;
+  // one queue per io thread, calls and their operations stay on the queue
+  std::vector<std::unique_ptr<::grpc::ServerCompletionQueue>> queues_;
   JumanppConfig defaultConfig_;
   AnalyzerCache cache_;
+  ConfigCache configs_;
+  RequestBudget budget_;
+  ResultCache results_;
   core::analysis::AnalyzerConfig defaultAconf_;
   jumandic::JumandicIdResolver idResolver_;
+  GrammarTables grammar_;
+  CpuTopology topology_;
+  bool pinThreads_ = false;
+  int poolThreads_ = 1;
+  int ioThreads_ = 1;
+  int computeQueue_ = 1;
+  int streamWindow_ = 1;
+  StreamCounters streamCounters_;
+  ArenaCounters arenaCounters_;
+
+  static thread_local int currentWorker_;
+
+  void initComputeThread(int index);
 
 public:
-  JumanppJumandic::AsyncService& service() { return asyncService_; }
+  JumandicService& service() { return asyncService_; }
   const JumanppConfig& defaultConfig() const { return defaultConfig_; }
   AnalyzerCache& analyzers() { return cache_; }
-  ::grpc::ServerCompletionQueue* mainQueue() { return mainQueue_.get(); }
-  ::grpc::ServerCompletionQueue* poolQueue() { return poolQueue_.get(); }
+  ConfigCache& configs() { return configs_; }
+  RequestBudget& budget() { return budget_; }
+  ResultCache& results() { return results_; }
+  // queue of the calling io thread
+  ::grpc::ServerCompletionQueue* poolQueue() { return queues_[currentWorker_].get(); }
+  int queueCount() const { return static_cast<int>(queues_.size()); }
+  ComputePool& compute() { return compute_; }
   const jumandic::JumandicIdResolver* idResolver() const { return &idResolver_; }
+  GrammarTables& grammar() { return grammar_; }
   const core::CoreHolder& core() const { return *jppEnv_.coreHolder(); }
+  // number of compute threads
+  int poolThreads() const { return poolThreads_; }
+  // maximum number of messages a single stream analyzes at once
+  int streamWindow() const { return streamWindow_; }
+  void setStreamWindow(int window) { streamWindow_ = std::max(window, 1); }
+  StreamCounters& streamCounters() { return streamCounters_; }
+  ArenaCounters& arenaCounters() { return arenaCounters_; }
+
+  /**
+   * Must be called before loading the config.
+   * When pinning is enabled, compute thread i is bound to a cpu of NUMA node i % nodes.
+   * At most computeQueue analysis tasks wait for a compute thread.
+   */
+  void configureThreads(int computeThreads, int ioThreads, int computeQueue, bool pin);
+  // NUMA node of each compute thread, analyzer pool has a shard per compute thread
+  std::vector<int> shardNodes() const;
+  // binds the calling thread to the cpu of the compute thread if pinning is enabled
+  void pinThread(int index);
 
   void registerService(::grpc::ServerBuilder* bldr) {
     bldr->RegisterService(&asyncService_);
-    mainQueue_ = bldr->AddCompletionQueue(true);
-    poolQueue_ = bldr->AddCompletionQueue(true);
+    for (int i = 0; i < ioThreads_; ++i) {
+      queues_.emplace_back(bldr->AddCompletionQueue(true));
+    }
   }
 
+  // every queue waits for calls of its own
   template<typename Call, typename... Args>
   void callImpl(Args&&... args) {
-    auto call = new Call(this, std::forward<Args>(args)...);
-    auto cnv = static_cast<CallImpl*>(call);
-    cnv->Handle();
+    for (int i = 0; i < queueCount(); ++i) {
+      currentWorker_ = i;
+      auto call = new Call(this, std::forward<Args>(args)...);
+      auto cnv = static_cast<CallImpl*>(call);
+      cnv->Handle();
+    }
+    currentWorker_ = 0;
   }
 
-  void start(int poolThreads) {
-    threadpool_.start(poolQueue_.get(), poolThreads);
-
-    void* msg;
-    bool ok = false;
-    while (mainQueue_->Next(&msg, &ok)) {
-      auto typed = static_cast<CallImpl*>(msg);
-      if (ok) {
-        typed->Handle();
-      } else {
-        delete typed;
-      }
+  void start() {
+    if (cache_.poolConfig().adaptive) {
+      reaper_.start(&cache_);
+    }
+    std::vector<::grpc::ServerCompletionQueue*> queues;
+    for (auto& q: queues_) {
+      queues.push_back(q.get());
     }
+    compute_.start(poolThreads_, static_cast<size_t>(computeQueue_), [this](int index) { initComputeThread(index); });
+    threadpool_.start(std::move(queues), [](int worker) { currentWorker_ = worker; });
+    threadpool_.join();
   }
 
   void printVersion();
 
-  Status loadConfig(StringPiece configPath, bool generic);
+  // cfg with beams reduced to the degraded limits of the reason, nullptr if it already fits into them
+  ConfigPtr degraded(const SharedConfig& cfg, Degradation reason);
+
+  /**
+   * Returns the degraded config when the request is long or the server is overloaded,
+   * nullptr when the request should be analyzed with cfg.
+   * Degradation is recorded in the trace.
+   */
+  ConfigPtr applyBudget(const AnalysisRequest& req, const SharedConfig& cfg, RequestTrace* trace);
+
+  // all server metrics in Prometheus text format
+  std::string metricsText() const;
+
+  Status loadConfig(StringPiece configPath, bool generic, const AnalyzerPoolConfig& poolConfig);
+
+  // profile configs override the default config
+  Status warmup(const std::vector<WarmupProfile>& profiles);
 
   ~JumanppGrpcEnv() {
+    reaper_.stop();
     threadpool_.stop();
-    if (mainQueue_) {
-      mainQueue_->Shutdown();
-      drainQueue(mainQueue());
-    }
-    if (poolQueue_) {
-      poolQueue_->Shutdown();
-      drainQueue(poolQueue());
+    compute_.stop();
+    for (auto& q: queues_) {
+      q->Shutdown();
+      drainQueue(q.get());
     }
   }
 };
@@ -7,6 +7,8 @@
 
 #include <deque>
 #include "service_env.h"
+#include "call_pool.h"
+#include "metrics.h"
 #include <google/protobuf/io/zero_copy_stream.h>
 #include <google/protobuf/io/coded_stream.h>
 #include <google/protobuf/io/zero_copy_stream_impl_lite.h>
@@ -14,152 +16,516 @@
 namespace jumanpp {
 namespace grpc {
 
-template <typename T, void (T::*Fn)()>
-class Forwarder: public CallImpl {
-  T* impl_;
-
-public:
-  explicit Forwarder(T* ptr): impl_{ptr} {}
-
-  void Handle() override {
-    (impl_->*Fn)();
-  }
-};
-
-template <typename Out, typename Child>
+/**
+ * Bidirectional stream which analyzes several messages in parallel.
+ * Messages are read on an io thread, analyzed and formatted on compute threads.
+ * A reply is written by whichever thread makes it writable: the compute thread
+ * which formatted it or the io thread which has finished the previous write.
+ * Writes are issued under mutex_ and only one of them is outstanding at a time.
+ *
+ * At most env->streamWindow() messages of a single stream can be in flight:
+ * the next message is not read until a reply for the oldest one is written.
+ * It is not read either while a message waits in the overfull compute queue.
+ * Replies are written in the order of requests, ready ones are written
+ * back to back with a buffer hint, so gRPC can coalesce them.
+ *
+ * Every message has its own Output, so messages are formatted in parallel.
+ * Child needs to implement
+ *  Status formatOutput(Output* output, CachedAnalyzer* an, const AnalysisRequest& req)
+ *  which formats the reply with an empty comment, it is called on compute threads.
+ * It can also reject messages before analysis with checkRequest
+ * and change replies before they are written with outgoing.
+ */
+template <typename Out, typename Output, typename Child>
 struct BidiStreamCallBase: public CallImpl {
+  struct Rpc {
+    ::grpc::ServerContext context;
+    ::grpc::ServerAsyncReaderWriter<Out, AnalysisRequest> rw{&context};
+  };
+
   JumanppGrpcEnv* env_;
-  ::grpc::ServerContext context_;
-  ::grpc::ServerAsyncReaderWriter<Out, AnalysisRequest> rw_{&context_};
-  AnalysisRequest input_;
-  std::deque<CachedAnalyzer*> analyzers_;
-  JumanppConfig config_;
+  InPlace<Rpc> rpc_;
+  ::grpc::ServerContext& context_ = rpc_.get().context;
+  ::grpc::ServerAsyncReaderWriter<Out, AnalysisRequest>& rw_ = rpc_.get().rw;
+  // interned config of the stream, shared with other streams which sent the same header
+  ConfigPtr config_;
   bool allFeatures_ = false;
+  // client asked for the timing trailer, it contains timings of all messages
+  bool tracing_ = false;
+  // client asked for replies without names of grammar ids
+  bool idsOnly_ = false;
+
+  /**
+   * Message objects are recycled by the stream together with their arenas,
+   * so a stream does not allocate message objects and arena blocks after the first few ones.
+   */
+  struct Message: public ComputeTask {
+    BidiStreamCallBase* call;
+    CallArena<8192> arena;
+    AnalysisRequest* input = nullptr;
+    // formatters are kept initialized when messages are recycled
+    Output output;
+    // the reply which is written when the message is ready
+    Out* reply = nullptr;
+    bool ready = false;
+    bool cacheable = false;
+    ResultKey resultKey;
+    std::string cachedData;
+    TimePoint received;
+    RequestTrace trace;
+
+    explicit Message(BidiStreamCallBase* c): call{c} {
+      input = arena.create<AnalysisRequest>();
+    }
 
-  enum CallState {
-    Initial,
-    WaitCall,
-    Working,
-    Replying,
-    Failed
+    void recycle() {
+      arena.reset();
+      input = arena.create<AnalysisRequest>();
+      reply = nullptr;
+      ready = false;
+      cacheable = false;
+      cachedData.clear();
+      trace = RequestTrace{};
+    }
+
+    void Run() override {
+      call->computeMessage(this);
+    }
   };
 
-  std::atomic<CallState> state_{Initial};
+  // all fields below are protected by the mutex
   std::mutex mutex_;
+  std::deque<std::unique_ptr<Message>> inflight_;
+  // message which is being read
+  std::unique_ptr<Message> readingMsg_;
+  std::vector<std::unique_ptr<Message>> spare_;
+  bool started_ = false;
+  bool reading_ = false;
+  bool writing_ = false;
+  // number of messages which were submitted to the compute pool and are not done yet
+  int computing_ = 0;
+  // message which was queued over the capacity of the compute pool, nothing is read until it starts
+  Message* overflowed_ = nullptr;
+  bool readsDone_ = false;
+  bool finishing_ = false;
+  bool finished_ = false;
+  // the AsyncNotifyWhenDone tag has come back
+  bool done_ = false;
+  ::grpc::Status finishStatus_;
+  CallLiveness liveness_;
+  StreamStats stats_;
+  RequestTrace trace_;
 
-  void ReadCommonConfig() {
-    config_.CopyFrom(env_->defaultConfig());
+  bool ReadCommonConfig() {
+    config_ = env_->configs().defaultConfig();
     auto& clientMeta = context_.client_metadata();
+    tracing_ = clientMeta.find("jumanpp-timing") != clientMeta.end();
+    idsOnly_ = clientMeta.find("jumanpp-ids-only") != clientMeta.end();
     auto iter = clientMeta.find("jumanpp-config-bin");
     if (iter != clientMeta.end()) {
-      auto& data = iter->second;
-      ::google::protobuf::io::ArrayInputStream is(data.data(), data.size());
-      ::google::protobuf::io::CodedInputStream cis(&is);
-      if (!config_.MergeFromCodedStream(&cis)) {
-        state_ = Failed;
-        rw_.Finish(::grpc::Status{::grpc::StatusCode::INVALID_ARGUMENT, "invalid config header"}, &outputTag_);
-        return;
+      config_ = env_->configs().fromHeader(iter->second);
+    }
+    return config_ != nullptr;
+  }
+
+  void startRead() {
+    reading_ = true;
+    if (spare_.empty()) {
+      readingMsg_.reset(new Message{this});
+    } else {
+      readingMsg_ = std::move(spare_.back());
+      spare_.pop_back();
+    }
+    rw_.Read(readingMsg_->input, &inputTag_);
+  }
+
+  bool canRead() const {
+    return !reading_ && !readsDone_ && !finishing_ && overflowed_ == nullptr &&
+           inflight_.size() < static_cast<size_t>(env_->streamWindow());
+  }
+
+  void recycleMessage(std::unique_ptr<Message> msg) {
+    env_->arenaCounters().record(msg->arena);
+    if (spare_.size() < static_cast<size_t>(env_->streamWindow())) {
+      msg->recycle();
+      spare_.push_back(std::move(msg));
+    }
+  }
+
+  // unlocks the mutex and returns the call to the pool if nothing references it anymore
+  void unlockAndMaybeDelete(std::unique_lock<std::mutex>& lock) {
+    bool done = finished_ && done_ && !reading_ && !writing_ && computing_ == 0;
+    lock.unlock();
+    if (done) {
+      env_->streamCounters().record(stats_);
+      CallPool<Child>::instance().put(&child());
+    }
+  }
+
+  void startFinish() {
+    // Finish can't be called concurrently with Write, OutputReady will call it
+    if (!writing_) {
+      if (tracing_) {
+        context_.AddTrailingMetadata("jumanpp-timing", trace_.format());
       }
+      auto degraded = trace_.formatDegraded();
+      if (!degraded.empty()) {
+        context_.AddTrailingMetadata("jumanpp-degraded", degraded);
+      }
+      rw_.Finish(finishStatus_, &finishTag_);
+    }
+  }
+
+  void fail(const ::grpc::Status& status) {
+    if (finishing_) {
+      return;
     }
+    finishing_ = true;
+    finishStatus_ = status;
+    Metrics::error(Child::Kind);
+
+    // messages which are still computing are dropped by their threads
+    for (auto it = inflight_.begin(); it != inflight_.end();) {
+      if ((*it)->ready) {
+        recycleMessage(std::move(*it));
+        it = inflight_.erase(it);
+      } else {
+        ++it;
+      }
+    }
+
+    startFinish();
+  }
+
+  void maybeFinishOk() {
+    if (readsDone_ && !finishing_ && !writing_ && computing_ == 0 && inflight_.empty()) {
+      finishing_ = true;
+      finishStatus_ = ::grpc::Status::OK;
+      startFinish();
+    }
+  }
+
+  // writes the oldest reply if it is ready, called with mutex_ held on compute and io threads
+  void sendReady() {
+    if (writing_ || finishing_ || inflight_.empty() || !inflight_.front()->ready) {
+      return;
+    }
+
+    std::unique_ptr<Message> item = std::move(inflight_.front());
+    inflight_.pop_front();
+    child().outgoing(item->reply);
+    StageTimer total{Child::Kind, &item->trace, item->received};
+    total.lap(Stage::Total);
+    trace_.merge(item->trace);
+
+    ::grpc::WriteOptions opts;
+    if (!inflight_.empty() && inflight_.front()->ready) {
+      // the next reply is written right after this one
+      opts.set_buffer_hint();
+      stats_.coalesced += 1;
+    }
+    writing_ = true;
+    stats_.replies += 1;
+    rw_.Write(*item->reply, opts, &outputTag_); // the reply is serialized here
+    recycleMessage(std::move(item));
+
+    if (canRead()) {
+      startRead();
+    }
+  }
+
+  // the message is analyzed and formatted, or was found in the result cache
+  void messageReady(Message* msg) {
+    std::unique_lock<std::mutex> lock{mutex_};
+    if (finishing_) {
+      dropMessage(msg);
+    } else {
+      computing_ -= 1;
+      msg->ready = true;
+      sendReady();
+      maybeFinishOk();
+    }
+    unlockAndMaybeDelete(lock);
+  }
+
+  void failMessage(Message* msg, const ::grpc::Status& status) {
+    std::unique_lock<std::mutex> lock{mutex_};
+    fail(status);
+    dropMessage(msg);
+    unlockAndMaybeDelete(lock);
   }
 
 public:
 
   BidiStreamCallBase(JumanppGrpcEnv* env): env_{env} {}
 
+  // children which keep per stream state hide these
+  void reset() {}
+
+  ::grpc::Status checkRequest(const AnalysisRequest& /*req*/) const { return ::grpc::Status::OK; }
+
+  /**
+   * The formatted reply of a message. Formatters rebuild their object on every call,
+   * so it is changed in place before being written.
+   */
+  Out* reply(Output* output) { return const_cast<Out*>(output->objectPtr()); }
+
+  // is called for every reply in the order of writes, after it was put into the result cache
+  void outgoing(Out* /*reply*/) {}
+
+  // called by the pool, spare messages and child formatters are kept
+  bool recycle() {
+    rpc_.destroy();
+    if (readingMsg_) {
+      recycleMessage(std::move(readingMsg_));
+    }
+    started_ = false;
+    reading_ = false;
+    writing_ = false;
+    computing_ = 0;
+    overflowed_ = nullptr;
+    readsDone_ = false;
+    finishing_ = false;
+    finished_ = false;
+    done_ = false;
+    finishStatus_ = ::grpc::Status::OK;
+    stats_ = StreamStats{};
+    trace_ = RequestTrace{};
+    config_.reset();
+    child().reset();
+    return true;
+  }
+
+  void revive() {
+    rpc_.emplace();
+    liveness_.reset();
+  }
+
   // Will be called for new calls
   void Handle() override {
-    if (state_ == WaitCall) {
-      Child* cld = new Child{env_}; //fork call
-      state_ = Working;
-      rw_.Read(&input_, &inputTag_);
+    if (started_) {
+      Child* cld = CallPool<Child>::instance().take(env_); //fork call
       cld->Handle();
-      ReadCommonConfig();
+      stats_.start = Clock::now();
+      env_->streamCounters().active.fetch_add(1, std::memory_order_relaxed);
+      liveness_.start(context_.deadline());
+      std::unique_lock<std::mutex> lock{mutex_};
+      if (!ReadCommonConfig()) {
+        readsDone_ = true;
+        fail(::grpc::Status{::grpc::StatusCode::INVALID_ARGUMENT, "invalid config header"});
+      } else {
+        startRead();
+      }
     } else {
-      state_ = WaitCall;
+      started_ = true;
+      context_.AsyncNotifyWhenDone(&doneTag_);
       child().startRequest();
     }
   }
 
-  void InputReady() {
-    JumanppConfig msgConfig{config_};
-    if (input_.has_config()) {
-      msgConfig.MergeFrom(input_.config());
+  void InputReady(bool ok) {
+    std::unique_lock<std::mutex> lock{mutex_};
+    reading_ = false;
+    if (!ok) { // client has finished sending messages
+      recycleMessage(std::move(readingMsg_));
+      readsDone_ = true;
+      maybeFinishOk();
+      unlockAndMaybeDelete(lock);
+      return;
     }
 
-    auto an = env_->analyzers().acquire(msgConfig, input_, allFeatures_);
+    if (finishing_) {
+      recycleMessage(std::move(readingMsg_));
+      unlockAndMaybeDelete(lock);
+      return;
+    }
 
-    if (an == nullptr) {
-      state_ = Failed;
-      rw_.Finish(::grpc::Status{::grpc::StatusCode::ABORTED, "no available analyzer"}, &outputTag_);
+    auto msg = readingMsg_.get();
+    msg->received = Clock::now();
+    msg->trace.messages = 1;
+    inflight_.push_back(std::move(readingMsg_));
+    computing_ += 1;
+    stats_.requests += 1;
+    Metrics::request(Child::Kind);
+    Metrics::local().streamDepth.record(inflight_.size());
+    stats_.maxInFlight = std::max<u64>(stats_.maxInFlight, inflight_.size());
+    // compute threads run tasks outside of the pool lock, so submitting under the stream mutex is safe
+    if (!env_->compute().submit(msg)) {
+      overflowed_ = msg;
+    }
+    if (canRead()) {
+      startRead();
+    } else if (!readsDone_ && overflowed_ == nullptr) {
+      stats_.windowStalls += 1;
+    }
+  }
+
+  // is executed on a compute thread
+  void computeMessage(Message* msg) {
+    StageTimer queued{Child::Kind, &msg->trace, msg->received};
+    queued.lap(Stage::Queue);
+    std::unique_lock<std::mutex> lock{mutex_};
+    if (overflowed_ == msg) {
+      overflowed_ = nullptr;
+      if (canRead()) {
+        startRead();
+      }
+    }
+    if (finishing_) {
+      dropMessage(msg);
+      unlockAndMaybeDelete(lock);
       return;
     }
 
-    Status s = an->readInput(input_, env_->analyzers());
-    if (!s) {
-      state_ = Failed;
-      env_->analyzers().release(an); //Release analyzer
-      rw_.Finish(::grpc::Status{::grpc::StatusCode::INVALID_ARGUMENT, s.message().str()}, &outputTag_);
+    auto alive = liveness_.check();
+    if (!alive.ok()) {
+      Metrics::abandoned(Child::Kind);
+      fail(alive);
+      dropMessage(msg);
+      unlockAndMaybeDelete(lock);
       return;
     }
+    lock.unlock();
 
-    {
-      std::lock_guard<std::mutex> guard(mutex_);
-      analyzers_.push_front(an);
+    auto& input = *msg->input;
+    auto budget = env_->budget().check(input);
+    if (budget.ok()) {
+      budget = child().checkRequest(input);
+    }
+    if (!budget.ok()) {
+      failMessage(msg, budget);
+      return;
     }
 
-    rw_.Read(&input_, &inputTag_); // allow to acquire a new message
-    // after this line there could be a new parallel request on this call
+    // messages without their own config use the stream config as is
+    const SharedConfig* msgConfig = config_.get();
+    ConfigPtr merged;
+    if (input.has_config()) {
+      merged = env_->configs().merged(*msgConfig, input.config());
+      msgConfig = merged.get();
+    }
+    auto smaller = env_->applyBudget(input, *msgConfig, &msg->trace);
+    if (smaller) {
+      merged = std::move(smaller);
+      msgConfig = merged.get();
+    }
 
-    s = an->analyze(); //the heaviest operation is this, it is parallel
+    auto& results = env_->results();
+    msg->cacheable = results.accepts(input);
+    if (msg->cacheable) {
+      msg->resultKey = ResultKey{Out::descriptor()->full_name(), allFeatures_, msgConfig->config, input, idsOnly_};
+      if (results.lookup(msg->resultKey, &msg->cachedData)) {
+        msg->trace.cacheHit();
+        msg->reply = msg->arena.template create<Out>();
+        if (!msg->reply->ParseFromString(msg->cachedData)) {
+          failMessage(msg, ::grpc::Status{::grpc::StatusCode::INTERNAL, "invalid cached reply"});
+          return;
+        }
+        msg->reply->set_comment(input.key());
+        messageReady(msg);
+        return;
+      }
+    }
 
-    if (!s) {
-      std::lock_guard<std::mutex> guard(mutex_);
-      state_ = Failed;
-      rw_.Finish(::grpc::Status{::grpc::StatusCode::INTERNAL, s.message().str()}, &outputTag_);
-      auto iter = std::find(analyzers_.begin(), analyzers_.end(), an);
-      analyzers_.erase(iter);
+    StageTimer timer{Child::Kind, &msg->trace};
+    AcquireStatus acquired;
+    auto an = env_->analyzers().acquireWaiting(*msgConfig, input, allFeatures_, context_.deadline(), &acquired);
+    timer.lap(Stage::Acquire);
+
+    if (an == nullptr) {
+      failMessage(msg, acquireFailure(acquired));
+      return;
+    }
+    msg->trace.analyzed(an->id(), an->source());
+
+    // waiting for the analyzer could take long
+    alive = liveness_.check();
+    if (!alive.ok()) {
       env_->analyzers().release(an);
-    } else if (state_ != Replying) {
-      std::lock_guard<std::mutex> guard(mutex_);
-      auto an2 = analyzers_.back(); // always should be at least 1 element here
-      if (an2->hasResult()) { //always true for ourselves, can be false if we are faster
-        child().sendReply(an2);
-        state_ = Replying;
-        analyzers_.pop_back();
-        env_->analyzers().release(an2);
-      }
+      Metrics::abandoned(Child::Kind);
+      failMessage(msg, alive);
+      return;
     }
-  }
 
-  void OutputReady() {
-    if (state_ == Failed) {
-      for (auto& an: analyzers_) {
-        env_->analyzers().release(an); //release all current analyzers
-      }
-      delete this; //all finished, bye
+    Status s = an->readInput(input, env_->analyzers());
+    timer.lap(Stage::ReadInput);
+    if (!s) {
+      env_->analyzers().release(an); //Release analyzer
+      failMessage(msg, ::grpc::Status{::grpc::StatusCode::INVALID_ARGUMENT, s.message().str()});
       return;
     }
 
-    std::lock_guard<std::mutex> guard(mutex_);
-    if (analyzers_.empty()) {
-      state_ = Working;
+    s = an->analyze(); //the heaviest operation is this, it is parallel
+    timer.lap(Stage::Analyze);
+    if (s) {
+      s = child().formatOutput(&msg->output, an, input);
+    }
+    env_->analyzers().release(an);
+    if (!s) {
+      failMessage(msg, ::grpc::Status{::grpc::StatusCode::INTERNAL, s.message().str()});
       return;
     }
 
-    auto an = analyzers_.back();
-    if (an->hasResult()) {
-      child().sendReply(an);
-      analyzers_.pop_back();
-      env_->analyzers().release(an);
+    msg->reply = child().reply(&msg->output);
+    if (msg->cacheable) {
+      // cached replies do not contain the request key
+      results.insert(msg->resultKey, msg->reply->SerializeAsString());
+    }
+    msg->reply->set_comment(input.key());
+    timer.lap(Stage::Format);
+    messageReady(msg);
+  }
+
+  // must be called under the mutex
+  void dropMessage(Message* msg) {
+    computing_ -= 1;
+    auto iter = std::find_if(inflight_.begin(), inflight_.end(), [msg](const std::unique_ptr<Message>& m) {
+      return m.get() == msg;
+    });
+    recycleMessage(std::move(*iter));
+    inflight_.erase(iter);
+    if (canRead()) {
+      startRead();
+    }
+  }
+
+  void OutputReady(bool ok) {
+    std::unique_lock<std::mutex> lock{mutex_};
+    writing_ = false;
+    if (finishing_) {
+      startFinish(); // was postponed because of this write
+    } else if (!ok) {
+      fail(::grpc::Status{::grpc::StatusCode::CANCELLED, "failed to write a reply"});
     } else {
-      state_ = Working;
+      sendReady();
+      maybeFinishOk();
+    }
+    unlockAndMaybeDelete(lock);
+  }
+
+  void FinishDone(bool ok) {
+    std::unique_lock<std::mutex> lock{mutex_};
+    finished_ = true;
+    unlockAndMaybeDelete(lock);
+  }
+
+  // the stream has finished or the client has cancelled it
+  void CallDone(bool ok) {
+    std::unique_lock<std::mutex> lock{mutex_};
+    done_ = true;
+    if (context_.IsCancelled()) {
+      liveness_.cancelled.store(true, std::memory_order_relaxed);
+      // messages which are being analyzed are dropped by their compute threads
+      fail(::grpc::Status{::grpc::StatusCode::CANCELLED, "stream was cancelled"});
     }
+    unlockAndMaybeDelete(lock);
   }
 
 protected:
-  Forwarder<BidiStreamCallBase, &BidiStreamCallBase<Out, Child>::InputReady> inputTag_{this};
-  Forwarder<BidiStreamCallBase, &BidiStreamCallBase<Out, Child>::OutputReady> outputTag_{this};
+  Forwarder<BidiStreamCallBase, &BidiStreamCallBase<Out, Output, Child>::InputReady> inputTag_{this};
+  Forwarder<BidiStreamCallBase, &BidiStreamCallBase<Out, Output, Child>::OutputReady> outputTag_{this};
+  Forwarder<BidiStreamCallBase, &BidiStreamCallBase<Out, Output, Child>::FinishDone> finishTag_{this};
+  Forwarder<BidiStreamCallBase, &BidiStreamCallBase<Out, Output, Child>::CallDone> doneTag_{this};
   Child& child() { return static_cast<Child&>(*this); }
 };
 
@@ -0,0 +1,104 @@
+//
+// Created by Arseny Tolmachev on 2018/03/25.
+//
+
+#include <catch2/catch.hpp>
+#include "budget.h"
+
+using namespace jumanpp;
+using namespace jumanpp::grpc;
+
+namespace {
+
+BudgetConfig config() {
+  BudgetConfig cfg;
+  cfg.maxInputBytes = 10;
+  cfg.degradeInputBytes = 5;
+  cfg.degradeWaiters = 2;
+  cfg.degraded.set_local_beam(3);
+  cfg.degraded.set_global_beam_left(4);
+  cfg.degraded.set_global_beam_right(2);
+  cfg.degraded.set_global_beam_check(1);
+  cfg.degraded.set_ignore_rnn(true);
+  return cfg;
+}
+
+AnalysisRequest request(const std::string& sentence) {
+  AnalysisRequest req;
+  req.set_sentence(sentence);
+  return req;
+}
+
+} // namespace
+
+TEST_CASE("inputs are limited and degraded by their size and the load") {
+  RequestBudget budget;
+  REQUIRE(budget.initialize(config()));
+
+  CHECK(budget.check(request("abc")).ok());
+  CHECK(budget.check(request("abcdefghijk")).error_code() == ::grpc::StatusCode::INVALID_ARGUMENT);
+
+  CHECK(budget.reason(request("abc"), 0) == Degradation::None);
+  CHECK(budget.reason(request("abc"), 2) == Degradation::Load);
+  CHECK(budget.reason(request("abcdefg"), 2) == Degradation::InputLength);
+}
+
+TEST_CASE("inconsistent degraded limits are rejected") {
+  auto cfg = config();
+
+  SECTION("partial global beams") {
+    cfg.degraded.clear_global_beam_check();
+    CHECK_FALSE(RequestBudget{}.initialize(cfg));
+  }
+
+  SECTION("load degradation without global beams") {
+    cfg.degraded.clear_global_beam_left();
+    cfg.degraded.clear_global_beam_right();
+    cfg.degraded.clear_global_beam_check();
+    CHECK_FALSE(RequestBudget{}.initialize(cfg));
+    cfg.degradeWaiters = 0;
+    CHECK(RequestBudget{}.initialize(cfg));
+  }
+}
+
+TEST_CASE("long inputs get all degraded limits") {
+  RequestBudget budget;
+  REQUIRE(budget.initialize(config()));
+
+  JumanppConfig cfg;
+  cfg.set_local_beam(5);
+  JumanppConfig overrides;
+  REQUIRE(budget.degrade(cfg, Degradation::InputLength, &overrides));
+  CHECK(overrides.local_beam() == 3);
+  // a disabled global beam is larger than any limit
+  CHECK(overrides.global_beam_left() == 4);
+  CHECK(overrides.global_beam_right() == 2);
+  CHECK(overrides.global_beam_check() == 1);
+  CHECK(overrides.ignore_rnn());
+
+  cfg.set_local_beam(2);
+  cfg.set_global_beam_left(3);
+  cfg.set_ignore_rnn(true);
+  overrides.Clear();
+  CHECK_FALSE(budget.degrade(cfg, Degradation::InputLength, &overrides));
+}
+
+TEST_CASE("load degradation changes only global beams") {
+  RequestBudget budget;
+  REQUIRE(budget.initialize(config()));
+
+  JumanppConfig cfg;
+  cfg.set_local_beam(5);
+  cfg.set_global_beam_left(10);
+  JumanppConfig overrides;
+  REQUIRE(budget.degrade(cfg, Degradation::Load, &overrides));
+  CHECK(overrides.local_beam() == 0);
+  CHECK_FALSE(overrides.ignore_rnn());
+  CHECK(overrides.global_beam_left() == 4);
+  CHECK(overrides.global_beam_right() == 2);
+  CHECK(overrides.global_beam_check() == 1);
+
+  cfg.set_global_beam_left(4);
+  overrides.Clear();
+  CHECK_FALSE(budget.degrade(cfg, Degradation::Load, &overrides));
+}
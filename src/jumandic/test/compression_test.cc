@@ -0,0 +1,68 @@
+//
+// Created by Arseny Tolmachev on 2018/03/25.
+//
+
+#include <catch2/catch.hpp>
+#include <zlib.h>
+#include "compression.h"
+
+using namespace jumanpp::grpc;
+
+namespace {
+
+// decompresses a gzip stream as clients do
+bool gunzip(const std::string& data, std::string* output) {
+  z_stream zs{};
+  if (inflateInit2(&zs, 15 + 16) != Z_OK) {
+    return false;
+  }
+  zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+  zs.avail_in = static_cast<uInt>(data.size());
+
+  output->clear();
+  char buffer[4096];
+  int result = Z_OK;
+  while (result == Z_OK) {
+    zs.next_out = reinterpret_cast<Bytef*>(buffer);
+    zs.avail_out = sizeof(buffer);
+    result = inflate(&zs, Z_NO_FLUSH);
+    output->append(buffer, sizeof(buffer) - zs.avail_out);
+  }
+  inflateEnd(&zs);
+  return result == Z_STREAM_END && zs.avail_in == 0;
+}
+
+} // namespace
+
+TEST_CASE("gzip frames round trip") {
+  std::string data;
+  for (int i = 0; i < 1000; ++i) {
+    data += "すもも\t名詞\t" + std::to_string(i) + "\n";
+  }
+  std::string compressed = "stale output";
+  REQUIRE(compressFrame(Compression::Gzip, data, &compressed));
+  CHECK(compressed.size() < data.size());
+  // gzip magic bytes
+  REQUIRE(compressed.size() > 2);
+  CHECK(static_cast<unsigned char>(compressed[0]) == 0x1f);
+  CHECK(static_cast<unsigned char>(compressed[1]) == 0x8b);
+
+  std::string restored;
+  REQUIRE(gunzip(compressed, &restored));
+  CHECK(restored == data);
+}
+
+TEST_CASE("empty gzip frames are valid streams") {
+  std::string compressed;
+  REQUIRE(compressFrame(Compression::Gzip, "", &compressed));
+  std::string restored = "x";
+  REQUIRE(gunzip(compressed, &restored));
+  CHECK(restored.empty());
+}
+
+TEST_CASE("uncompressed frames are copied") {
+  std::string output = "stale output";
+  REQUIRE(compressFrame(Compression::Uncompressed, "abc", &output));
+  CHECK(output == "abc");
+  CHECK_FALSE(compressFrame(static_cast<Compression>(100), "abc", &output));
+}
@@ -0,0 +1,81 @@
+//
+// Created by Arseny Tolmachev on 2018/03/25.
+//
+
+#include <catch2/catch.hpp>
+#include "config_cache.h"
+
+using namespace jumanpp;
+using namespace jumanpp::grpc;
+
+namespace {
+
+void initialize(ConfigCache* cache, size_t maxEntries) {
+  JumanppConfig defaults;
+  defaults.set_local_beam(5);
+  cache->initialize(defaults, [](const JumanppConfig& cfg) { return static_cast<u64>(cfg.local_beam()); },
+                    maxEntries);
+}
+
+JumanppConfig localBeam(int beam) {
+  JumanppConfig cfg;
+  cfg.set_local_beam(beam);
+  return cfg;
+}
+
+} // namespace
+
+TEST_CASE("merged configs are interned") {
+  ConfigCache cache;
+  initialize(&cache, 4);
+  auto& base = *cache.defaultConfig();
+
+  JumanppConfig request;
+  request.set_global_beam_left(7);
+  auto a = cache.merged(base, request);
+  auto b = cache.merged(base, request);
+  CHECK(a == b);
+  CHECK(a->config.local_beam() == 5);
+  CHECK(a->config.global_beam_left() == 7);
+  CHECK(a->fingerprint == 5);
+  CHECK(cache.size() == 1);
+
+  auto c = cache.merged(base, localBeam(3));
+  CHECK(c != a);
+  CHECK(c->fingerprint == 3);
+  CHECK(cache.size() == 2);
+}
+
+TEST_CASE("configs are parsed from the header") {
+  ConfigCache cache;
+  initialize(&cache, 4);
+
+  auto bytes = localBeam(3).SerializeAsString();
+  auto a = cache.fromHeader(::grpc::string_ref{bytes});
+  REQUIRE(a != nullptr);
+  CHECK(a->config.local_beam() == 3);
+  CHECK(a->fingerprint == 3);
+  CHECK(cache.fromHeader(::grpc::string_ref{bytes}) == a);
+
+  CHECK(cache.fromHeader(::grpc::string_ref{"\xff\xff", 2}) == nullptr);
+}
+
+TEST_CASE("configs are not interned when the table is full") {
+  ConfigCache cache;
+  initialize(&cache, 1);
+  auto& base = *cache.defaultConfig();
+
+  auto interned = cache.merged(base, localBeam(1));
+  CHECK(cache.merged(base, localBeam(1)) == interned);
+
+  // every call gets its own object, which is freed with the last reference,
+  // so callers must not compare these configs by a raw pointer which they do not own
+  auto a = cache.merged(base, localBeam(2));
+  auto b = cache.merged(base, localBeam(2));
+  CHECK(a != b);
+  CHECK(a->config.SerializeAsString() == b->config.SerializeAsString());
+  CHECK(a->fingerprint == 2);
+  CHECK(b->fingerprint == 2);
+  CHECK(a.use_count() == 1);
+  CHECK(cache.size() == 1);
+}
@@ -0,0 +1,120 @@
+//
+// Created by Arseny Tolmachev on 2018/03/25.
+//
+
+#include <catch2/catch.hpp>
+#include "grammar_tables.h"
+
+using namespace jumanpp;
+using namespace jumanpp::grpc;
+
+namespace {
+
+core::VersionInfo version() {
+  core::VersionInfo info;
+  info.dictionary = "dic";
+  info.model = "model";
+  return info;
+}
+
+DictionaryTablesReply fill(const GrammarTables& tables, const std::string& version, int known) {
+  DictionaryTablesRequest req;
+  req.set_version(version);
+  req.set_known(known);
+  DictionaryTablesReply reply;
+  tables.fill(req, &reply);
+  return reply;
+}
+
+} // namespace
+
+TEST_CASE("names are recorded once and returned after the known ones") {
+  GrammarTables tables;
+  tables.initialize(version());
+  tables.record(GrammarField::Pos, 0, 1, "名詞");
+  tables.record(GrammarField::Subpos, 1, 2, "普通名詞");
+  tables.record(GrammarField::Pos, 0, 1, "名詞");
+  tables.record(GrammarField::Pos, 0, 1000, "large id");
+  tables.record(GrammarField::Pos, 0, 1000, "large id");
+
+  auto all = fill(tables, "", 0);
+  CHECK(all.version() == tables.version());
+  CHECK(all.offset() == 0);
+  REQUIRE(all.names_size() == 3);
+  CHECK(all.names(0).name() == "名詞");
+  CHECK(all.names(1).field() == GrammarField::Subpos);
+  CHECK(all.names(1).parent() == 1);
+  CHECK(all.names(1).id() == 2);
+  CHECK(all.names(2).id() == 1000);
+
+  auto rest = fill(tables, tables.version(), 2);
+  CHECK(rest.offset() == 2);
+  REQUIRE(rest.names_size() == 1);
+  CHECK(rest.names(0).id() == 1000);
+
+  auto none = fill(tables, tables.version(), 10);
+  CHECK(none.offset() == 3);
+  CHECK(none.names_size() == 0);
+}
+
+TEST_CASE("offsets of another version are ignored") {
+  GrammarTables tables;
+  tables.initialize(version());
+  tables.record(GrammarField::Pos, 0, 1, "名詞");
+  tables.record(GrammarField::Pos, 0, 2, "動詞");
+
+  auto reply = fill(tables, "dic/model", 1);
+  CHECK(reply.offset() == 0);
+  CHECK(reply.names_size() == 2);
+}
+
+TEST_CASE("every process has its own version") {
+  // another replica or a restarted server meets ids in another order,
+  // so its offsets must not be reused even with the same dictionary and model
+  GrammarTables first;
+  GrammarTables second;
+  first.initialize(version());
+  second.initialize(version());
+  CHECK(first.version() != second.version());
+  CHECK(first.version().find("dic/model/") == 0);
+
+  first.record(GrammarField::Pos, 0, 1, "名詞");
+  first.record(GrammarField::Pos, 0, 2, "動詞");
+  second.record(GrammarField::Pos, 0, 2, "動詞");
+  second.record(GrammarField::Pos, 0, 1, "名詞");
+
+  auto reply = fill(second, first.version(), 1);
+  CHECK(reply.offset() == 0);
+  CHECK(reply.names_size() == 2);
+}
+
+TEST_CASE("stripping records names of morphemes and variants") {
+  GrammarTables tables;
+  tables.initialize(version());
+
+  JumanSentence sentence;
+  auto m = sentence.add_morphemes();
+  m->mutable_posid()->set_pos(2);
+  m->mutable_posid()->set_subpos(3);
+  m->mutable_stringpos()->set_pos("動詞");
+  m->mutable_stringpos()->set_subpos("*");
+  auto v = m->add_variants();
+  v->mutable_posid()->set_pos(1);
+  v->mutable_stringpos()->set_pos("名詞");
+  tables.strip(&sentence);
+
+  CHECK_FALSE(sentence.morphemes(0).has_stringpos());
+  CHECK_FALSE(sentence.morphemes(0).variants(0).has_stringpos());
+  CHECK(sentence.morphemes(0).posid().pos() == 2);
+
+  auto reply = fill(tables, "", 0);
+  std::vector<std::string> names;
+  for (auto& n: reply.names()) {
+    names.push_back(n.name());
+  }
+  // conjugation ids of 0 have empty names, they are recorded too
+  REQUIRE(names.size() == 6);
+  CHECK(names[0] == "動詞");
+  CHECK(names[1] == "*");
+  CHECK(names[4] == "名詞");
+}
@@ -0,0 +1,170 @@
+//
+// Created by Arseny Tolmachev on 2018/03/25.
+//
+
+#include <catch2/catch.hpp>
+#include <google/protobuf/text_format.h>
+#include "lattice_filter.h"
+
+using namespace jumanpp;
+using namespace jumanpp::grpc;
+
+namespace {
+
+// nodes 1 and 2 are in the beam, node 0 is not
+const char* const Dump = R"(
+  surface: "abc" comment: "c"
+  nodes { boundary: 0 values: 1 }
+  nodes { boundary: 1 values: 2 ranks { rank: 0 score: -1 } ranks { rank: 1 score: -3 } }
+  nodes { boundary: 2 values: 3 ranks { rank: 1 score: -2 } }
+)";
+
+LatticeDump makeDump() {
+  LatticeDump dump;
+  REQUIRE(::google::protobuf::TextFormat::ParseFromString(Dump, &dump));
+  return dump;
+}
+
+LatticeDump parse(const char* text) {
+  LatticeDump dump;
+  REQUIRE(::google::protobuf::TextFormat::ParseFromString(text, &dump));
+  return dump;
+}
+
+void checkSame(const LatticeDump& actual, const LatticeDump& expected) {
+  INFO(actual.ShortDebugString());
+  CHECK(actual.SerializeAsString() == expected.SerializeAsString());
+}
+
+} // namespace
+
+TEST_CASE("dumps are not touched without options") {
+  AnalysisRequest req;
+  REQUIRE(LatticeDumpFilter::check(req).ok());
+  auto dump = makeDump();
+  LatticeDumpFilter::apply(&dump, req);
+  checkSame(dump, makeDump());
+
+  req.mutable_dump(); // options without anything set
+  LatticeDumpFilter::apply(&dump, req);
+  checkSame(dump, makeDump());
+}
+
+TEST_CASE("field masks go through repeated fields") {
+  AnalysisRequest req;
+  auto fields = req.mutable_dump()->mutable_fields();
+  fields->add_paths("nodes.boundary");
+  fields->add_paths("nodes.ranks.rank");
+  REQUIRE(LatticeDumpFilter::check(req).ok());
+
+  auto dump = makeDump();
+  LatticeDumpFilter::apply(&dump, req);
+  // the comment is always kept, rank 0 is the default value
+  checkSame(dump, parse(R"(
+    comment: "c"
+    nodes { boundary: 0 }
+    nodes { boundary: 1 ranks { rank: 0 } ranks { rank: 1 } }
+    nodes { boundary: 2 ranks { rank: 1 } }
+  )"));
+}
+
+TEST_CASE("a shorter mask path keeps the whole field") {
+  AnalysisRequest req;
+  auto fields = req.mutable_dump()->mutable_fields();
+
+  SECTION("shorter path first") {
+    fields->add_paths("nodes");
+    fields->add_paths("nodes.ranks.rank");
+  }
+  SECTION("shorter path last") {
+    fields->add_paths("nodes.ranks.rank");
+    fields->add_paths("nodes");
+  }
+
+  REQUIRE(LatticeDumpFilter::check(req).ok());
+  auto dump = makeDump();
+  LatticeDumpFilter::apply(&dump, req);
+  auto expected = makeDump();
+  expected.clear_surface();
+  checkSame(dump, expected);
+}
+
+TEST_CASE("unknown mask paths are rejected") {
+  AnalysisRequest req;
+  auto fields = req.mutable_dump()->mutable_fields();
+  fields->add_paths("nodes");
+
+  SECTION("unknown subfield under a kept field") { fields->add_paths("nodes.bogus"); }
+  SECTION("unknown top level field") { fields->add_paths("bogus"); }
+  SECTION("path through a scalar") { fields->add_paths("surface.length"); }
+  SECTION("empty path element") { fields->add_paths("nodes..ranks"); }
+
+  auto status = LatticeDumpFilter::check(req);
+  CHECK(status.error_code() == ::grpc::StatusCode::INVALID_ARGUMENT);
+}
+
+TEST_CASE("nodes are pruned by their ranks") {
+  AnalysisRequest req;
+  auto options = req.mutable_dump();
+  auto dump = makeDump();
+
+  SECTION("beam_only drops nodes without ranks") {
+    options->set_beam_only(true);
+    REQUIRE(LatticeDumpFilter::check(req).ok());
+    LatticeDumpFilter::apply(&dump, req);
+    REQUIRE(dump.nodes_size() == 2);
+    CHECK(dump.nodes(0).boundary() == 1);
+    CHECK(dump.nodes(1).boundary() == 2);
+  }
+
+  SECTION("top_k keeps the best ranks and nodes without ranks") {
+    options->set_top_k(1);
+    REQUIRE(LatticeDumpFilter::check(req).ok());
+    LatticeDumpFilter::apply(&dump, req);
+    REQUIRE(dump.nodes_size() == 3);
+    CHECK(dump.nodes(0).ranks_size() == 0);
+    REQUIRE(dump.nodes(1).ranks_size() == 1);
+    CHECK(dump.nodes(1).ranks(0).rank() == 0);
+    CHECK(dump.nodes(2).ranks_size() == 0);
+  }
+
+  SECTION("min_score compares the best rank of a node") {
+    options->mutable_min_score()->set_value(-1.5f);
+    REQUIRE(LatticeDumpFilter::check(req).ok());
+    LatticeDumpFilter::apply(&dump, req);
+    REQUIRE(dump.nodes_size() == 1);
+    CHECK(dump.nodes(0).boundary() == 1);
+    CHECK(dump.nodes(0).ranks_size() == 2);
+  }
+
+  SECTION("beam_only drops nodes without ranks in the top_k") {
+    options->set_top_k(1);
+    options->set_beam_only(true);
+    REQUIRE(LatticeDumpFilter::check(req).ok());
+    LatticeDumpFilter::apply(&dump, req);
+    REQUIRE(dump.nodes_size() == 1);
+    CHECK(dump.nodes(0).boundary() == 1);
+    CHECK(dump.nodes(0).ranks_size() == 1);
+  }
+
+  SECTION("min_score only looks at the top_k ranks") {
+    options->set_top_k(1);
+    options->mutable_min_score()->set_value(-2.5f);
+    REQUIRE(LatticeDumpFilter::check(req).ok());
+    LatticeDumpFilter::apply(&dump, req);
+    REQUIRE(dump.nodes_size() == 1);
+    CHECK(dump.nodes(0).boundary() == 1);
+  }
+
+  SECTION("pruning and masks together") {
+    options->set_top_k(1);
+    options->set_beam_only(true);
+    options->mutable_fields()->add_paths("nodes.ranks.score");
+    REQUIRE(LatticeDumpFilter::check(req).ok());
+    LatticeDumpFilter::apply(&dump, req);
+    checkSame(dump, parse(R"(
+      comment: "c"
+      nodes { ranks { score: -1 } }
+    )"));
+  }
+}
@@ -0,0 +1,129 @@
+//
+// Created by Arseny Tolmachev on 2018/03/25.
+//
+
+#include <catch2/catch.hpp>
+#include "result_cache.h"
+
+using namespace jumanpp::grpc;
+
+namespace {
+
+const std::string Kind = "jumanpp.LatticeDump";
+
+AnalysisRequest request(const std::string& sentence) {
+  AnalysisRequest req;
+  req.set_sentence(sentence);
+  return req;
+}
+
+} // namespace
+
+TEST_CASE("result keys do not depend on the request key") {
+  JumanppConfig cfg;
+  auto a = request("すもも");
+  auto b = request("すもも");
+  a.set_key("1");
+  b.set_key("2");
+  CHECK(ResultKey(Kind, false, cfg, a, false) == ResultKey(Kind, false, cfg, b, false));
+}
+
+TEST_CASE("result keys differ by lattice dump options") {
+  JumanppConfig cfg;
+  auto plain = request("すもも");
+  auto topK = request("すもも");
+  topK.mutable_dump()->set_top_k(1);
+  auto topK2 = request("すもも");
+  topK2.mutable_dump()->set_top_k(2);
+  auto masked = request("すもも");
+  masked.mutable_dump()->mutable_fields()->add_paths("nodes.ranks");
+  auto maskedOther = request("すもも");
+  maskedOther.mutable_dump()->mutable_fields()->add_paths("nodes");
+
+  std::vector<ResultKey> keys = {
+      ResultKey(Kind, false, cfg, plain, false), ResultKey(Kind, false, cfg, topK, false),
+      ResultKey(Kind, false, cfg, topK2, false), ResultKey(Kind, false, cfg, masked, false),
+      ResultKey(Kind, false, cfg, maskedOther, false),
+  };
+  for (size_t i = 0; i < keys.size(); ++i) {
+    for (size_t j = i + 1; j < keys.size(); ++j) {
+      INFO("keys " << i << " and " << j);
+      CHECK_FALSE(keys[i] == keys[j]);
+    }
+  }
+
+  SECTION("options are not confused with the sentence") {
+    // the serialized options end with the bytes of the path, the sentence follows them
+    auto longPath = request("c");
+    longPath.mutable_dump()->mutable_fields()->add_paths("nodes.b");
+    auto shortPath = request("bc");
+    shortPath.mutable_dump()->mutable_fields()->add_paths("nodes.");
+    CHECK_FALSE(ResultKey(Kind, false, cfg, longPath, false) == ResultKey(Kind, false, cfg, shortPath, false));
+  }
+}
+
+TEST_CASE("result keys differ by output kind and flags") {
+  JumanppConfig cfg;
+  auto req = request("すもも");
+  ResultKey base{Kind, false, cfg, req, false};
+  CHECK_FALSE(base == ResultKey("jumanpp.JumanSentence", false, cfg, req, false));
+  CHECK_FALSE(base == ResultKey(Kind, true, cfg, req, false));
+  CHECK_FALSE(base == ResultKey(Kind, false, cfg, req, true));
+  cfg.set_local_beam(3);
+  CHECK_FALSE(base == ResultKey(Kind, false, cfg, req, false));
+}
+
+TEST_CASE("result cache keeps replies of different dump options apart") {
+  ResultCache cache;
+  ResultCacheConfig config;
+  config.maxBytes = 1 << 20;
+  config.shards = 1;
+  cache.initialize(config);
+
+  JumanppConfig cfg;
+  auto all = request("すもも");
+  auto top = request("すもも");
+  top.mutable_dump()->set_top_k(1);
+  ResultKey allKey{Kind, false, cfg, all, false};
+  ResultKey topKey{Kind, false, cfg, top, false};
+
+  cache.insert(allKey, "all ranks");
+  std::string value;
+  CHECK_FALSE(cache.lookup(topKey, &value));
+  cache.insert(topKey, "top rank");
+  REQUIRE(cache.lookup(allKey, &value));
+  CHECK(value == "all ranks");
+  REQUIRE(cache.lookup(topKey, &value));
+  CHECK(value == "top rank");
+
+  auto stats = cache.stats();
+  CHECK(stats.inserts == 2);
+  CHECK(stats.entries == 2);
+  CHECK(stats.hits == 2);
+  CHECK(stats.misses == 1);
+  CHECK(stats.evictions == 0);
+}
+
+TEST_CASE("result cache evicts the least recently used replies") {
+  ResultCache cache;
+  ResultCacheConfig config;
+  config.maxBytes = 1024;
+  config.shards = 1;
+  cache.initialize(config);
+
+  JumanppConfig cfg;
+  std::string reply(200, 'x');
+  for (int i = 0; i < 10; ++i) {
+    cache.insert(ResultKey{Kind, false, cfg, request(std::to_string(i)), false}, reply);
+  }
+
+  auto stats = cache.stats();
+  CHECK(stats.inserts == 10);
+  CHECK(stats.evictions > 0);
+  CHECK(stats.entries == stats.inserts - stats.evictions);
+  CHECK(stats.bytes <= config.maxBytes);
+
+  std::string value;
+  CHECK(cache.lookup(ResultKey{Kind, false, cfg, request("9"), false}, &value));
+  CHECK_FALSE(cache.lookup(ResultKey{Kind, false, cfg, request("0"), false}, &value));
+}
@@ -0,0 +1,73 @@
+//
+// Created by Arseny Tolmachev on 2018/03/25.
+//
+
+#include <catch2/catch.hpp>
+#include "sentence_splitter.h"
+
+using namespace jumanpp::grpc;
+
+namespace {
+
+std::vector<std::string> splitText(const std::string& text, const SplitOptions& options = SplitOptions{}) {
+  SentenceSplitter splitter{options};
+  std::vector<TextPiece> pieces;
+  splitter.split(text, &pieces);
+  std::vector<std::string> result;
+  for (auto& p: pieces) {
+    REQUIRE(p.offset + p.length <= text.size());
+    result.emplace_back(text, p.offset, p.length);
+  }
+  return result;
+}
+
+} // namespace
+
+TEST_CASE("sentences end after delimiters and newlines") {
+  auto pieces = splitText("今日は晴れ。明日は雨？\nそうか");
+  CHECK(pieces == std::vector<std::string>{"今日は晴れ。", "明日は雨？", "そうか"});
+}
+
+TEST_CASE("closing brackets and repeated delimiters stay in the sentence") {
+  auto pieces = splitText("「行くぞ。」（本当に！？）そして");
+  CHECK(pieces == std::vector<std::string>{"「行くぞ。」", "（本当に！？）", "そして"});
+}
+
+TEST_CASE("trailing brackets at the end of the text are kept") {
+  auto pieces = splitText("終わり。」』");
+  CHECK(pieces == std::vector<std::string>{"終わり。」』"});
+}
+
+TEST_CASE("blank pieces are skipped") {
+  auto pieces = splitText("  \n。\t\r\n");
+  CHECK(pieces == std::vector<std::string>{"。"});
+  CHECK(splitText(" \n \n").empty());
+}
+
+TEST_CASE("custom delimiters replace the default ones") {
+  SplitOptions options;
+  options.add_delimiters(". ");
+  options.add_delimiters("");
+  auto pieces = splitText("One. Two。Three", options);
+  CHECK(pieces == std::vector<std::string>{"One. ", "Two。Three"});
+}
+
+TEST_CASE("max_length cuts long sentences at utf-8 boundaries") {
+  SplitOptions options;
+  options.set_max_length(7); // two characters of three bytes fit
+  std::string text = "あいうえおか";
+  auto pieces = splitText(text, options);
+  CHECK(pieces == std::vector<std::string>{"あい", "うえ", "おか"});
+
+  SECTION("a character longer than the limit is not split") {
+    options.set_max_length(2);
+    pieces = splitText("あa", options);
+    CHECK(pieces == std::vector<std::string>{"あ", "a"});
+  }
+
+  SECTION("mixed widths") {
+    options.set_max_length(4);
+    pieces = splitText("abあcd", options);
+    CHECK(pieces == std::vector<std::string>{"ab", "あc", "d"});
+  }
+}
@@ -0,0 +1,6 @@
+//
+// Created by Arseny Tolmachev on 2018/03/25.
+//
+
+#define CATCH_CONFIG_MAIN
+#include <catch2/catch.hpp>
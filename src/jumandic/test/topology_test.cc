@@ -0,0 +1,55 @@
+//
+// Created by Arseny Tolmachev on 2018/03/25.
+//
+
+#include <algorithm>
+#include <catch2/catch.hpp>
+#include "topology.h"
+
+using namespace jumanpp::grpc;
+
+TEST_CASE("kernel cpu lists are parsed") {
+  std::vector<int> cpus;
+
+  SECTION("ranges and single cpus") {
+    REQUIRE(parseCpuList("0-3,8,10-11\n", &cpus));
+    CHECK(cpus == std::vector<int>{0, 1, 2, 3, 8, 10, 11});
+  }
+
+  SECTION("empty list") {
+    REQUIRE(parseCpuList("\n", &cpus));
+    CHECK(cpus.empty());
+  }
+
+  SECTION("cpus are appended") {
+    cpus.push_back(5);
+    REQUIRE(parseCpuList("1", &cpus));
+    CHECK(cpus == std::vector<int>{5, 1});
+  }
+}
+
+TEST_CASE("invalid cpu lists are rejected") {
+  std::vector<int> cpus;
+  CHECK_FALSE(parseCpuList("a", &cpus));
+  CHECK_FALSE(parseCpuList("3-1", &cpus));
+  CHECK_FALSE(parseCpuList("1-", &cpus));
+  CHECK_FALSE(parseCpuList("-1", &cpus));
+  CHECK_FALSE(parseCpuList("0-2x", &cpus));
+}
+
+TEST_CASE("every worker gets a node and a cpu of it") {
+  CpuTopology topology;
+  topology.detect();
+  REQUIRE(topology.numNodes() > 0);
+  for (int worker = 0; worker < 16; ++worker) {
+    auto node = topology.nodeOf(worker);
+    auto cpu = topology.cpuOf(worker);
+    bool found = false;
+    for (auto& n: topology.nodes()) {
+      if (n.id == node) {
+        found = std::find(n.cpus.begin(), n.cpus.end(), cpu) != n.cpus.end();
+      }
+    }
+    CHECK(found);
+  }
+}
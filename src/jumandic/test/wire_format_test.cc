@@ -0,0 +1,67 @@
+//
+// Created by Arseny Tolmachev on 2018/03/25.
+//
+
+#include <catch2/catch.hpp>
+#include "wire_format.h"
+#include "jumandic-svc.pb.h"
+
+using namespace jumanpp;
+using namespace jumanpp::grpc;
+
+namespace {
+
+std::string bytesOf(const ::grpc::ByteBuffer& buffer) {
+  std::vector<::grpc::Slice> slices;
+  REQUIRE(buffer.Dump(&slices).ok());
+  std::string result;
+  for (auto& s: slices) {
+    result.append(reinterpret_cast<const char*>(s.begin()), s.size());
+  }
+  return result;
+}
+
+JumanSentence sentence() {
+  JumanSentence s;
+  s.add_morphemes()->set_surface("すもも");
+  return s;
+}
+
+} // namespace
+
+TEST_CASE("the comment is written after the message body") {
+  auto wire = WireReply::forType(JumanSentence::descriptor());
+  ::grpc::ByteBuffer buffer;
+  std::string body;
+  wire.serialize(sentence(), "key", &buffer, &body);
+
+  CHECK(body == sentence().SerializeAsString());
+  auto bytes = bytesOf(buffer);
+  REQUIRE(bytes.size() > body.size());
+  CHECK(bytes.compare(0, body.size(), body) == 0);
+
+  JumanSentence withComment;
+  withComment.set_comment("key");
+  CHECK(bytes.substr(body.size()) == withComment.SerializeAsString());
+
+  JumanSentence parsed;
+  REQUIRE(parsed.ParseFromString(bytes));
+  CHECK(parsed.comment() == "key");
+  CHECK(parsed.morphemes(0).surface() == "すもも");
+}
+
+TEST_CASE("cached bodies get the comment of the request") {
+  auto wire = WireReply::forType(JumanSentence::descriptor());
+  auto body = sentence().SerializeAsString();
+  ::grpc::ByteBuffer buffer;
+
+  wire.fromBody(body, "other", &buffer);
+  JumanSentence parsed;
+  REQUIRE(parsed.ParseFromString(bytesOf(buffer)));
+  CHECK(parsed.comment() == "other");
+  CHECK(parsed.morphemes_size() == 1);
+
+  // proto3 does not write empty strings, so an empty comment adds nothing
+  wire.fromBody(body, "", &buffer);
+  CHECK(bytesOf(buffer) == body);
+}
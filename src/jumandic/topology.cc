@@ -0,0 +1,101 @@
+//
+// Created by Arseny Tolmachev on 2018/03/12.
+//
+
+#include "topology.h"
+#include <algorithm>
+#include <cctype>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <cstdlib>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace jumanpp {
+namespace grpc {
+
+bool parseCpuList(const std::string &data, std::vector<int> *cpus) {
+  std::istringstream ss{data};
+  std::string range;
+  while (std::getline(ss, range, ',')) {
+    while (!range.empty() && std::isspace(static_cast<unsigned char>(range.back()))) {
+      range.pop_back();
+    }
+    if (range.empty()) {
+      continue;
+    }
+
+    char* end = nullptr;
+    long first = std::strtol(range.c_str(), &end, 10);
+    long last = first;
+    if (*end == '-') {
+      last = std::strtol(end + 1, &end, 10);
+    }
+    if (*end != '\0' || first < 0 || last < first) {
+      return false;
+    }
+    for (long cpu = first; cpu <= last; ++cpu) {
+      cpus->push_back(static_cast<int>(cpu));
+    }
+  }
+  return true;
+}
+
+void CpuTopology::detect() {
+  nodes_.clear();
+
+  // node numbers can have gaps, so stop only after several missing ones
+  for (int id = 0, missing = 0; missing < 8; ++id) {
+    std::ifstream file{"/sys/devices/system/node/node" + std::to_string(id) + "/cpulist"};
+    if (!file) {
+      ++missing;
+      continue;
+    }
+    missing = 0;
+
+    std::string data;
+    std::getline(file, data);
+    NumaNode node;
+    node.id = id;
+    if (parseCpuList(data, &node.cpus) && !node.cpus.empty()) {
+      nodes_.push_back(node);
+    }
+  }
+
+  if (nodes_.empty()) {
+    NumaNode node;
+    int ncpus = std::max<int>(std::thread::hardware_concurrency(), 1);
+    for (int i = 0; i < ncpus; ++i) {
+      node.cpus.push_back(i);
+    }
+    nodes_.push_back(node);
+  }
+}
+
+int CpuTopology::nodeOf(int worker) const {
+  return nodes_[worker % nodes_.size()].id;
+}
+
+int CpuTopology::cpuOf(int worker) const {
+  auto& node = nodes_[worker % nodes_.size()];
+  return node.cpus[(worker / nodes_.size()) % node.cpus.size()];
+}
+
+bool pinCurrentThread(int cpu) {
+#ifdef __linux__
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+  return false;
+#endif
+}
+
+} // namespace grpc
+} // namespace jumanpp
@@ -0,0 +1,47 @@
+//
+// Created by Arseny Tolmachev on 2018/03/12.
+//
+
+#ifndef JUMANPP_GRPC_TOPOLOGY_H
+#define JUMANPP_GRPC_TOPOLOGY_H
+
+#include <string>
+#include <vector>
+#include "util/types.hpp"
+
+namespace jumanpp {
+namespace grpc {
+
+struct NumaNode {
+  int id = 0;
+  std::vector<int> cpus;
+};
+
+/**
+ * NUMA nodes and their cpus as reported by the kernel.
+ * Falls back to a single node with all cpus if the information is not available.
+ */
+class CpuTopology {
+  std::vector<NumaNode> nodes_;
+
+public:
+  void detect();
+
+  int numNodes() const { return static_cast<int>(nodes_.size()); }
+  const std::vector<NumaNode>& nodes() const { return nodes_; }
+
+  // workers are spread over nodes round robin, then over cpus of a node
+  int nodeOf(int worker) const;
+  int cpuOf(int worker) const;
+};
+
+// parses kernel cpu lists like 0-3,8,10-11
+bool parseCpuList(const std::string& data, std::vector<int>* cpus);
+
+// binds the calling thread to the cpu, returns false if it is not supported
+bool pinCurrentThread(int cpu);
+
+} // namespace grpc
+} // namespace jumanpp
+
+#endif //JUMANPP_GRPC_TOPOLOGY_H
@@ -14,104 +14,329 @@
 #include <jumandic-svc.pb.h>
 #include "interfaces.h"
 #include "service_env.h"
+#include "call_pool.h"
+#include "wire_format.h"
+#include "metrics.h"
 
 namespace jumanpp {
 namespace grpc {
 
+/**
+ * Unary call: the request is received on an io thread,
+ * handleCall is executed on a compute thread.
+ *
+ * After the request has arrived two tags are outstanding: the finish one and
+ * the AsyncNotifyWhenDone one, the call goes back to the pool when both have returned.
+ */
 template <typename Reply, typename Child>
-class BaseUnaryCall: public CallImpl {
+class BaseUnaryCall: public CallImpl, public ComputeTask {
   enum State {
     Initial,
     Compute,
     Finished
   };
 
+  struct Rpc {
+    ::grpc::ServerContext context;
+    ::grpc::ServerAsyncResponseWriter<Reply> replier{&context};
+  };
+
   std::atomic<State> state_{Initial};
+  std::atomic<int> pending_{0};
+  InPlace<Rpc> rpc_;
+  TimePoint received_;
+  // client asked for the timing trailer
+  bool tracing_ = false;
+
+  void recordTotal() {
+    auto total = Clock::now() - received_;
+    Metrics::stage(Child::Kind, Stage::Total, total);
+    trace_.add(Stage::Total, Metrics::micros(total));
+    if (tracing_) {
+      context_.AddTrailingMetadata("jumanpp-timing", trace_.format());
+    }
+    auto degraded = trace_.formatDegraded();
+    if (!degraded.empty()) {
+      context_.AddTrailingMetadata("jumanpp-degraded", degraded);
+    }
+  }
+
+  void release() {
+    if (pending_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      CallPool<Child>::instance().put(&child());
+    }
+  }
+
+  // comes back when the call is finished or cancelled by the client
+  void callDone(bool ok) {
+    if (context_.IsCancelled()) {
+      liveness_.cancelled.store(true, std::memory_order_relaxed);
+    }
+    release();
+  }
+
+  Forwarder<BaseUnaryCall, &BaseUnaryCall::callDone> doneTag_{this};
+
 protected:
 
-  ::grpc::ServerContext context_;
-  ::grpc::ServerAsyncResponseWriter<Reply> replier_{&context_};
+  // request and reply messages of the call live here, it must be declared before them
+  CallArena<4096> arena_;
+  ::grpc::ServerContext& context_ = rpc_.get().context;
+  ::grpc::ServerAsyncResponseWriter<Reply>& replier_ = rpc_.get().replier;
   JumanppGrpcEnv* env_;
-  JumanppConfig config_;
+  // interned config of the call, per request configs are merged on top of it
+  ConfigPtr config_;
+  // is filled for every call, but is sent only when the client asks for it
+  RequestTrace trace_;
+  CallLiveness liveness_;
+  // client asked for replies without names of grammar ids, calls with JUMAN output honor it
+  bool idsOnly_ = false;
+
+  // finishes the call if it was cancelled or its deadline has passed
+  bool abandoned() {
+    auto status = liveness_.check();
+    if (status.ok()) {
+      return false;
+    }
+    Metrics::abandoned(Child::Kind);
+    finishWithError(status);
+    return true;
+  }
+
+  // replies go through these two, they record the total time of the call
+  template <typename Message>
+  void finish(const Message& reply) {
+    recordTotal();
+    replier_.Finish(reply, ::grpc::Status::OK, this);
+  }
+
+  void finishWithError(const ::grpc::Status& status) {
+    Metrics::error(Child::Kind);
+    recordTotal();
+    replier_.FinishWithError(status, this);
+  }
 
 public:
+  // children which keep per request state override this and call the parent version
+  void reset() {}
 
   BaseUnaryCall(JumanppGrpcEnv* env): env_{env} {}
 
+  /**
+   * Called by the pool when the RPC is finished.
+   * Calls which needed more memory than the inline arena block are not reused.
+   */
+  bool recycle() {
+    env_->arenaCounters().record(arena_);
+    if (arena_.overflowed()) {
+      return false;
+    }
+    rpc_.destroy();
+    config_.reset();
+    trace_ = RequestTrace{};
+    child().reset();
+    return true;
+  }
+
+  void revive() {
+    rpc_.emplace();
+    liveness_.reset();
+    state_.store(Initial, std::memory_order_relaxed);
+  }
+
+  void HandleFailure() override {
+    if (state_.load(std::memory_order_acquire) == Finished) {
+      release();
+    } else {
+      // the request has not arrived, so the done tag will not come back
+      CallPool<Child>::instance().put(&child());
+    }
+  }
+
   void Handle() override {
     auto state = state_.load(std::memory_order_acquire);
     if (state == Initial) {
+      // the done tag can come back before the request handler has finished
+      pending_.store(2, std::memory_order_relaxed);
+      context_.AsyncNotifyWhenDone(&doneTag_);
       child().startCall();
       state_ = Compute;
     } else if (state == Compute) {
-      auto copy = new Child(env_);
+      auto copy = CallPool<Child>::instance().take(env_);
       copy->Handle(); //fork call
+      received_ = Clock::now();
+      Metrics::request(Child::Kind);
+      trace_.messages = 1;
+      liveness_.start(context_.deadline());
 
-      config_.CopyFrom(env_->defaultConfig());
+      config_ = env_->configs().defaultConfig();
       auto& clientMeta = context_.client_metadata();
+      tracing_ = clientMeta.find("jumanpp-timing") != clientMeta.end();
+      idsOnly_ = clientMeta.find("jumanpp-ids-only") != clientMeta.end();
       auto iter = clientMeta.find("jumanpp-config-bin");
       if (iter != clientMeta.end()) {
-        auto& data = iter->second;
-        ::google::protobuf::io::ArrayInputStream is(data.data(), data.size());
-        ::google::protobuf::io::CodedInputStream cis(&is);
-        if (!config_.MergeFromCodedStream(&cis)) {
+        config_ = env_->configs().fromHeader(iter->second);
+        if (!config_) {
           state_.store(Finished, std::memory_order_release);
-          replier_.FinishWithError(::grpc::Status{::grpc::StatusCode::INVALID_ARGUMENT, "invalid config header"}, this);
+          finishWithError(::grpc::Status{::grpc::StatusCode::INVALID_ARGUMENT, "invalid config header"});
           return;
         }
       }
 
-      child().handleCall(); //actual logic
+      // handleCall finishes the call, the finish tag can come back before it returns
       state_.store(Finished, std::memory_order_release);
+      if (!env_->compute().trySubmit(this)) {
+        finishWithError(::grpc::Status{::grpc::StatusCode::RESOURCE_EXHAUSTED, "compute queue is full"});
+      }
     } else if (state == Finished) {
-      delete this;
+      release();
+    }
+  }
+
+  void Run() override {
+    StageTimer queued{Child::Kind, &trace_, received_};
+    queued.lap(Stage::Queue);
+    // the client could have gone while the call was in the queue
+    if (abandoned()) {
+      return;
     }
+    child().handleCall(); //actual logic
   }
 
   Child& child() { return static_cast<Child&>(*this); }
 };
 
 
+/**
+ * Unary call which analyzes a single AnalysisRequest.
+ *
+ * These RPCs are raw: the request is parsed on the compute thread and
+ * the reply goes to a slice without being serialized by grpc again.
+ *
+ * Child needs to implement
+ *  Status formatOutput(CachedAnalyzer* ana) which formats the reply with an empty comment and
+ *  const Reply& reply().
+ * It can reject requests before analysis with checkRequest.
+ */
 template <typename Reply, typename Child>
-class AnaReqBasedUnaryCall: public BaseUnaryCall<Reply, Child> {
+class AnaReqBasedUnaryCall: public BaseUnaryCall<::grpc::ByteBuffer, Child> {
+  ::grpc::ByteBuffer wire_;
+
+  static const WireReply& wireFormat() {
+    static const WireReply format = WireReply::forType(Reply::descriptor());
+    return format;
+  }
+
+  bool finishFromCache(const ResultKey& key) {
+    std::string body;
+    if (!this->env_->results().lookup(key, &body)) {
+      return false;
+    }
+    wireFormat().fromBody(body, req_.key(), &wire_);
+    this->trace_.cacheHit();
+    this->finish(wire_);
+    return true;
+  }
+
 protected:
-  AnalysisRequest req_;
+  ::grpc::ByteBuffer request_;
+  AnalysisRequest& req_ = *this->arena_.template create<AnalysisRequest>();
   bool allFeatures_ = false;
+
 public:
-  explicit AnaReqBasedUnaryCall(JumanppGrpcEnv* env): BaseUnaryCall<Reply, Child>::BaseUnaryCall(env) {}
+  void reset() {
+    BaseUnaryCall<::grpc::ByteBuffer, Child>::reset();
+    request_.Clear();
+    wire_.Clear();
+    req_.Clear();
+  }
+
+  explicit AnaReqBasedUnaryCall(JumanppGrpcEnv* env): BaseUnaryCall<::grpc::ByteBuffer, Child>::BaseUnaryCall(env) {}
+
+  // children with request options hide it
+  ::grpc::Status checkRequest(const AnalysisRequest& /*req*/) const { return ::grpc::Status::OK; }
 
   void handleCall() {
-    ScopedAnalyzer ana{this->env_->analyzers(), this->config_, req_, allFeatures_};
-    if (!ana) {
-      this->replier_.FinishWithError(
-        ::grpc::Status{::grpc::StatusCode::INTERNAL, "failed to acquire analyzer"},
-        this);
+    if (!::grpc::SerializationTraits<AnalysisRequest>::Deserialize(&request_, &req_).ok()) {
+      this->finishWithError(::grpc::Status{::grpc::StatusCode::INVALID_ARGUMENT, "failed to parse the request"});
       return;
     }
 
-    Status s = ana.value()->readInput(req_, this->env_->analyzers());
+    auto budget = this->env_->budget().check(req_);
+    if (!budget.ok()) {
+      this->finishWithError(budget);
+      return;
+    }
 
+    auto valid = this->child().checkRequest(req_);
+    if (!valid.ok()) {
+      this->finishWithError(valid);
+      return;
+    }
+
+    ConfigPtr cfg = this->config_;
     if (req_.has_config()) {
-      auto& cfg = req_.config();
-      this->config_.MergeFrom(cfg);
+      cfg = this->env_->configs().merged(*cfg, req_.config());
+    }
+    auto smaller = this->env_->applyBudget(req_, *cfg, &this->trace_);
+    if (smaller) {
+      cfg = std::move(smaller);
     }
 
+    auto& results = this->env_->results();
+    bool cacheable = results.accepts(req_);
+    ResultKey resultKey;
+    if (cacheable) {
+      resultKey = ResultKey{Reply::descriptor()->full_name(), allFeatures_, cfg->config, req_, this->idsOnly_};
+      if (finishFromCache(resultKey)) {
+        return;
+      }
+    }
+
+    StageTimer timer{Child::Kind, &this->trace_};
+    AcquireStatus acquired;
+    ScopedAnalyzer ana{this->env_->analyzers(), *cfg, req_, allFeatures_, this->context_.deadline(), &acquired};
+    timer.lap(Stage::Acquire);
+    if (!ana) {
+      this->finishWithError(acquireFailure(acquired));
+      return;
+    }
+    this->trace_.analyzed(ana.value()->id(), ana.value()->source());
+    if (this->abandoned()) {
+      return;
+    }
+
+    Status s = ana.value()->readInput(req_, this->env_->analyzers());
+    timer.lap(Stage::ReadInput);
     if (!s) {
-      this->replier_.FinishWithError(
-        ::grpc::Status{::grpc::StatusCode::INVALID_ARGUMENT, s.message().str()},
-        this);
+      this->finishWithError(::grpc::Status{::grpc::StatusCode::INVALID_ARGUMENT, s.message().str()});
       return;
     }
 
     s = ana.value()->analyze();
+    timer.lap(Stage::Analyze);
     if (!s) { //failed to analyze
-      this->replier_.FinishWithError(
-        ::grpc::Status{::grpc::StatusCode::INTERNAL, s.message().str()},
-        this);
+      this->finishWithError(::grpc::Status{::grpc::StatusCode::INTERNAL, s.message().str()});
       return;
     }
 
-    static_cast<Child*>(this)->handleOutput(ana.value());
+    if (this->abandoned()) {
+      return;
+    }
+
+    s = this->child().formatOutput(ana.value());
+    if (!s) {
+      this->finishWithError(::grpc::Status{::grpc::StatusCode::INTERNAL, s.message().str()});
+      return;
+    }
+
+    std::string body;
+    wireFormat().serialize(this->child().reply(), req_.key(), &wire_, cacheable ? &body : nullptr);
+    if (cacheable) {
+      results.insert(resultKey, std::move(body));
+    }
+    timer.lap(Stage::Format);
+    this->finish(wire_);
   }
 };
 
@@ -0,0 +1,79 @@
+//
+// Created by Arseny Tolmachev on 2018/03/16.
+//
+
+#include "wire_format.h"
+#include <cstring>
+#include <grpc/slice.h>
+#include <grpc++/support/slice.h>
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/wire_format_lite.h>
+
+namespace jumanpp {
+namespace grpc {
+
+namespace {
+
+using ::google::protobuf::io::CodedOutputStream;
+using ::google::protobuf::internal::WireFormatLite;
+
+size_t commentSize(u32 tag, const std::string& comment) {
+  if (comment.empty()) { // proto3 does not write empty strings
+    return 0;
+  }
+  auto len = static_cast<u32>(comment.size());
+  return CodedOutputStream::VarintSize32(tag) + CodedOutputStream::VarintSize32(len) + comment.size();
+}
+
+u8* writeComment(u32 tag, const std::string& comment, u8* ptr) {
+  if (comment.empty()) {
+    return ptr;
+  }
+  ptr = CodedOutputStream::WriteTagToArray(tag, ptr);
+  ptr = CodedOutputStream::WriteVarint32ToArray(static_cast<u32>(comment.size()), ptr);
+  return CodedOutputStream::WriteRawToArray(comment.data(), static_cast<int>(comment.size()), ptr);
+}
+
+// the buffer takes the ownership of the slice
+void wrap(grpc_slice raw, ::grpc::ByteBuffer* out) {
+  ::grpc::Slice slice{raw, ::grpc::Slice::STEAL_REF};
+  ::grpc::ByteBuffer buffer{&slice, 1};
+  out->Swap(&buffer);
+}
+
+} // namespace
+
+WireReply::WireReply(int field)
+  : commentTag_{WireFormatLite::MakeTag(field, WireFormatLite::WIRETYPE_LENGTH_DELIMITED)} {}
+
+WireReply WireReply::forType(const ::google::protobuf::Descriptor *descr) {
+  auto field = descr->FindFieldByName("comment");
+  GOOGLE_CHECK(field != nullptr && field->type() == ::google::protobuf::FieldDescriptor::TYPE_STRING)
+    << descr->full_name() << " does not have a string comment field";
+  return WireReply{field->number()};
+}
+
+void WireReply::serialize(const ::google::protobuf::MessageLite &msg, const std::string &comment,
+                          ::grpc::ByteBuffer *out, std::string *body) const {
+  size_t bodySize = msg.ByteSizeLong();
+  grpc_slice raw = grpc_slice_malloc(bodySize + commentSize(commentTag_, comment));
+  u8* start = GRPC_SLICE_START_PTR(raw);
+  u8* ptr = msg.SerializeWithCachedSizesToArray(start);
+  if (body != nullptr) {
+    body->assign(reinterpret_cast<const char*>(start), bodySize);
+  }
+  writeComment(commentTag_, comment, ptr);
+  wrap(raw, out);
+}
+
+void WireReply::fromBody(const std::string &body, const std::string &comment, ::grpc::ByteBuffer *out) const {
+  grpc_slice raw = grpc_slice_malloc(body.size() + commentSize(commentTag_, comment));
+  u8* ptr = GRPC_SLICE_START_PTR(raw);
+  std::memcpy(ptr, body.data(), body.size());
+  writeComment(commentTag_, comment, ptr + body.size());
+  wrap(raw, out);
+}
+
+} // namespace grpc
+} // namespace jumanpp
@@ -0,0 +1,48 @@
+//
+// Created by Arseny Tolmachev on 2018/03/16.
+//
+
+#ifndef JUMANPP_GRPC_WIRE_FORMAT_H
+#define JUMANPP_GRPC_WIRE_FORMAT_H
+
+#include <string>
+#include <grpc++/support/byte_buffer.h>
+#include <google/protobuf/message.h>
+#include "util/types.hpp"
+
+namespace jumanpp {
+namespace grpc {
+
+/**
+ * Writes replies of raw methods directly into a grpc slice.
+ *
+ * Replies are formatted with an empty comment and the comment field is appended
+ * after the message body. Protobuf parsers do not care about the field order,
+ * so the body does not depend on the request key and can be shared
+ * between requests through the result cache.
+ */
+class WireReply {
+  u32 commentTag_;
+
+public:
+  // field is the number of the comment string field of the reply message
+  explicit WireReply(int field);
+
+  // uses the field named "comment" of the message type
+  static WireReply forType(const ::google::protobuf::Descriptor* descr);
+
+  /**
+   * Serializes the message and the comment into a single slice.
+   * When body is not null, it receives the serialized message without the comment.
+   */
+  void serialize(const ::google::protobuf::MessageLite& msg, const std::string& comment,
+                 ::grpc::ByteBuffer* out, std::string* body) const;
+
+  // same as serialize, but the message is already serialized
+  void fromBody(const std::string& body, const std::string& comment, ::grpc::ByteBuffer* out) const;
+};
+
+} // namespace grpc
+} // namespace jumanpp
+
+#endif //JUMANPP_GRPC_WIRE_FORMAT_H